@@ -0,0 +1,225 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Device memory arena carved into sub-buffers
+//
+//             One buffer of `capacity` bytes is created up front and handed
+//             out in slices with clCreateSubBuffer, each aligned to
+//             CL_DEVICE_MEM_BASE_ADDR_ALIGN. The slices form an offset-sorted
+//             list. A freed slice keeps its sub-buffer object, so the next
+//             allocation of a similar size gets the very same cl_mem back
+//             and creates nothing; best fit picks the smallest free slice
+//             that is large enough. Only when nothing fits are neighbouring
+//             free slices merged, which releases their cached sub-buffers.
+//             Requests beyond the capacity fail, nothing ever falls back to
+//             clCreateBuffer.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cuboid.h"
+
+//------------------------------------------------------------------------------
+
+struct arena_block {
+    size_t              offset;
+    size_t              size;
+    cl_mem              mem;    // cached sub-buffer covering the block, or NULL
+    int                 used;
+    struct arena_block *next;
+};
+
+static struct arena_block *new_block(size_t offset, size_t size, struct arena_block *next)
+{
+    struct arena_block *block = (struct arena_block*) malloc(sizeof(struct arena_block));
+    if (block == NULL)
+        return NULL;
+
+    block->offset = offset;
+    block->size   = size;
+    block->mem    = NULL;
+    block->used   = 0;
+    block->next   = next;
+
+    return block;
+}
+
+static void drop_cached(struct arena_block *block)
+{
+    if (block->mem != NULL)
+    {
+        clReleaseMemObject(block->mem);
+        block->mem = NULL;
+    }
+}
+
+// Merges runs of free blocks, returns the largest free block afterwards
+static size_t coalesce(struct device_arena *arena)
+{
+    size_t largest = 0;
+
+    for (struct arena_block *b = arena->blocks; b != NULL; b = b->next)
+    {
+        while (!b->used && b->next != NULL && !b->next->used)
+        {
+            struct arena_block *n = b->next;
+            drop_cached(b);
+            drop_cached(n);
+            b->size += n->size;
+            b->next  = n->next;
+            free(n);
+        }
+        if (!b->used && b->size > largest)
+            largest = b->size;
+    }
+
+    return largest;
+}
+
+static struct arena_block *best_fit(struct device_arena *arena, size_t size)
+{
+    struct arena_block *best = NULL;
+
+    for (struct arena_block *b = arena->blocks; b != NULL; b = b->next)
+    {
+        if (!b->used && b->size >= size && (best == NULL || b->size < best->size))
+            best = b;
+    }
+
+    return best;
+}
+
+//------------------------------------------------------------------------------
+
+cl_int arena_create(struct device_arena *arena, cl_context context, cl_device_id device_id, size_t capacity)
+{
+    cl_int  err;
+    cl_uint align_bits;
+
+    err = clGetDeviceInfo(device_id, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &align_bits, NULL);
+    if (err != CL_SUCCESS)
+        return err;
+
+    arena->align = align_bits / 8 > 0 ? align_bits / 8 : 1;
+    arena->capacity = capacity / arena->align * arena->align;
+    arena->in_use = 0;
+    arena->high_water = 0;
+    arena->created = 0;
+    arena->reused = 0;
+    arena->failed = 0;
+    arena->blocks = NULL;
+
+    arena->base = clCreateBuffer(context, CL_MEM_READ_WRITE, arena->capacity, NULL, &err);
+    if (err != CL_SUCCESS)
+        return err;
+
+    arena->blocks = new_block(0, arena->capacity, NULL);
+    if (arena->blocks == NULL)
+    {
+        clReleaseMemObject(arena->base);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    telemetry_set(TELEMETRY_POOL_CAPACITY, arena->capacity);
+    telemetry_set(TELEMETRY_POOL_IN_USE, 0);
+
+    return CL_SUCCESS;
+}
+
+cl_mem arena_alloc(struct device_arena *arena, size_t bytes, cl_int *err)
+{
+    size_t size = (bytes + arena->align - 1) / arena->align * arena->align;
+    if (size == 0)
+        size = arena->align;
+
+    struct arena_block *b = best_fit(arena, size);
+    if (b == NULL && coalesce(arena) >= size)
+        b = best_fit(arena, size);
+    if (b == NULL)
+    {
+        arena->failed++;
+        *err = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        return NULL;
+    }
+
+    // A cached sub-buffer is handed out again unless it would waste more
+    // than the request itself, then the block is split instead
+    if (b->mem != NULL && b->size > 2 * size)
+        drop_cached(b);
+
+    if (b->mem == NULL)
+    {
+        if (b->size > size)
+        {
+            struct arena_block *rest = new_block(b->offset + size, b->size - size, b->next);
+            if (rest == NULL)
+            {
+                *err = CL_OUT_OF_HOST_MEMORY;
+                return NULL;
+            }
+            b->size = size;
+            b->next = rest;
+        }
+
+        cl_buffer_region region = { b->offset, b->size };
+        b->mem = clCreateSubBuffer(arena->base, 0, CL_BUFFER_CREATE_TYPE_REGION, &region, err);
+        if (*err != CL_SUCCESS)
+        {
+            b->mem = NULL;
+            arena->failed++;
+            return NULL;
+        }
+        arena->created++;
+    }
+    else
+    {
+        arena->reused++;
+    }
+
+    b->used = 1;
+    arena->in_use += b->size;
+    if (arena->in_use > arena->high_water)
+        arena->high_water = arena->in_use;
+    telemetry_set(TELEMETRY_POOL_IN_USE, arena->in_use);
+
+    *err = CL_SUCCESS;
+    return b->mem;
+}
+
+void arena_free(struct device_arena *arena, cl_mem mem)
+{
+    if (mem == NULL)
+        return;
+
+    for (struct arena_block *b = arena->blocks; b != NULL; b = b->next)
+    {
+        if (b->used && b->mem == mem)
+        {
+            b->used = 0;
+            arena->in_use -= b->size;
+            telemetry_set(TELEMETRY_POOL_IN_USE, arena->in_use);
+            return;
+        }
+    }
+}
+
+void arena_release(struct device_arena *arena)
+{
+    struct arena_block *b = arena->blocks;
+
+    while (b != NULL)
+    {
+        struct arena_block *next = b->next;
+        drop_cached(b);
+        free(b);
+        b = next;
+    }
+    arena->blocks = NULL;
+
+    if (arena->base != NULL)
+    {
+        clReleaseMemObject(arena->base);
+        arena->base = NULL;
+    }
+}
@@ -0,0 +1,296 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Repeatable benchmark of the OpenCL and CPU paths
+//
+//             For every problem size of a doubling sweep the copy path is run
+//             `warmup` times unmeasured and then `iterations` times measured.
+//             Write, kernel and read come from profiling events, end-to-end
+//             and CPU engine times from wtime(). Sizes whose buffers do not
+//             fit on the device go through the streaming pipeline instead,
+//             which only has an end-to-end time. Each stage is reported as
+//             min / median / p95 / p99 / mean / stddev in text, CSV or JSON,
+//             to stdout or the --output file so the machine-readable formats
+//             are not mixed with the rest of the program output.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+enum { STAGE_WRITE, STAGE_KERNEL, STAGE_READ, STAGE_TOTAL, STAGE_CPU, STAGE_COUNT };
+
+static const char *stage_names[STAGE_COUNT] = { "write", "kernel", "read", "total", "cpu" };
+
+struct bench_stats {
+    double min;
+    double median;
+    double p95;
+    double p99;
+    double mean;
+    double stddev;
+};
+
+static int compare_double(const void *x, const void *y)
+{
+    double a = *(const double*) x, b = *(const double*) y;
+    return (a > b) - (a < b);
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const double *sorted, int n, double p)
+{
+    int rank = (int) ceil(p / 100.0 * n);
+    if (rank < 1)
+        rank = 1;
+    return sorted[rank - 1];
+}
+
+// Sorts samples in place
+static void compute_stats(double *samples, int n, struct bench_stats *s)
+{
+    qsort(samples, n, sizeof(double), compare_double);
+
+    double sum = 0.0;
+    for (int i = 0; i < n; i++)
+        sum += samples[i];
+    s->mean = sum / n;
+
+    double var = 0.0;
+    for (int i = 0; i < n; i++)
+        var += (samples[i] - s->mean) * (samples[i] - s->mean);
+    s->stddev = n > 1 ? sqrt(var / (n - 1)) : 0.0;
+
+    s->min    = samples[0];
+    s->median = n % 2 ? samples[n / 2] : 0.5 * (samples[n / 2 - 1] + samples[n / 2]);
+    s->p95    = percentile(samples, n, 95.0);
+    s->p99    = percentile(samples, n, 99.0);
+}
+
+static double event_seconds(cl_event event)
+{
+    cl_ulong start, end;
+
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+    clReleaseEvent(event);
+
+    return (end - start) * 1.0e-9;
+}
+
+//------------------------------------------------------------------------------
+
+// One write + kernel + read round trip on device-resident buffers
+static void copy_once(cl_command_queue commands, cl_kernel kernel, cl_mem d[4],
+                      const int *a, const int *b, const int *c, int *result, size_t length,
+                      double sample[STAGE_COUNT])
+{
+    int err;
+
+    size_t   bytes = sizeof(cl_int) * length;
+    cl_event ev[5];
+
+    cl_uint n = (cl_uint) length;
+    err = clSetKernelArg(kernel, 4, sizeof(cl_uint), &n);
+    checkError(err, "Setting benchmark element count");
+
+    double total = wtime();
+
+    err  = clEnqueueWriteBuffer(commands, d[0], CL_FALSE, 0, bytes, a, 0, NULL, &ev[0]);
+    err |= clEnqueueWriteBuffer(commands, d[1], CL_FALSE, 0, bytes, b, 0, NULL, &ev[1]);
+    err |= clEnqueueWriteBuffer(commands, d[2], CL_FALSE, 0, bytes, c, 0, NULL, &ev[2]);
+    checkError(err, "Copying benchmark inputs");
+
+    err = clEnqueueNDRangeKernel(commands, kernel, 1, NULL, &length, NULL, 0, NULL, &ev[3]);
+    checkError(err, "Enqueueing benchmark kernel");
+
+    err = clEnqueueReadBuffer(commands, d[3], CL_TRUE, 0, bytes, result, 0, NULL, &ev[4]);
+    checkError(err, "Reading benchmark result");
+
+    sample[STAGE_TOTAL]  = wtime() - total;
+    sample[STAGE_WRITE]  = event_seconds(ev[0]) + event_seconds(ev[1]) + event_seconds(ev[2]);
+    sample[STAGE_KERNEL] = event_seconds(ev[3]);
+    sample[STAGE_READ]   = event_seconds(ev[4]);
+}
+
+static void print_header(FILE *out, enum bench_format format)
+{
+    if (format == BENCH_CSV)
+        fprintf(out, "elements,bytes,path,stage,samples,min,median,p95,p99,mean,stddev\n");
+    else if (format == BENCH_JSON)
+        fprintf(out, "[\n");
+    else
+        fprintf(out, "\n%12s %12s %-7s %-7s %12s %12s %12s %12s %12s\n", "elements", "bytes", "path", "stage",
+                "min(s)", "median(s)", "p95(s)", "p99(s)", "stddev(s)");
+}
+
+static void print_row(FILE *out, enum bench_format format, int first, size_t length, const char *path,
+                      const char *stage, int n, const struct bench_stats *s)
+{
+    size_t bytes = 4 * sizeof(cl_int) * length;
+
+    if (format == BENCH_CSV)
+        fprintf(out, "%zu,%zu,%s,%s,%d,%.9e,%.9e,%.9e,%.9e,%.9e,%.9e\n", length, bytes, path, stage, n,
+                s->min, s->median, s->p95, s->p99, s->mean, s->stddev);
+    else if (format == BENCH_JSON)
+        fprintf(out, "%s  {\"elements\": %zu, \"bytes\": %zu, \"path\": \"%s\", \"stage\": \"%s\", \"samples\": %d, "
+                "\"min\": %.9e, \"median\": %.9e, \"p95\": %.9e, \"p99\": %.9e, \"mean\": %.9e, \"stddev\": %.9e}",
+                first ? "" : ",\n", length, bytes, path, stage, n,
+                s->min, s->median, s->p95, s->p99, s->mean, s->stddev);
+    else
+        fprintf(out, "%12zu %12zu %-7s %-7s %12.6lf %12.6lf %12.6lf %12.6lf %12.6lf\n", length, bytes, path, stage,
+                s->min, s->median, s->p95, s->p99, s->stddev);
+}
+
+//------------------------------------------------------------------------------
+
+void run_bench(cl_context context, cl_device_id device_id, cl_command_queue commands,
+               cl_kernel kernel_cuboid_area, const struct bench_options *bo)
+{
+    int err;
+
+    cl_ulong global_mem, max_alloc;
+    err  = clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &global_mem, NULL);
+    err |= clGetDeviceInfo(device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+    checkError(err, "Querying device memory");
+
+    // Up to twice what fits on the device, but no more than half the host
+    // memory for the three inputs and two results
+    size_t max_length = bo->max_length;
+    if (max_length == 0)
+    {
+        double host_mem = (double) sysconf(_SC_PHYS_PAGES) * (double) sysconf(_SC_PAGESIZE);
+        double device_limit = 2.0 * global_mem / (4 * sizeof(cl_int));
+        double host_limit   = host_mem / 2 / (5 * sizeof(cl_int));
+        max_length = (size_t) (device_limit < host_limit ? device_limit : host_limit);
+    }
+    size_t min_length = bo->min_length > 0 ? bo->min_length : 1024;
+
+    int*    a = (int*) cpu_alloc(max_length, sizeof(int));
+    int*    b = (int*) cpu_alloc(max_length, sizeof(int));
+    int*    c = (int*) cpu_alloc(max_length, sizeof(int));
+    int*    result = (int*) cpu_alloc(max_length, sizeof(int));
+    int*    result_cpu = (int*) cpu_alloc(max_length, sizeof(int));
+    double* samples = (double*) malloc(sizeof(double) * STAGE_COUNT * bo->iterations);
+
+    if (a == NULL || b == NULL || c == NULL || result == NULL || result_cpu == NULL || samples == NULL)
+    {
+        fprintf(stderr, "Error: Failed to allocate host memory for %zu elements!\n", max_length);
+        exit(EXIT_FAILURE);
+    }
+
+    make_inputs(a, b, c, max_length, 0, bo->generate, bo->seed);
+
+    // How this binary was built, so sweeps from different machines compare
+#if defined(__clang__)
+    const char *compiler = "clang " __clang_version__;
+#elif defined(__GNUC__)
+    const char *compiler = "gcc " __VERSION__;
+#else
+    const char *compiler = "unknown compiler";
+#endif
+#ifdef __OPTIMIZE__
+    const char *optimized = "optimized";
+#else
+    const char *optimized = "unoptimized";
+#endif
+#ifdef _OPENMP
+    const char *timer = "omp_get_wtime";
+#else
+    const char *timer = "gettimeofday";
+#endif
+    printf("Benchmark build: %s, %s, CPU engine %s on %d threads, %s timer\n",
+           compiler, optimized, cpu_isa(), cpu_threads(), timer);
+
+    print_header(bo->out, bo->format);
+
+    int    first = 1;
+    size_t crossover = 0;
+
+    for (size_t length = min_length; length <= max_length; length *= 2)
+    {
+        size_t bytes = sizeof(cl_int) * length;
+        int resident = bytes <= max_alloc && 4 * bytes <= global_mem - global_mem / 10;
+
+        cl_mem d[4] = { NULL, NULL, NULL, NULL };
+        if (resident)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                d[i] = clCreateBuffer(context, i < 3 ? CL_MEM_READ_ONLY : CL_MEM_WRITE_ONLY, bytes, NULL, &err);
+                checkError(err, "Creating benchmark buffer");
+                err = clSetKernelArg(kernel_cuboid_area, i, sizeof(cl_mem), &d[i]);
+                checkError(err, "Setting benchmark kernel arguments");
+            }
+        }
+
+        for (int it = -bo->warmup; it < bo->iterations; it++)
+        {
+            double sample[STAGE_COUNT] = { 0.0 };
+
+            if (resident)
+                copy_once(commands, kernel_cuboid_area, d, a, b, c, result, length, sample);
+            else
+                sample[STAGE_TOTAL] = run_streaming(context, device_id, kernel_cuboid_area,
+                                                    a, b, c, result, length, bo->chunk, 0);
+
+            sample[STAGE_CPU] = wtime();
+            cpu_cuboid_area(a, b, c, result_cpu, length);
+            sample[STAGE_CPU] = wtime() - sample[STAGE_CPU];
+
+            if (it >= 0)
+            {
+                for (int s = 0; s < STAGE_COUNT; s++)
+                    samples[s * bo->iterations + it] = sample[s];
+            }
+        }
+
+        if (memcmp(result, result_cpu, bytes) != 0)
+            fprintf(stderr, "Warning: OpenCL and CPU results differ at %zu elements\n", length);
+
+        const char *path = resident ? "copy" : "stream";
+        struct bench_stats st[STAGE_COUNT];
+        for (int s = 0; s < STAGE_COUNT; s++)
+        {
+            if (!resident && s != STAGE_TOTAL && s != STAGE_CPU)
+                continue;
+            compute_stats(samples + s * bo->iterations, bo->iterations, &st[s]);
+            print_row(bo->out, bo->format, first, length, s == STAGE_CPU ? "cpu" : path, stage_names[s], bo->iterations, &st[s]);
+            first = 0;
+        }
+
+        if (crossover == 0 && st[STAGE_TOTAL].median < st[STAGE_CPU].median)
+            crossover = length;
+
+        for (int i = 0; i < 4; i++)
+        {
+            if (d[i] != NULL)
+                clReleaseMemObject(d[i]);
+        }
+    }
+
+    if (bo->format == BENCH_JSON)
+        fprintf(bo->out, "\n]\n");
+    else if (bo->format == BENCH_TEXT)
+    {
+        if (crossover > 0)
+            fprintf(bo->out, "\nOpenCL end-to-end beats the CPU engine from %zu elements on\n", crossover);
+        else
+            fprintf(bo->out, "\nOpenCL end-to-end never beat the CPU engine in this sweep\n");
+    }
+    fflush(bo->out);
+
+    free(a);
+    free(b);
+    free(c);
+    free(result);
+    free(result_cpu);
+    free(samples);
+}
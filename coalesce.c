@@ -0,0 +1,298 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Coalescing front end that merges many small requests into one
+//             engine dispatch
+//
+//             Callers on any thread copy their cuboids into the staging
+//             buffer being filled and sleep until their results are back. A
+//             flusher thread dispatches the buffer as one cuboid_area batch
+//             once it holds `max_elements` cuboids or COALESCE_MAX_REQUESTS
+//             requests, or once its first request has waited `window_us`,
+//             whichever comes first, then copies each caller's slice of the
+//             result to the caller's array. That bounds the added latency
+//             by the window plus one dispatch.
+//
+//             There are two staging buffers, both pinned host memory of the
+//             engine's device: callers fill one while the other is on the
+//             device. A request larger than the space left is split over
+//             consecutive dispatches. Only the flusher thread touches the
+//             engine.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cuboid.h"
+#include "cuboid_engine.h"
+
+//------------------------------------------------------------------------------
+
+// Requests of one dispatch, so the scatter list has a fixed size
+#define COALESCE_MAX_REQUESTS 1024
+
+struct coalesce_request {
+    int    *result;     // the caller's slice
+    size_t  offset;     // first staged element of the slice
+    size_t  count;
+    cl_int *status;     // the caller's, gets the first error
+    int    *pending;    // the caller's count of slices still in flight
+};
+
+struct coalesce_stage {
+    cl_mem  mem;        // one pinned allocation for the four columns
+    int    *a;
+    int    *b;
+    int    *c;
+    int    *result;
+    size_t  used;       // staged elements
+    double  opened;     // wall time of the first staged request
+
+    struct coalesce_request request[COALESCE_MAX_REQUESTS];
+    size_t  requests;
+};
+
+struct cuboid_coalescer {
+    struct cuboid_engine *engine;
+    size_t          max_elements;
+    double          window;     // seconds
+
+    pthread_mutex_t lock;
+    pthread_cond_t  arrived;    // to the flusher: something was staged
+    pthread_cond_t  swapped;    // to callers: a fresh stage is open
+    pthread_cond_t  finished;   // to callers: a dispatch has scattered its results
+
+    struct coalesce_stage stage[2];
+    int             filling;    // stage callers copy into
+    int             stop;
+    int             running;    // the flusher thread was started
+    pthread_t       flusher;
+
+    struct cuboid_coalescer_stats stats;
+};
+
+static int stage_full(const struct cuboid_coalescer *co, const struct coalesce_stage *s)
+{
+    return s->used == co->max_elements || s->requests == COALESCE_MAX_REQUESTS;
+}
+
+static struct timespec deadline(double at)
+{
+    // wtime() and CLOCK_REALTIME differ by an offset, not a rate
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    double wait = at - wtime();
+    if (wait < 0.0)
+        wait = 0.0;
+
+    long   ns  = now.tv_nsec + (long) ((wait - (long) wait) * 1.0e9);
+    struct timespec ts;
+    ts.tv_sec  = now.tv_sec + (time_t) wait + ns / 1000000000L;
+    ts.tv_nsec = ns % 1000000000L;
+
+    return ts;
+}
+
+static void *coalesce_flusher(void *arg)
+{
+    struct cuboid_coalescer *co = (struct cuboid_coalescer*) arg;
+
+    pthread_mutex_lock(&co->lock);
+    for (;;)
+    {
+        struct coalesce_stage *s = &co->stage[co->filling];
+
+        while (!co->stop && s->used == 0)
+            pthread_cond_wait(&co->arrived, &co->lock);
+        if (s->used == 0)
+            break;
+
+        // Give later requests until the window closes to join in
+        struct timespec until = deadline(s->opened + co->window);
+        while (!co->stop && !stage_full(co, s) && wtime() < s->opened + co->window)
+            pthread_cond_timedwait(&co->arrived, &co->lock, &until);
+
+        if (stage_full(co, s))
+            co->stats.full_dispatches++;
+        co->filling ^= 1;
+        pthread_cond_broadcast(&co->swapped);
+        pthread_mutex_unlock(&co->lock);
+
+        cl_int err = cuboid_engine_submit(co->engine, s->a, s->b, s->c, s->result, s->used);
+        if (err == CL_SUCCESS)
+        {
+            for (size_t r = 0; r < s->requests; r++)
+                memcpy(s->request[r].result, s->result + s->request[r].offset,
+                       sizeof(int) * s->request[r].count);
+        }
+
+        pthread_mutex_lock(&co->lock);
+        for (size_t r = 0; r < s->requests; r++)
+        {
+            if (*s->request[r].status == CL_SUCCESS)
+                *s->request[r].status = err;
+            (*s->request[r].pending)--;
+        }
+        co->stats.dispatches++;
+        co->stats.elements += s->used;
+        s->used     = 0;
+        s->requests = 0;
+        pthread_cond_broadcast(&co->finished);
+    }
+    pthread_mutex_unlock(&co->lock);
+
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+
+struct cuboid_coalescer *cuboid_coalescer_create(struct cuboid_engine *engine, size_t max_elements,
+                                                 unsigned window_us, cl_int *err)
+{
+    cl_int status;
+    if (err == NULL)
+        err = &status;
+
+    if (max_elements == 0 || max_elements > UINT_MAX)
+    {
+        *err = CL_INVALID_VALUE;
+        return NULL;
+    }
+
+    struct cuboid_coalescer *co = (struct cuboid_coalescer*) calloc(1, sizeof(struct cuboid_coalescer));
+    if (co == NULL)
+    {
+        *err = CL_OUT_OF_HOST_MEMORY;
+        return NULL;
+    }
+
+    co->engine       = engine;
+    co->max_elements = max_elements;
+    co->window       = window_us * 1.0e-6;
+
+    *err = CL_SUCCESS;
+    for (int i = 0; i < 2 && *err == CL_SUCCESS; i++)
+    {
+        struct coalesce_stage *s = &co->stage[i];
+        int *base = (int*) cuboid_engine_host_alloc(engine, 4 * sizeof(int) * max_elements, &s->mem, err);
+        if (base == NULL)
+            break;
+        s->a      = base;
+        s->b      = base + max_elements;
+        s->c      = base + 2 * max_elements;
+        s->result = base + 3 * max_elements;
+    }
+    if (*err != CL_SUCCESS)
+    {
+        for (int i = 0; i < 2; i++)
+            cuboid_engine_host_free(engine, co->stage[i].mem, co->stage[i].a);
+        free(co);
+        return NULL;
+    }
+
+    pthread_mutex_init(&co->lock, NULL);
+    pthread_cond_init(&co->arrived, NULL);
+    pthread_cond_init(&co->swapped, NULL);
+    pthread_cond_init(&co->finished, NULL);
+
+    if (pthread_create(&co->flusher, NULL, coalesce_flusher, co) != 0)
+    {
+        *err = CL_OUT_OF_HOST_MEMORY;
+        cuboid_coalescer_destroy(co);
+        return NULL;
+    }
+    co->running = 1;
+
+    return co;
+}
+
+cl_int cuboid_coalescer_submit(struct cuboid_coalescer *co, const int *a, const int *b, const int *c,
+                               int *result, size_t length)
+{
+    cl_int status  = CL_SUCCESS;
+    int    pending = 0;
+    size_t done    = 0;
+
+    pthread_mutex_lock(&co->lock);
+    co->stats.requests++;
+
+    while (done < length)
+    {
+        struct coalesce_stage *s = &co->stage[co->filling];
+        if (stage_full(co, s))
+        {
+            // Let the flusher go and wait for the other stage to open
+            pthread_cond_signal(&co->arrived);
+            pthread_cond_wait(&co->swapped, &co->lock);
+            continue;
+        }
+
+        size_t take = length - done;
+        if (take > co->max_elements - s->used)
+            take = co->max_elements - s->used;
+
+        // A few thousand cuboids copy in microseconds, so under the lock
+        memcpy(s->a + s->used, a + done, sizeof(int) * take);
+        memcpy(s->b + s->used, b + done, sizeof(int) * take);
+        memcpy(s->c + s->used, c + done, sizeof(int) * take);
+
+        struct coalesce_request *r = &s->request[s->requests++];
+        r->result  = result + done;
+        r->offset  = s->used;
+        r->count   = take;
+        r->status  = &status;
+        r->pending = &pending;
+        pending++;
+
+        if (s->used == 0)
+            s->opened = wtime();
+        s->used += take;
+        done    += take;
+
+        pthread_cond_signal(&co->arrived);
+    }
+
+    while (pending > 0)
+        pthread_cond_wait(&co->finished, &co->lock);
+
+    pthread_mutex_unlock(&co->lock);
+
+    return status;
+}
+
+void cuboid_coalescer_stats(struct cuboid_coalescer *co, struct cuboid_coalescer_stats *stats)
+{
+    pthread_mutex_lock(&co->lock);
+    *stats = co->stats;
+    pthread_mutex_unlock(&co->lock);
+}
+
+void cuboid_coalescer_destroy(struct cuboid_coalescer *co)
+{
+    if (co == NULL)
+        return;
+
+    // The flusher dispatches whatever is still staged before it stops
+    if (co->running)
+    {
+        pthread_mutex_lock(&co->lock);
+        co->stop = 1;
+        pthread_cond_signal(&co->arrived);
+        pthread_mutex_unlock(&co->lock);
+        pthread_join(co->flusher, NULL);
+    }
+
+    for (int i = 0; i < 2; i++)
+        cuboid_engine_host_free(co->engine, co->stage[i].mem, co->stage[i].a);
+
+    pthread_mutex_destroy(&co->lock);
+    pthread_cond_destroy(&co->arrived);
+    pthread_cond_destroy(&co->swapped);
+    pthread_cond_destroy(&co->finished);
+    free(co);
+}
@@ -0,0 +1,136 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Multithreaded, vectorized CPU engine for the cuboid surface area
+//
+//             The range is split statically over all OpenMP threads and each
+//             thread runs an AVX-512, AVX2 or NEON loop when the compiler
+//             targets one of them, or a plain loop the compiler can
+//             auto-vectorize otherwise. cpu_alloc() touches the pages with
+//             the same static schedule, so on NUMA machines every page lives
+//             on the node of the thread that later computes it.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "cuboid.h"
+
+//------------------------------------------------------------------------------
+
+int cpu_threads(void)
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+const char *cpu_isa(void)
+{
+#if defined(__AVX512F__)
+    return "AVX-512";
+#elif defined(__AVX2__)
+    return "AVX2";
+#elif defined(__ARM_NEON)
+    return "NEON";
+#else
+    return "auto-vectorized";
+#endif
+}
+
+void *cpu_alloc(size_t count, size_t size)
+{
+    size_t bytes = count * size;
+    char  *ptr   = (char*) malloc(bytes);
+    if (ptr == NULL)
+        return NULL;
+
+    // First touch with the same static schedule as cpu_cuboid_area(), one
+    // write per page is enough to place it
+    const size_t page = 4096;
+    long pages = (long) ((bytes + page - 1) / page);
+
+    #pragma omp parallel for schedule(static)
+    for (long p = 0; p < pages; p++)
+        ptr[(size_t) p * page] = 0;
+
+    return ptr;
+}
+
+// One thread's share of the range
+static void cuboid_area_block(const int *restrict a, const int *restrict b, const int *restrict c,
+                              int *restrict result, size_t begin, size_t end)
+{
+    size_t i = begin;
+
+#if defined(__AVX512F__)
+    for (; i + 16 <= end; i += 16) {
+        __m512i va = _mm512_loadu_si512((const void*) (a + i));
+        __m512i vb = _mm512_loadu_si512((const void*) (b + i));
+        __m512i vc = _mm512_loadu_si512((const void*) (c + i));
+        __m512i s  = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(va, vb),
+                                                       _mm512_mullo_epi32(vb, vc)),
+                                      _mm512_mullo_epi32(va, vc));
+        _mm512_storeu_si512((void*) (result + i), _mm512_slli_epi32(s, 1));
+    }
+#elif defined(__AVX2__)
+    for (; i + 8 <= end; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i*) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*) (b + i));
+        __m256i vc = _mm256_loadu_si256((const __m256i*) (c + i));
+        __m256i s  = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(va, vb),
+                                                       _mm256_mullo_epi32(vb, vc)),
+                                      _mm256_mullo_epi32(va, vc));
+        _mm256_storeu_si256((__m256i*) (result + i), _mm256_slli_epi32(s, 1));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= end; i += 4) {
+        int32x4_t va = vld1q_s32(a + i);
+        int32x4_t vb = vld1q_s32(b + i);
+        int32x4_t vc = vld1q_s32(c + i);
+        int32x4_t s  = vmlaq_s32(vmlaq_s32(vmulq_s32(va, vb), vb, vc), va, vc);
+        vst1q_s32(result + i, vshlq_n_s32(s, 1));
+    }
+#endif
+
+    // Remainder, or the whole block when no intrinsics are available
+    #pragma omp simd
+    for (size_t j = i; j < end; j++)
+        result[j] = 2 * ((a[j] * b[j]) + (b[j] * c[j]) + (a[j] * c[j]));
+}
+
+void cpu_cuboid_area_range(const int *a, const int *b, const int *c, int *result, size_t begin, size_t end)
+{
+    cuboid_area_block(a, b, c, result, begin, end);
+}
+
+void cpu_cuboid_area(const int *a, const int *b, const int *c, int *result, size_t length)
+{
+    #pragma omp parallel
+    {
+#ifdef _OPENMP
+        size_t nthreads = (size_t) omp_get_num_threads();
+        size_t tid      = (size_t) omp_get_thread_num();
+#else
+        size_t nthreads = 1;
+        size_t tid      = 0;
+#endif
+        // Contiguous static blocks, matching the first-touch in cpu_alloc()
+        size_t begin = length * tid / nthreads;
+        size_t end   = length * (tid + 1) / nthreads;
+
+        cuboid_area_block(a, b, c, result, begin, end);
+    }
+}
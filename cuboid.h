@@ -0,0 +1,781 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+// Purpose:    Declarations shared by the cuboid-opencl translation units
+//
+//------------------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdio.h>
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+extern double wtime(void);       // returns time since some fixed past point (wtime.c)
+
+extern const char *OpenCL_code;  // kernel source (kernels.c)
+
+struct build_info {
+    int    cache_hit;   // loaded from the binary cache
+    double build_time;  // seconds spent creating and building the program
+};
+
+// Builds OpenCL_code for device_id, from the on-disk binary cache when
+// possible. Prints the build log and exits on failure (program.c). info may
+// be NULL.
+cl_program build_program(cl_context context, cl_device_id device_id, struct build_info *info);
+
+// Same with clBuildProgram options, which are part of the cache key
+cl_program build_program_options(cl_context context, cl_device_id device_id, const char *options,
+                                 struct build_info *info);
+
+// For library callers: the same build, but a failure prints the build log
+// to stderr and returns NULL with the OpenCL error in err instead of exiting
+cl_program build_program_err(cl_context context, cl_device_id device_id, const char *options,
+                             struct build_info *info, cl_int *err);
+
+// Path of a per-device file with the given suffix in the cache directory,
+// keyed by device name and driver version. Returns -1 when caching is
+// disabled.
+int cache_device_path(cl_device_id device_id, const char *suffix, char *path, size_t size);
+
+//------------------------------------------------------------------------------
+//
+// Streaming pipeline (stream.c)
+//
+// Splits the input into chunks of `chunk` elements and keeps STREAM_DEPTH
+// chunks in flight, so the upload of chunk N+1, the kernel on chunk N and
+// the download of chunk N-1 overlap on separate command queues.
+//
+//------------------------------------------------------------------------------
+
+#define STREAM_DEPTH 3
+
+// Runs kernel_cuboid_area over `length` elements of a/b/c into result.
+// Returns the wall time of the whole pipeline (transfers included). With
+// `pinned` every slot also owns a pinned host staging set (pinned.c): the
+// chunk is copied into it and transferred from there, and the result comes
+// back through it.
+double run_streaming(cl_context context, cl_device_id device_id, cl_kernel kernel_cuboid_area,
+                     const int *a, const int *b, const int *c, int *result,
+                     size_t length, size_t chunk, int pinned);
+
+//------------------------------------------------------------------------------
+//
+// Zero-copy buffers (zerocopy.c)
+//
+// The four buffers are allocated with CL_MEM_ALLOC_HOST_PTR. After
+// zero_copy_create() the inputs are mapped for writing at a/b/c; after
+// zero_copy_run() the result is mapped for reading at `result` and the
+// inputs are mapped for reading again.
+//
+//------------------------------------------------------------------------------
+
+struct zero_copy {
+    size_t length;
+
+    cl_mem d_a;
+    cl_mem d_b;
+    cl_mem d_c;
+    cl_mem d_result;
+
+    int   *a;
+    int   *b;
+    int   *c;
+    int   *result;
+};
+
+void zero_copy_create(cl_context context, cl_command_queue commands,
+                      struct zero_copy *zc, size_t length);
+
+// Returns the time from handing the inputs to the device until the results
+// are readable on the host, the kernel alone is returned in kernel_time.
+double zero_copy_run(cl_command_queue commands, cl_kernel kernel_cuboid_area,
+                     struct zero_copy *zc, double *kernel_time);
+
+void zero_copy_release(cl_command_queue commands, struct zero_copy *zc);
+
+//------------------------------------------------------------------------------
+//
+// Packed input layout (layout.c)
+//
+// One cl_int4 {a, b, c, 0} per cuboid, consumed by cuboid_area_packed.
+//
+//------------------------------------------------------------------------------
+
+void pack_cuboids(const int *a, const int *b, const int *c, cl_int4 *packed, size_t length);
+
+// Same contract as the copy path: returns the kernel time, the time
+// including both transfers is returned in total_time.
+double run_packed(cl_context context, cl_command_queue commands, cl_kernel kernel_packed,
+                  const cl_int4 *packed, int *result, size_t length, double *total_time);
+
+//------------------------------------------------------------------------------
+//
+// Narrow element types (narrow.c)
+//
+// Dimensions stored as 8 or 16-bit values, results as 64-bit values.
+//
+//------------------------------------------------------------------------------
+
+enum elem_type {
+    ELEM_INT,           // cl_int inputs, cl_int results (cuboid_area)
+    ELEM_USHORT,        // cl_ushort inputs, cl_ulong results
+    ELEM_UCHAR          // cl_uchar inputs, cl_ulong results
+};
+
+size_t      elem_size(enum elem_type type);
+const char *elem_name(enum elem_type type);
+
+// Generates `length` cuboids of the given type with make_inputs(), runs the
+// matching kernel on the copy path and checks every result against a
+// sequential loop. Returns the number of mismatching results.
+size_t run_narrow(cl_context context, cl_command_queue commands, cl_program program,
+                  enum elem_type type, size_t length, int generate, cl_ulong seed);
+
+//------------------------------------------------------------------------------
+//
+// CPU engine (cpu.c)
+//
+//------------------------------------------------------------------------------
+
+int         cpu_threads(void);
+const char *cpu_isa(void);
+
+// malloc() whose pages are first touched by the threads that will process
+// them in cpu_cuboid_area(). Release with free().
+void *cpu_alloc(size_t count, size_t size);
+
+void cpu_cuboid_area(const int *a, const int *b, const int *c, int *result, size_t length);
+
+// Elements [begin, end) on the calling thread only, for callers that bring
+// their own threads
+void cpu_cuboid_area_range(const int *a, const int *b, const int *c, int *result, size_t begin, size_t end);
+
+//------------------------------------------------------------------------------
+//
+// Multi-device work splitting (multi.c)
+//
+//------------------------------------------------------------------------------
+
+struct multi_device {
+    cl_device_id     device_id;
+    char             name[128];
+
+    cl_context       context;
+    cl_command_queue commands;
+    cl_program       program;
+    cl_kernel        kernel;
+
+    cl_mem           d_a;
+    cl_mem           d_b;
+    cl_mem           d_c;
+    cl_mem           d_result;
+
+    size_t           chunks;     // chunks processed in the last run
+    size_t           elements;   // elements processed in the last run
+    double           busy_time;  // seconds spent on them
+};
+
+// Sets up every device of every platform. Returns the number of devices,
+// the array is released with multi_release().
+int multi_discover(struct multi_device **devices);
+
+// Processes `length` elements with all devices pulling `chunk`-sized pieces
+// from a shared work counter. Returns the wall time.
+double run_multi(struct multi_device *devices, int count,
+                 const int *a, const int *b, const int *c, int *result,
+                 size_t length, size_t chunk);
+
+void multi_report(const struct multi_device *devices, int count, size_t length);
+void multi_release(struct multi_device *devices, int count);
+
+//------------------------------------------------------------------------------
+//
+// Event profiling (profile.c)
+//
+//------------------------------------------------------------------------------
+
+#define PROFILE_MAX_STAGES 16
+
+#define PROFILE_WRITE    "write"
+#define PROFILE_KERNEL   "kernel"
+#define PROFILE_READ     "read"
+#define PROFILE_GENERATE "generate"
+
+struct profile_stage {
+    const char *name;
+    size_t      bytes;      // bytes moved by a transfer, or touched by a kernel
+    cl_ulong    queued;
+    cl_ulong    submit;
+    cl_ulong    start;
+    cl_ulong    end;
+};
+
+struct profile {
+    int                  count;
+    struct profile_stage stage[PROFILE_MAX_STAGES];
+};
+
+void profile_init(struct profile *prof);
+
+// Waits for event, records its timestamps under `name` and releases it
+void profile_add(struct profile *prof, cl_event event, const char *name, size_t bytes);
+
+// Total START..END time of all stages called `name`
+double profile_seconds(const struct profile *prof, const char *name);
+
+// peak_gbps <= 0 when the device peak bandwidth is unknown
+void profile_report(const struct profile *prof, double wall_time, double peak_gbps);
+
+//------------------------------------------------------------------------------
+//
+// Benchmark harness (bench.c)
+//
+//------------------------------------------------------------------------------
+
+enum bench_format {
+    BENCH_TEXT,
+    BENCH_CSV,
+    BENCH_JSON
+};
+
+struct bench_options {
+    int    warmup;          // unmeasured runs per size
+    int    iterations;      // measured runs per size
+    size_t min_length;      // first size of the sweep, 0 for the default
+    size_t max_length;      // last size of the sweep, 0 for past device memory
+    size_t chunk;           // streaming chunk for sizes that do not fit
+    enum bench_format format;
+    FILE  *out;             // where the results go
+    int    generate;        // inputs from cpu_generate() with seed (rng.c)
+    cl_ulong seed;
+};
+
+// Sweeps the problem size in powers of two and prints per-stage statistics
+// for the OpenCL path and the CPU engine to bo->out
+void run_bench(cl_context context, cl_device_id device_id, cl_command_queue commands,
+               cl_kernel kernel_cuboid_area, const struct bench_options *bo);
+
+//------------------------------------------------------------------------------
+//
+// Launch configuration and auto-tuner (tune.c)
+//
+// The copy path is launched with `local` work-items per work-group (0 lets
+// the runtime choose) and `items` cuboids per work-item; items > 1 selects
+// cuboid_area_items. The tuner stores the fastest combination per device in
+// the cache directory.
+//
+//------------------------------------------------------------------------------
+
+struct launch_config {
+    size_t  local;          // work-group size, 0 for the runtime's choice
+    cl_uint items;          // cuboids per work-item, at least 1
+};
+
+// NDRange size for `work_items` work-items, rounded up to a multiple of the
+// work-group size. The kernels skip the work-items past the end.
+size_t launch_global(const struct launch_config *lc, size_t work_items);
+
+// Loads the tuned configuration of device_id. Returns 0 on success, -1 when
+// the device has not been tuned or caching is disabled.
+int tune_load(cl_device_id device_id, struct launch_config *lc);
+
+// Times cuboid_area_items over `length` elements for every candidate
+// configuration, prints the results, saves the fastest for the device and
+// returns it in best. commands must have profiling enabled.
+void tune_run(cl_context context, cl_device_id device_id, cl_command_queue commands,
+              cl_program program, size_t length, struct launch_config *best);
+
+//------------------------------------------------------------------------------
+//
+// Fused metrics (metrics.c)
+//
+// cuboid_metrics computes any combination of volume, surface area and space
+// diagonal from one read of the inputs. The bits are shared with the kernel.
+//
+//------------------------------------------------------------------------------
+
+enum metric {
+    METRIC_VOLUME   = 1,
+    METRIC_AREA     = 2,
+    METRIC_DIAGONAL = 4,
+    METRIC_ALL      = 7
+};
+
+// Parses a comma separated list of volume, area, diagonal or all. Returns 0
+// for an unknown name.
+unsigned metric_mask(const char *list);
+
+// Generates `length` cuboids with make_inputs(), runs cuboid_metrics for the
+// metrics in mask, times it against one pass per metric and checks every
+// output against a sequential loop. Returns the number of mismatching values.
+size_t run_metrics(cl_context context, cl_command_queue commands, cl_program program,
+                   unsigned mask, size_t length, const struct launch_config *lc,
+                   int generate, cl_ulong seed);
+
+//------------------------------------------------------------------------------
+//
+// On-device aggregation (reduce.c)
+//
+// Sum, minimum and maximum of the surface areas and a histogram of the
+// volumes, reduced on the device so only per-work-group partials and the
+// histogram are read back.
+//
+//------------------------------------------------------------------------------
+
+// Generates `length` cuboids with make_inputs() and aggregates them, fused with the area
+// computation or over a cuboid_area result kept on the device. The last of
+// `bins` histogram bins of `bin_width` takes every larger volume. Returns
+// the number of aggregates that differ from a sequential loop.
+size_t run_aggregate(cl_context context, cl_device_id device_id, cl_command_queue commands,
+                     cl_program program, size_t length, int fused, cl_uint bins, cl_uint bin_width,
+                     int generate, cl_ulong seed);
+
+//------------------------------------------------------------------------------
+//
+// Counter-based input generator (rng.c)
+//
+// Philox4x32-10 keyed by a seed: element `first + i` always gets the same
+// values, on the host or on the device (cuboid_generate).
+//
+//------------------------------------------------------------------------------
+
+// Fills a/b/c with elements first .. first + length - 1 on all CPU threads
+void cpu_generate(int *a, int *b, int *c, size_t length, size_t first, cl_ulong seed);
+
+// The default inputs: rand() values 1..9 after srand(1), the same data on
+// every run. Elements first .. first + length - 1 of that sequence; rand()
+// has no random access, so every range after first == 0 must follow the
+// previous one.
+void fill_inputs(int *a, int *b, int *c, size_t length, size_t first);
+
+// cpu_generate() with `seed` when `generate` is set, fill_inputs() on one
+// thread otherwise. Returns the wall time.
+double make_inputs(int *a, int *b, int *c, size_t length, size_t first, int generate, cl_ulong seed);
+
+// Fills device buffers with the same elements using kernel_generate.
+// Returns the wall time; event, if not NULL, receives the kernel's event.
+double device_generate(cl_command_queue commands, cl_kernel kernel_generate,
+                       cl_mem d_a, cl_mem d_b, cl_mem d_c, size_t length, size_t first,
+                       cl_ulong seed, cl_event *event);
+
+//------------------------------------------------------------------------------
+//
+// Device memory arena (arena.c)
+//
+// One large buffer handed out as aligned sub-buffers. Freed slices keep
+// their sub-buffer for the next allocation of a similar size, so a repeated
+// allocation pattern creates no OpenCL objects at all.
+//
+//------------------------------------------------------------------------------
+
+struct arena_block;
+
+struct device_arena {
+    cl_mem  base;
+    size_t  capacity;       // bytes of the base buffer
+    size_t  align;          // slice alignment in bytes
+    size_t  in_use;         // bytes in allocated slices
+    size_t  high_water;     // largest in_use so far
+    size_t  created;        // sub-buffers created
+    size_t  reused;         // allocations served by a cached sub-buffer
+    size_t  failed;         // allocations that did not fit
+    struct arena_block *blocks;
+};
+
+// Creates the base buffer of `capacity` bytes. Returns CL_SUCCESS or the
+// OpenCL error.
+cl_int arena_create(struct device_arena *arena, cl_context context, cl_device_id device_id, size_t capacity);
+
+// A read-write slice of at least `bytes`, or NULL with the error in err
+// (CL_MEM_OBJECT_ALLOCATION_FAILURE when the arena is full). The slice
+// belongs to the arena: give it back with arena_free(), never release it.
+cl_mem arena_alloc(struct device_arena *arena, size_t bytes, cl_int *err);
+
+void arena_free(struct device_arena *arena, cl_mem mem);
+
+// Releases every sub-buffer and the base buffer
+void arena_release(struct device_arena *arena);
+
+//------------------------------------------------------------------------------
+//
+// Cuboid dataset files (dataset.c)
+//
+//------------------------------------------------------------------------------
+
+#define DATASET_VERSION     1
+#define DATASET_HEADER_SIZE 64
+#define DATASET_COLUMNAR    0   // a, b, c and result columns back to back
+#define DATASET_HAS_RESULT  1   // flag: the result column is filled in
+
+struct dataset_header {
+    char     magic[8];      // "CUBOIDS\0"
+    cl_uint  version;       // DATASET_VERSION
+    cl_uint  byte_order;    // 0x01020304 as the writing host stored it
+    cl_uint  elem_type;     // enum elem_type of every column
+    cl_uint  elem_size;     // bytes per element
+    cl_uint  layout;        // DATASET_COLUMNAR
+    cl_uint  flags;         // DATASET_HAS_RESULT
+    cl_ulong count;         // cuboids
+    char     reserved[DATASET_HEADER_SIZE - 40];
+};
+
+struct dataset {
+    void   *map;
+    size_t  bytes;
+    int     writable;
+    struct dataset_header *header;
+    int    *a;              // columns inside the mapping
+    int    *b;
+    int    *c;
+    int    *result;
+};
+
+// Maps an existing dataset, read-write if `writable` so the result can be
+// stored in place. Returns 0, or -1 after printing why the file is unusable.
+int  dataset_open(const char *path, int writable, struct dataset *ds);
+
+// Creates (or truncates) a dataset of `count` cuboids and maps it
+// read-write; the columns are left for the caller to fill
+int  dataset_create(const char *path, cl_ulong count, struct dataset *ds);
+
+// Marks the result column valid and flushes the mapping to the file
+int  dataset_finish(struct dataset *ds);
+
+// Non-zero if both paths exist and name the same file
+int  dataset_same_file(const char *path, const char *other);
+
+void dataset_close(struct dataset *ds);
+
+//------------------------------------------------------------------------------
+//
+// Stream filter (filter.c)
+//
+//------------------------------------------------------------------------------
+
+// Moves stdout to a new descriptor for the binary results and points
+// stdout at stderr, so every report line stays out of the data stream
+int    filter_claim_stdout(void);
+
+// Reads {a, b, c} records from in_fd until the end of the input and writes
+// their surface areas to out_fd, `frame` records at a time. Returns the
+// number of records, or (size_t) -1 after an I/O error; the elapsed time is
+// returned in filter_time.
+size_t run_filter(cl_context context, cl_command_queue commands, cl_kernel kernel_cuboid_area,
+                  int in_fd, int out_fd, size_t frame, double *filter_time);
+
+//------------------------------------------------------------------------------
+//
+// Verification (verify.c)
+//
+//------------------------------------------------------------------------------
+
+enum verify_mode {
+    VERIFY_NONE,
+    VERIFY_FULL,        // every element, in parallel
+    VERIFY_SAMPLE,      // a random sample of the elements
+    VERIFY_CHECKSUM     // one order-independent hash per side
+};
+
+#define VERIFY_FIRST 8  // differing indices kept for the report
+
+struct verify_report {
+    enum verify_mode mode;
+    size_t   checked;       // elements compared or hashed
+    size_t   mismatches;    // differing elements, 1 for a differing checksum
+    size_t   first[VERIFY_FIRST]; // lowest differing indices seen, sorted
+    size_t   shown;         // valid entries of first
+    cl_ulong expected;      // checksum mode: hash of the expected areas
+    cl_ulong actual;        //                hash of the result
+    int      on_device;     //                actual was hashed by cuboid_checksum
+};
+
+void     verify_full(const int *a, const int *b, const int *c, const int *result, size_t length,
+                     struct verify_report *report);
+void     verify_sample(const int *a, const int *b, const int *c, const int *result, size_t length,
+                       size_t samples, cl_ulong seed, struct verify_report *report);
+
+// Compares `actual`, a checksum of the result, with the one of the areas
+// expected from the inputs
+void     verify_checksum(const int *a, const int *b, const int *c, size_t length,
+                         cl_ulong actual, int on_device, struct verify_report *report);
+cl_ulong host_checksum(const int *result, size_t length);
+
+// `mode` over a result on the host, hashing it on the host for checksums
+void     verify_result(enum verify_mode mode, const int *a, const int *b, const int *c, const int *result,
+                       size_t length, size_t samples, struct verify_report *report);
+
+// Checks a result one range at a time, for results that are never whole on
+// the host: verify_range() adds `count` results of the elements from
+// `offset` on, `samples` of them in sample mode. Full and sample modes only.
+void     verify_begin(struct verify_report *report, enum verify_mode mode);
+void     verify_range(const int *a, const int *b, const int *c, const int *result, size_t offset,
+                      size_t count, size_t samples, struct verify_report *report);
+
+// Prints the outcome for `what`, returns the number of mismatches
+size_t   verify_print(const struct verify_report *report, const char *what);
+
+// Checksum of a result still in device memory, with the cuboid_checksum kernel
+cl_ulong device_checksum(cl_command_queue commands, cl_kernel kernel_checksum, cl_mem d_result, size_t length);
+
+//------------------------------------------------------------------------------
+//
+// Specialized program builds (spec.c)
+//
+//------------------------------------------------------------------------------
+
+struct kernel_variant {
+    cl_uint  width;     // cuboids per vector load of cuboid_area_spec: 1, 4, 8 or 16
+    cl_uint  items;     // vectors per work-item
+    unsigned metrics;   // metric mask baked into cuboid_metrics, 0 to keep the argument
+    int      fast_math; // -cl-mad-enable -cl-fast-relaxed-math
+};
+
+// Picks the variant for the device's capabilities
+void       variant_select(cl_device_id device_id, unsigned metrics, int fast_math, struct kernel_variant *variant);
+
+// The -D defines and options of the variant
+void       variant_options(const struct kernel_variant *variant, char *options, size_t size);
+
+// build_program() with the variant's options; cuboid_area_spec only exists
+// in such a program
+cl_program build_variant(cl_context context, cl_device_id device_id, const struct kernel_variant *variant,
+                         struct build_info *info);
+
+//------------------------------------------------------------------------------
+//
+// Hybrid CPU + OpenCL co-execution (hybrid.c)
+//
+//------------------------------------------------------------------------------
+
+struct hybrid_stats {
+    size_t gpu_chunks;
+    size_t gpu_elements;
+    double gpu_busy_time;   // seconds the feeding thread spent on its chunks
+
+    int    cpu_workers;
+    size_t cpu_chunks;
+    size_t cpu_elements;
+    double cpu_busy_time;   // seconds summed over the CPU workers
+};
+
+// Processes `length` elements on the device, in pieces of up to gpu_chunk,
+// and on cpu_workers CPU threads at once, every side claiming its next piece
+// from one atomic work counter. Returns the wall time.
+double run_hybrid(cl_context context, cl_command_queue commands, cl_kernel kernel_cuboid_area,
+                  const int *a, const int *b, const int *c, int *result,
+                  size_t length, size_t gpu_chunk, int cpu_workers, struct hybrid_stats *stats);
+
+void hybrid_report(const struct hybrid_stats *stats, size_t length, double hybrid_time);
+
+//------------------------------------------------------------------------------
+//
+// Task graph execution (graph.c)
+//
+//------------------------------------------------------------------------------
+
+struct graph_stats {
+    size_t nodes;           // writes, kernels and reads enqueued
+    int    out_of_order;    // one out-of-order queue, or one in-order queue per node kind
+    double transfer_time;   // device seconds of the writes and reads, summed
+    double kernel_time;     // device seconds of the kernels, summed
+    double device_span;     // first start to last end on the device
+};
+
+// Streams `length` elements through the device `chunk` at a time, every
+// command ordered only by the events it really depends on. Returns the wall
+// time.
+double run_graph(cl_context context, cl_device_id device_id, cl_kernel kernel_cuboid_area,
+                 const int *a, const int *b, const int *c, int *result,
+                 size_t length, size_t chunk, struct graph_stats *stats);
+
+//------------------------------------------------------------------------------
+//
+// Telemetry (telemetry.c)
+//
+// Lock-free process-wide counters and stage latency histograms for
+// monitoring, safe to update from any thread.
+//
+//------------------------------------------------------------------------------
+
+#define TELEMETRY_BUCKETS 24    // power-of-two latency buckets from 1 us to 8 s
+
+enum telemetry_counter {
+    TELEMETRY_BYTES_TO_DEVICE,
+    TELEMETRY_BYTES_FROM_DEVICE,
+    TELEMETRY_ELEMENTS,
+    TELEMETRY_KERNELS,
+    TELEMETRY_CACHE_HITS,
+    TELEMETRY_CACHE_MISSES,
+    TELEMETRY_DEVICE_ERRORS,
+    TELEMETRY_POOL_IN_USE,      // gauges, set rather than added to
+    TELEMETRY_POOL_CAPACITY,
+    TELEMETRY_COUNTERS
+};
+
+enum telemetry_stage {
+    TELEMETRY_WRITE,            // one host-to-device transfer
+    TELEMETRY_KERNEL,
+    TELEMETRY_READ,             // one device-to-host transfer
+    TELEMETRY_GENERATE,
+    TELEMETRY_CHUNK,            // one chunk or frame through the device, start to end
+    TELEMETRY_BATCH,            // one engine submit
+    TELEMETRY_STAGES
+};
+
+enum telemetry_format {
+    TELEMETRY_PROMETHEUS,
+    TELEMETRY_JSON
+};
+
+void telemetry_add(enum telemetry_counter counter, cl_ulong value);
+void telemetry_set(enum telemetry_counter counter, cl_ulong value);
+void telemetry_observe(enum telemetry_stage stage, double seconds);
+void telemetry_observe_ns(enum telemetry_stage stage, cl_ulong ns);
+
+// Counts err as a device error unless it is CL_SUCCESS
+void telemetry_error(cl_int err);
+
+// One snapshot of every counter and histogram
+void telemetry_write(FILE *out, enum telemetry_format format);
+
+// Exports a snapshot to path ("-" for stdout) every interval_ms, if not 0,
+// and when the process exits
+void telemetry_start(const char *path, enum telemetry_format format, unsigned interval_ms);
+
+//------------------------------------------------------------------------------
+//
+// Device probing and engine planning (probe.c)
+//
+//------------------------------------------------------------------------------
+
+#define PROBE_MAX_DEVICES 16
+
+struct device_probe {
+    cl_platform_id platform;
+    cl_device_id   device_id;
+    char           name[128];
+    cl_device_type type;
+    cl_uint        compute_units;
+    cl_ulong       global_mem;      // bytes
+    cl_ulong       max_alloc;       // bytes of the largest buffer
+    cl_bool        unified_memory;  // device memory is host memory
+    cl_uint        vector_int;      // preferred int vector width
+    int            version_major;   // OpenCL version of the device
+    int            version_minor;
+    int            subgroups;       // cl_khr_subgroups or OpenCL 2.1
+    double         bandwidth;       // measured host-to-device GB/s, 0 if unusable
+    double         latency;         // seconds of a minimal blocking round trip
+};
+
+enum plan_engine {
+    PLAN_HOST,          // the CPU engine, no device at all
+    PLAN_COPY,
+    PLAN_ZERO_COPY,
+    PLAN_STREAM
+};
+
+struct engine_plan {
+    enum plan_engine engine;
+    int    device;          // index into the probes, -1 for PLAN_HOST
+    size_t chunk;           // PLAN_STREAM elements per chunk
+    int    vector;          // cuboids per work-item of the copy path
+    double estimate;        // seconds expected for the chosen engine
+    double host_estimate;   // seconds expected on the CPU engine
+};
+
+// Probes up to `max` devices of every platform, bandwidth included.
+// Returns the number probed.
+int  probe_devices(struct device_probe *probes, int max);
+void probe_report(const struct device_probe *probes, int count);
+
+// Picks the cheapest engine for `length` cuboids over the probed devices
+// and the host
+void plan_engine(const struct device_probe *probes, int count, size_t length, struct engine_plan *plan);
+const char *plan_name(enum plan_engine engine);
+
+//------------------------------------------------------------------------------
+//
+// Pinned host staging memory (pinned.c)
+//
+// A CL_MEM_ALLOC_HOST_PTR buffer mapped on `commands` for its whole
+// lifetime, so transfers from and to `ptr` skip the driver's bounce copy.
+//
+//------------------------------------------------------------------------------
+
+struct pinned_buffer {
+    cl_mem           mem;
+    cl_command_queue commands;  // the buffer is mapped and unmapped on it
+    void            *ptr;
+    size_t           bytes;
+};
+
+// Exits on failure
+void *pinned_alloc(cl_context context, cl_command_queue commands, size_t bytes, struct pinned_buffer *pb);
+void  pinned_free(struct pinned_buffer *pb);
+
+// Best host-to-device bandwidth in GB/s of a `bytes` write from calloc()
+// memory and from pinned memory
+void pinned_bandwidth(cl_context context, cl_device_id device_id, size_t bytes,
+                      double *pageable, double *pinned);
+
+//------------------------------------------------------------------------------
+//
+// Grid-stride launch (stride.c)
+//
+// cuboid_area_stride loops over the range with 64-bit indices, so one
+// NDRange sized to the device covers any `length` its buffers can hold.
+//
+//------------------------------------------------------------------------------
+
+struct stride_report {
+    cl_uint compute_units;
+    size_t  groups;         // work-groups of the grid-stride launch
+    size_t  local;          // work-items per work-group
+    size_t  global;
+    double  stride_time;    // best profiled grid-stride kernel
+    double  item_time;      // best cuboid_area kernel, one work-item per cuboid,
+                            // 0 when `length` exceeds its 32-bit index
+};
+
+// Copies the inputs to the device, runs cuboid_area_stride once and reads
+// the result back, then times both kernels on the same buffers. `local` 0
+// picks the work-group size. Returns the kernel time, the time including
+// both transfers is returned in total_time. commands must have profiling
+// enabled.
+double run_stride(cl_context context, cl_device_id device_id, cl_command_queue commands, cl_program program,
+                  const int *a, const int *b, const int *c, int *result, size_t length, size_t local,
+                  struct stride_report *report, double *total_time);
+
+//------------------------------------------------------------------------------
+//
+// Memory-lean copy path (lean.c)
+//
+// Three device buffers instead of four, the result written over d_c, and
+// the result read back LEAN_CHUNK elements at a time over the host c array
+// while the pages of a and b are given back.
+//
+//------------------------------------------------------------------------------
+
+#define LEAN_CHUNK (1024 * 1024)
+
+struct lean_stats {
+    cl_ulong device_bytes;  // allocated on the device by the lean path
+    cl_ulong copy_bytes;    // the regular copy path would allocate
+    size_t   released;      // host bytes of a and b given back while reading
+};
+
+// Peak resident set size of the process in bytes, 0 if unknown
+size_t peak_rss(void);
+
+// Runs cuboid_area (cuboid_area_items for lc->items > 1) with the result
+// written over c, checking it chunk by chunk in `mode`; a and b are empty
+// afterwards. Returns the kernel time, the time including the transfers
+// and the check in total_time.
+double run_lean(cl_context context, cl_command_queue commands, cl_program program,
+                int *a, int *b, int *c, size_t length, const struct launch_config *lc,
+                enum verify_mode mode, size_t samples, struct verify_report *report,
+                struct lean_stats *stats, double *total_time);
@@ -0,0 +1,159 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+// Purpose:    Public API of the reusable cuboid engine (engine.c)
+//
+//             An engine owns a context, a command queue, the built program,
+//             the cuboid_area kernel and CUBOID_ENGINE_SLOTS sets of device
+//             buffers, all of which live until cuboid_engine_destroy().
+//             Every submit reuses them; a set is only reallocated, as slices
+//             of one device arena, when a batch is larger than any batch it
+//             carried before. Up to CUBOID_ENGINE_SLOTS asynchronous batches
+//             can be in flight.
+//
+//             An engine must not be used from several threads at once.
+//
+//------------------------------------------------------------------------------
+
+#include <stddef.h>
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#define CUBOID_ENGINE_SLOTS 4
+
+struct cuboid_engine;
+struct cuboid_batch;
+
+// Called once per asynchronous batch from an OpenCL runtime thread, with
+// CL_COMPLETE or the negative error that terminated the batch. It must not
+// call back into the engine.
+typedef void (*cuboid_batch_callback)(cl_int status, void *user_data);
+
+struct cuboid_engine_stats {
+    size_t   batches;       // successfully submitted batches
+    size_t   elements;      // cuboids over all batches
+    size_t   capacity;      // elements of the largest buffer set
+    size_t   reallocations; // times a buffer set had to grow
+    double   setup_time;    // seconds spent in cuboid_engine_create()
+    double   busy_time;     // seconds the host spent in submit calls
+
+    size_t   arena_capacity;    // bytes of the device arena
+    size_t   arena_high_water;  // most arena bytes in use at once
+    size_t   sub_buffers;       // sub-buffers carved from the arena
+    size_t   reused_buffers;    // slot growths served by a cached sub-buffer
+};
+
+// Sets up the first device of `device_type` (e.g. CL_DEVICE_TYPE_GPU) on
+// any platform. `local` is the work-group size, 0 for the tuned one or the
+// runtime's choice. Returns NULL, and the OpenCL error in err if not NULL,
+// when no device is found or the setup fails.
+struct cuboid_engine *cuboid_engine_create(cl_device_type device_type, size_t local, cl_int *err);
+
+// Computes the surface areas of `length` cuboids into result, blocking until
+// they are on the host. Returns CL_SUCCESS or the first OpenCL error; the
+// engine stays usable after an error.
+cl_int cuboid_engine_submit(struct cuboid_engine *engine, const int *a, const int *b, const int *c,
+                            int *result, size_t length);
+
+// Queues a batch and returns without waiting for it: write -> kernel ->
+// read are chained with events and callback, if not NULL, runs when the
+// result is on the host. a, b, c and result must stay valid until then.
+// Blocks only when CUBOID_ENGINE_SLOTS batches are already in flight.
+// Returns NULL and the error in err if not NULL when the batch could not be
+// queued.
+struct cuboid_batch *cuboid_engine_submit_async(struct cuboid_engine *engine,
+                                                const int *a, const int *b, const int *c, int *result,
+                                                size_t length, cuboid_batch_callback callback,
+                                                void *user_data, cl_int *err);
+
+// Non-zero once the batch's result is on the host or the batch failed
+int cuboid_batch_done(const struct cuboid_batch *batch);
+
+// Blocks until the batch is over. Returns CL_SUCCESS or its error.
+cl_int cuboid_batch_wait(struct cuboid_batch *batch);
+
+// Drops the handle, the batch itself still completes if it is in flight
+void cuboid_batch_release(struct cuboid_batch *batch);
+
+// Name of the engine's device
+const char *cuboid_engine_device(const struct cuboid_engine *engine);
+
+// Page-locked host memory the engine's device transfers from and to without
+// a staging copy. Returns NULL, and the error in err if not NULL, on
+// failure. Free with cuboid_engine_host_free() before destroying the engine.
+void *cuboid_engine_host_alloc(struct cuboid_engine *engine, size_t bytes, cl_mem *mem, cl_int *err);
+void  cuboid_engine_host_free(struct cuboid_engine *engine, cl_mem mem, void *ptr);
+
+// A long computation split into engine submits that survives device
+// failures. Allocation failures (CL_MEM_OBJECT_ALLOCATION_FAILURE,
+// CL_OUT_OF_RESOURCES, CL_OUT_OF_HOST_MEMORY, CL_INVALID_BUFFER_SIZE) halve
+// the chunk, down to CUBOID_MIN_CHUNK, and retry it. Any other device error,
+// or an allocation failure at the smallest chunk, counts as a lost device.
+#define CUBOID_MIN_CHUNK 4096
+
+struct cuboid_job {
+    size_t   length;        // cuboids of the whole job
+    size_t   done;          // cuboids completed, a failed run resumes here
+    size_t   chunk;         // cuboids per submit
+    size_t   retries;       // submits repeated after a failure
+    size_t   halvings;      // times the chunk was halved
+    size_t   cpu_elements;  // cuboids computed by the CPU engine
+    int      device_lost;   // the rest goes to the CPU engine
+    cl_int   last_error;    // last device error, CL_SUCCESS if none
+};
+
+void cuboid_job_init(struct cuboid_job *job, size_t length, size_t chunk);
+
+// Runs the job from job->done on. With cpu_fallback the CPU engine takes
+// over once the device is lost, otherwise the run stops there. Returns
+// CL_SUCCESS when all `length` results are in, or the error that stopped
+// the run; calling it again then resumes from the last completed chunk.
+// Clearing device_lost first tries the device again, e.g. a new engine.
+// While device_lost is set with cpu_fallback, engine may be NULL, so a job
+// goes on when the engine cannot be recreated.
+cl_int cuboid_engine_run(struct cuboid_engine *engine, struct cuboid_job *job,
+                         const int *a, const int *b, const int *c, int *result, int cpu_fallback);
+
+void cuboid_engine_stats(const struct cuboid_engine *engine, struct cuboid_engine_stats *stats);
+
+void cuboid_engine_destroy(struct cuboid_engine *engine);
+
+//------------------------------------------------------------------------------
+//
+// Coalescing front end (coalesce.c)
+//
+// Merges small requests from any number of threads into single engine
+// dispatches. The engine must not be used directly while a coalescer owns
+// it.
+//
+//------------------------------------------------------------------------------
+
+struct cuboid_coalescer;
+
+struct cuboid_coalescer_stats {
+    size_t   requests;          // submits
+    size_t   dispatches;        // engine batches they were merged into
+    size_t   elements;          // cuboids over all dispatches
+    size_t   full_dispatches;   // dispatches sent because the stage filled up
+};
+
+// Dispatches up to max_elements cuboids at a time, or what has arrived once
+// the first staged request has waited window_us microseconds. Returns NULL,
+// and the error in err if not NULL, on failure.
+struct cuboid_coalescer *cuboid_coalescer_create(struct cuboid_engine *engine, size_t max_elements,
+                                                 unsigned window_us, cl_int *err);
+
+// Computes `length` surface areas into result as part of a coalesced
+// dispatch, blocking until they are there. Safe to call from several
+// threads at once. Returns CL_SUCCESS or the dispatch's error.
+cl_int cuboid_coalescer_submit(struct cuboid_coalescer *co, const int *a, const int *b, const int *c,
+                               int *result, size_t length);
+
+void cuboid_coalescer_stats(struct cuboid_coalescer *co, struct cuboid_coalescer_stats *stats);
+
+// Dispatches what is still staged, then frees the coalescer; the engine
+// stays
+void cuboid_coalescer_destroy(struct cuboid_coalescer *co);
@@ -0,0 +1,198 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Memory-mapped binary cuboid datasets
+//
+//             A dataset file is a DATASET_HEADER_SIZE byte header followed
+//             by the a, b and c columns and the result column, each `count`
+//             elements of `elem_size` bytes in the byte order of the host
+//             that wrote it:
+//
+//                 header | a[count] | b[count] | c[count] | result[count]
+//
+//             The result column always has its room in the file and is only
+//             valid once DATASET_HAS_RESULT is set in the header. Files are
+//             mapped with mmap, so the columns are handed to the device
+//             straight from the page cache, and a result written into a
+//             writable mapping lands in the file without another copy.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cuboid.h"
+
+//------------------------------------------------------------------------------
+
+static const char dataset_magic[8] = { 'C', 'U', 'B', 'O', 'I', 'D', 'S', '\0' };
+
+#define DATASET_BYTE_ORDER 0x01020304u
+
+static size_t dataset_bytes(cl_ulong count)
+{
+    return DATASET_HEADER_SIZE + 4 * sizeof(cl_int) * (size_t) count;
+}
+
+// Points the column pointers into the mapping
+static void dataset_columns(struct dataset *ds)
+{
+    char *data = (char*) ds->map + DATASET_HEADER_SIZE;
+    size_t column = sizeof(cl_int) * (size_t) ds->header->count;
+
+    ds->a      = (int*) data;
+    ds->b      = (int*) (data + column);
+    ds->c      = (int*) (data + 2 * column);
+    ds->result = (int*) (data + 3 * column);
+}
+
+static int dataset_map(struct dataset *ds, int fd, size_t bytes, int writable, const char *path)
+{
+    ds->map = mmap(NULL, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (ds->map == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map %s: %s\n", path, strerror(errno));
+        ds->map = NULL;
+        return -1;
+    }
+    ds->bytes    = bytes;
+    ds->header   = (struct dataset_header*) ds->map;
+    ds->writable = writable;
+
+    // The columns are read front to back exactly once
+    madvise(ds->map, bytes, MADV_SEQUENTIAL);
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+
+int dataset_open(const char *path, int writable, struct dataset *ds)
+{
+    memset(ds, 0, sizeof(struct dataset));
+
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < DATASET_HEADER_SIZE)
+    {
+        fprintf(stderr, "%s is not a cuboid dataset\n", path);
+        close(fd);
+        return -1;
+    }
+
+    int mapped = dataset_map(ds, fd, (size_t) st.st_size, writable, path);
+    close(fd);
+    if (mapped != 0)
+        return -1;
+
+    const struct dataset_header *h = ds->header;
+    const char *problem = NULL;
+
+    if (memcmp(h->magic, dataset_magic, sizeof(dataset_magic)) != 0)
+        problem = "is not a cuboid dataset";
+    else if (h->version != DATASET_VERSION)
+        problem = "has an unsupported version";
+    else if (h->byte_order != DATASET_BYTE_ORDER)
+        problem = "was written with the other byte order";
+    else if (h->elem_type != ELEM_INT || h->elem_size != sizeof(cl_int))
+        problem = "has an element type other than int";
+    else if (h->layout != DATASET_COLUMNAR)
+        problem = "has an unsupported layout";
+    // The count is checked against the file size before it is multiplied,
+    // so a hostile count cannot wrap dataset_bytes() around to a match
+    else if (h->count == 0 || h->count > (ds->bytes - DATASET_HEADER_SIZE) / (4 * sizeof(cl_int)) ||
+             dataset_bytes(h->count) != ds->bytes)
+        problem = "is truncated or has a wrong count";
+
+    if (problem != NULL)
+    {
+        fprintf(stderr, "%s %s\n", path, problem);
+        dataset_close(ds);
+        return -1;
+    }
+
+    dataset_columns(ds);
+
+    return 0;
+}
+
+int dataset_create(const char *path, cl_ulong count, struct dataset *ds)
+{
+    memset(ds, 0, sizeof(struct dataset));
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // Sized up front, the pages are only backed once they are written
+    size_t bytes = dataset_bytes(count);
+    if (ftruncate(fd, (off_t) bytes) != 0)
+    {
+        fprintf(stderr, "Cannot size %s to %zu bytes: %s\n", path, bytes, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    int mapped = dataset_map(ds, fd, bytes, 1, path);
+    close(fd);
+    if (mapped != 0)
+        return -1;
+
+    struct dataset_header *h = ds->header;
+    memcpy(h->magic, dataset_magic, sizeof(dataset_magic));
+    h->version    = DATASET_VERSION;
+    h->byte_order = DATASET_BYTE_ORDER;
+    h->elem_type  = ELEM_INT;
+    h->elem_size  = sizeof(cl_int);
+    h->layout     = DATASET_COLUMNAR;
+    h->flags      = 0;
+    h->count      = count;
+
+    dataset_columns(ds);
+
+    return 0;
+}
+
+int dataset_finish(struct dataset *ds)
+{
+    ds->header->flags |= DATASET_HAS_RESULT;
+
+    if (msync(ds->map, ds->bytes, MS_SYNC) != 0)
+    {
+        fprintf(stderr, "Cannot write the dataset back: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int dataset_same_file(const char *path, const char *other)
+{
+    struct stat a, b;
+
+    if (stat(path, &a) != 0 || stat(other, &b) != 0)
+        return 0;
+
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+void dataset_close(struct dataset *ds)
+{
+    if (ds->map != NULL)
+        munmap(ds->map, ds->bytes);
+    memset(ds, 0, sizeof(struct dataset));
+}
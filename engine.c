@@ -0,0 +1,601 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Reusable cuboid engine for repeated batches
+//
+//             Platform discovery, context, queue, program build and kernel
+//             creation happen once in cuboid_engine_create(). Device buffers
+//             are kept between submits in CUBOID_ENGINE_SLOTS slots, each of
+//             which grows to the largest batch it has carried, so a steady
+//             stream of batches only pays for its transfers and the kernel.
+//             The slots are slices of one device arena (arena.c), so growing
+//             a slot carves or reuses a sub-buffer instead of calling
+//             clCreateBuffer, which synchronizes on some drivers.
+//
+//             An asynchronous submit claims a slot that is not in flight,
+//             enqueues write -> kernel -> read chained through events and
+//             returns right away; completion is signalled through a
+//             clSetEventCallback on the read. When every slot is in flight
+//             the submit waits for the oldest one, which bounds the work in
+//             flight. The blocking submit is an asynchronous one plus a wait.
+//
+//             Errors are returned instead of exiting, so a caller can decide
+//             what to do with a failed batch. cuboid_engine_run() is such a
+//             caller for long jobs: it submits one chunk at a time, halves
+//             the chunk when the device runs out of memory, hands the rest to
+//             the CPU engine when the device is gone, and records the last
+//             completed chunk so a stopped job can be resumed.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "cuboid.h"
+#include "cuboid_engine.h"
+
+//------------------------------------------------------------------------------
+
+struct engine_slot {
+    cl_mem   d_a;
+    cl_mem   d_b;
+    cl_mem   d_c;
+    cl_mem   d_result;
+    size_t   capacity;  // elements the buffers hold
+
+    cl_event done;      // read of the last batch carried, NULL when idle
+    size_t   sequence;  // submit number of that batch, to find the oldest
+};
+
+struct cuboid_engine {
+    cl_device_id     device_id;
+    cl_context       context;
+    cl_command_queue commands;
+    cl_program       program;
+    cl_kernel        kernel;
+
+    struct launch_config launch;
+
+    struct device_arena arena;
+    struct engine_slot slot[CUBOID_ENGINE_SLOTS];
+    size_t           sequence;
+
+    char             name[256];
+    struct cuboid_engine_stats stats;
+};
+
+struct cuboid_batch {
+    cl_event done;      // read of the result
+    double   submitted; // wall time of the submit, for the batch latency
+    int      observed;  // the latency has gone into the telemetry
+};
+
+// Owned by the event callback, freed once it has run
+struct batch_callback {
+    cuboid_batch_callback callback;
+    void                 *user_data;
+};
+
+//------------------------------------------------------------------------------
+
+static void release_slot(struct cuboid_engine *engine, struct engine_slot *s)
+{
+    cl_mem *buffers[4] = { &s->d_a, &s->d_b, &s->d_c, &s->d_result };
+
+    if (s->done != NULL)
+    {
+        clWaitForEvents(1, &s->done);
+        clReleaseEvent(s->done);
+        s->done = NULL;
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        if (*buffers[i] != NULL)
+        {
+            arena_free(&engine->arena, *buffers[i]);
+            *buffers[i] = NULL;
+        }
+    }
+    s->capacity = 0;
+}
+
+// Execution status of an event: CL_COMPLETE, a pending state, or a
+// negative error when the commands were terminated
+static cl_int event_status(cl_event event)
+{
+    cl_int status;
+
+    cl_int err = clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+
+    return err != CL_SUCCESS ? err : status;
+}
+
+static int slot_idle(struct engine_slot *s)
+{
+    if (s->done == NULL)
+        return 1;
+
+    if (event_status(s->done) > CL_COMPLETE)
+        return 0;
+
+    clReleaseEvent(s->done);
+    s->done = NULL;
+    return 1;
+}
+
+// A slot whose last batch has finished, waiting for the oldest one if every
+// slot is still in flight
+static struct engine_slot *acquire_slot(struct cuboid_engine *engine)
+{
+    struct engine_slot *oldest = NULL;
+
+    for (int i = 0; i < CUBOID_ENGINE_SLOTS; i++)
+    {
+        struct engine_slot *s = &engine->slot[i];
+        if (slot_idle(s))
+            return s;
+        if (oldest == NULL || s->sequence < oldest->sequence)
+            oldest = s;
+    }
+
+    clWaitForEvents(1, &oldest->done);
+    clReleaseEvent(oldest->done);
+    oldest->done = NULL;
+
+    return oldest;
+}
+
+// Makes room for `length` elements. The old contents do not matter, every
+// submit writes all the inputs it uses.
+static cl_int reserve(struct cuboid_engine *engine, struct engine_slot *s, size_t length)
+{
+    cl_int err = CL_SUCCESS;
+    size_t bytes = sizeof(cl_int) * length;
+
+    if (length <= s->capacity)
+        return CL_SUCCESS;
+
+    release_slot(engine, s);
+
+    s->d_a = arena_alloc(&engine->arena, bytes, &err);
+    if (err == CL_SUCCESS)
+        s->d_b = arena_alloc(&engine->arena, bytes, &err);
+    if (err == CL_SUCCESS)
+        s->d_c = arena_alloc(&engine->arena, bytes, &err);
+    if (err == CL_SUCCESS)
+        s->d_result = arena_alloc(&engine->arena, bytes, &err);
+
+    if (err != CL_SUCCESS)
+    {
+        release_slot(engine, s);
+        return err;
+    }
+
+    s->capacity = length;
+    engine->stats.reallocations++;
+    if (length > engine->stats.capacity)
+        engine->stats.capacity = length;
+
+    return CL_SUCCESS;
+}
+
+// The largest single allocation the device allows, or CUBOID_ARENA_BYTES
+// when that is set and smaller
+static size_t arena_capacity(cl_device_id device_id)
+{
+    cl_ulong max_alloc = 0;
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+
+    const char *env = getenv("CUBOID_ARENA_BYTES");
+    if (env != NULL)
+    {
+        cl_ulong limit = strtoull(env, NULL, 0);
+        if (limit > 0 && limit < max_alloc)
+            max_alloc = limit;
+    }
+
+    return (size_t) max_alloc;
+}
+
+static void CL_CALLBACK batch_complete(cl_event event, cl_int status, void *user_data)
+{
+    struct batch_callback *cb = (struct batch_callback*) user_data;
+    (void) event;
+
+    cb->callback(status, cb->user_data);
+    free(cb);
+}
+
+//------------------------------------------------------------------------------
+
+struct cuboid_engine *cuboid_engine_create(cl_device_type device_type, size_t local, cl_int *err)
+{
+    cl_int status;
+    if (err == NULL)
+        err = &status;
+
+    double setup_time = wtime();
+
+    cl_uint numPlatforms;
+    *err = clGetPlatformIDs(0, NULL, &numPlatforms);
+    if (*err != CL_SUCCESS)
+        return NULL;
+    if (numPlatforms == 0)
+    {
+        *err = CL_DEVICE_NOT_FOUND;
+        return NULL;
+    }
+
+    cl_platform_id Platform[numPlatforms];
+    *err = clGetPlatformIDs(numPlatforms, Platform, NULL);
+    if (*err != CL_SUCCESS)
+        return NULL;
+
+    cl_device_id device_id = NULL;
+    for (cl_uint i = 0; i < numPlatforms && device_id == NULL; i++)
+    {
+        if (clGetDeviceIDs(Platform[i], device_type, 1, &device_id, NULL) != CL_SUCCESS)
+            device_id = NULL;
+    }
+    if (device_id == NULL)
+    {
+        *err = CL_DEVICE_NOT_FOUND;
+        return NULL;
+    }
+
+    struct cuboid_engine *engine = (struct cuboid_engine*) calloc(1, sizeof(struct cuboid_engine));
+    if (engine == NULL)
+    {
+        *err = CL_OUT_OF_HOST_MEMORY;
+        return NULL;
+    }
+
+    engine->device_id = device_id;
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(engine->name), engine->name, NULL);
+
+    engine->context = clCreateContext(0, 1, &device_id, NULL, NULL, err);
+    if (*err == CL_SUCCESS)
+        engine->commands = clCreateCommandQueue(engine->context, device_id, 0, err);
+    if (*err == CL_SUCCESS)
+        *err = arena_create(&engine->arena, engine->context, device_id, arena_capacity(device_id));
+    if (*err == CL_SUCCESS)
+    {
+        // A device that cannot build the program is an error, never an exit
+        engine->program = build_program_err(engine->context, device_id, "", NULL, err);
+    }
+    if (*err == CL_SUCCESS)
+        engine->kernel = clCreateKernel(engine->program, "cuboid_area", err);
+    if (*err != CL_SUCCESS)
+    {
+        cuboid_engine_destroy(engine);
+        return NULL;
+    }
+
+    engine->launch.local = local;
+    engine->launch.items = 1;
+    if (local == 0)
+    {
+        // Only the work-group size applies to cuboid_area
+        struct launch_config tuned;
+        if (tune_load(device_id, &tuned) == 0)
+            engine->launch.local = tuned.local;
+    }
+
+    engine->stats.setup_time = wtime() - setup_time;
+
+    return engine;
+}
+
+struct cuboid_batch *cuboid_engine_submit_async(struct cuboid_engine *engine,
+                                                const int *a, const int *b, const int *c, int *result,
+                                                size_t length, cuboid_batch_callback callback,
+                                                void *user_data, cl_int *err)
+{
+    cl_int status;
+    if (err == NULL)
+        err = &status;
+
+    if (length == 0 || length > UINT_MAX)
+    {
+        *err = CL_INVALID_VALUE;
+        return NULL;
+    }
+
+    double start = wtime();
+
+    struct cuboid_batch *batch = (struct cuboid_batch*) malloc(sizeof(struct cuboid_batch));
+    if (batch == NULL)
+    {
+        *err = CL_OUT_OF_HOST_MEMORY;
+        return NULL;
+    }
+
+    struct engine_slot *s = acquire_slot(engine);
+    *err = reserve(engine, s, length);
+    if (*err != CL_SUCCESS)
+    {
+        telemetry_error(*err);
+        free(batch);
+        return NULL;
+    }
+
+    size_t  bytes  = sizeof(cl_int) * length;
+    size_t  global = launch_global(&engine->launch, length);
+    cl_uint n      = (cl_uint) length;
+
+    cl_event written[3] = { NULL, NULL, NULL };
+    cl_event computed = NULL;
+    cl_event done = NULL;
+
+    *err = clEnqueueWriteBuffer(engine->commands, s->d_a, CL_FALSE, 0, bytes, a, 0, NULL, &written[0]);
+    if (*err == CL_SUCCESS)
+        *err = clEnqueueWriteBuffer(engine->commands, s->d_b, CL_FALSE, 0, bytes, b, 0, NULL, &written[1]);
+    if (*err == CL_SUCCESS)
+        *err = clEnqueueWriteBuffer(engine->commands, s->d_c, CL_FALSE, 0, bytes, c, 0, NULL, &written[2]);
+
+    // Arguments are captured at enqueue time, so the one kernel object can
+    // point at a different slot for every batch
+    if (*err == CL_SUCCESS)
+    {
+        *err  = clSetKernelArg(engine->kernel, 0, sizeof(cl_mem), &s->d_a);
+        *err |= clSetKernelArg(engine->kernel, 1, sizeof(cl_mem), &s->d_b);
+        *err |= clSetKernelArg(engine->kernel, 2, sizeof(cl_mem), &s->d_c);
+        *err |= clSetKernelArg(engine->kernel, 3, sizeof(cl_mem), &s->d_result);
+        *err |= clSetKernelArg(engine->kernel, 4, sizeof(cl_uint), &n);
+    }
+    if (*err == CL_SUCCESS)
+        *err = clEnqueueNDRangeKernel(engine->commands, engine->kernel, 1, NULL, &global,
+                                      engine->launch.local > 0 ? &engine->launch.local : NULL,
+                                      3, written, &computed);
+    if (*err == CL_SUCCESS)
+        *err = clEnqueueReadBuffer(engine->commands, s->d_result, CL_FALSE, 0, bytes, result,
+                                   1, &computed, &done);
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (written[i] != NULL)
+            clReleaseEvent(written[i]);
+    }
+    if (computed != NULL)
+        clReleaseEvent(computed);
+
+    if (*err == CL_SUCCESS && callback != NULL)
+    {
+        struct batch_callback *cb = (struct batch_callback*) malloc(sizeof(struct batch_callback));
+        if (cb == NULL)
+            *err = CL_OUT_OF_HOST_MEMORY;
+        else
+        {
+            cb->callback  = callback;
+            cb->user_data = user_data;
+            *err = clSetEventCallback(done, CL_COMPLETE, batch_complete, cb);
+            if (*err != CL_SUCCESS)
+                free(cb);
+        }
+    }
+
+    if (*err != CL_SUCCESS)
+    {
+        // Let whatever was queued before the failure drain, the slot stays
+        // usable for the next submit
+        telemetry_error(*err);
+        clFinish(engine->commands);
+        if (done != NULL)
+            clReleaseEvent(done);
+        free(batch);
+        return NULL;
+    }
+
+    clFlush(engine->commands);
+
+    // One reference for the slot, one for the caller's handle
+    clRetainEvent(done);
+    s->done     = done;
+    s->sequence = engine->sequence++;
+    batch->done = done;
+    batch->submitted = start;
+    batch->observed  = 0;
+
+    telemetry_add(TELEMETRY_BYTES_TO_DEVICE, 3 * bytes);
+    telemetry_add(TELEMETRY_BYTES_FROM_DEVICE, bytes);
+    telemetry_add(TELEMETRY_ELEMENTS, length);
+    telemetry_add(TELEMETRY_KERNELS, 1);
+
+    engine->stats.batches++;
+    engine->stats.elements += length;
+    engine->stats.busy_time += wtime() - start;
+
+    return batch;
+}
+
+int cuboid_batch_done(const struct cuboid_batch *batch)
+{
+    return event_status(batch->done) <= CL_COMPLETE;
+}
+
+cl_int cuboid_batch_wait(struct cuboid_batch *batch)
+{
+    cl_int err = clWaitForEvents(1, &batch->done);
+    cl_int status = event_status(batch->done);
+
+    // A terminated command reports its error through the status
+    if (status < 0)
+    {
+        telemetry_error(status);
+        return status;
+    }
+
+    if (err == CL_SUCCESS && !batch->observed)
+    {
+        telemetry_observe(TELEMETRY_BATCH, wtime() - batch->submitted);
+        batch->observed = 1;
+    }
+
+    return err;
+}
+
+void cuboid_batch_release(struct cuboid_batch *batch)
+{
+    if (batch == NULL)
+        return;
+
+    clReleaseEvent(batch->done);
+    free(batch);
+}
+
+cl_int cuboid_engine_submit(struct cuboid_engine *engine, const int *a, const int *b, const int *c,
+                            int *result, size_t length)
+{
+    cl_int err;
+
+    if (length == 0)
+        return CL_SUCCESS;
+
+    struct cuboid_batch *batch = cuboid_engine_submit_async(engine, a, b, c, result, length, NULL, NULL, &err);
+    if (batch == NULL)
+        return err;
+
+    // The asynchronous submit counted its own part, add the wait
+    double waited = wtime();
+    err = cuboid_batch_wait(batch);
+    engine->stats.busy_time += wtime() - waited;
+
+    cuboid_batch_release(batch);
+
+    return err;
+}
+
+// Errors a smaller chunk may avoid
+static int allocation_error(cl_int err)
+{
+    return err == CL_MEM_OBJECT_ALLOCATION_FAILURE || err == CL_OUT_OF_RESOURCES ||
+           err == CL_OUT_OF_HOST_MEMORY || err == CL_INVALID_BUFFER_SIZE;
+}
+
+void cuboid_job_init(struct cuboid_job *job, size_t length, size_t chunk)
+{
+    if (chunk == 0 || chunk > UINT_MAX)
+        chunk = UINT_MAX;
+
+    job->length       = length;
+    job->done         = 0;
+    job->chunk        = chunk;
+    job->retries      = 0;
+    job->halvings     = 0;
+    job->cpu_elements = 0;
+    job->device_lost  = 0;
+    job->last_error   = CL_SUCCESS;
+}
+
+cl_int cuboid_engine_run(struct cuboid_engine *engine, struct cuboid_job *job,
+                         const int *a, const int *b, const int *c, int *result, int cpu_fallback)
+{
+    while (job->done < job->length)
+    {
+        size_t offset = job->done;
+        size_t count  = job->length - offset < job->chunk ? job->length - offset : job->chunk;
+
+        if (job->device_lost)
+        {
+            if (!cpu_fallback)
+                return job->last_error;
+
+            cpu_cuboid_area(a + offset, b + offset, c + offset, result + offset, count);
+            job->cpu_elements += count;
+            job->done         += count;
+            continue;
+        }
+
+        cl_int err = cuboid_engine_submit(engine, a + offset, b + offset, c + offset, result + offset, count);
+        if (err == CL_SUCCESS)
+        {
+            job->done += count;
+            continue;
+        }
+
+        // The caller's arguments are wrong, no retry helps
+        job->last_error = err;
+        if (err == CL_INVALID_VALUE)
+            return err;
+
+        job->retries++;
+        if (allocation_error(err) && count > CUBOID_MIN_CHUNK)
+        {
+            job->chunk = count / 2 > CUBOID_MIN_CHUNK ? count / 2 : CUBOID_MIN_CHUNK;
+            job->halvings++;
+            continue;
+        }
+
+        job->device_lost = 1;
+    }
+
+    return CL_SUCCESS;
+}
+
+const char *cuboid_engine_device(const struct cuboid_engine *engine)
+{
+    return engine->name;
+}
+
+void *cuboid_engine_host_alloc(struct cuboid_engine *engine, size_t bytes, cl_mem *mem, cl_int *err)
+{
+    cl_int status;
+    if (err == NULL)
+        err = &status;
+
+    *mem = clCreateBuffer(engine->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bytes, NULL, err);
+    if (*err != CL_SUCCESS)
+        return NULL;
+
+    // Mapped once for the lifetime of the allocation; transfers from a
+    // mapped CL_MEM_ALLOC_HOST_PTR region need no driver staging copy
+    void *ptr = clEnqueueMapBuffer(engine->commands, *mem, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+                                   0, bytes, 0, NULL, NULL, err);
+    if (*err != CL_SUCCESS)
+    {
+        clReleaseMemObject(*mem);
+        *mem = NULL;
+        return NULL;
+    }
+
+    return ptr;
+}
+
+void cuboid_engine_host_free(struct cuboid_engine *engine, cl_mem mem, void *ptr)
+{
+    if (mem == NULL)
+        return;
+
+    clEnqueueUnmapMemObject(engine->commands, mem, ptr, 0, NULL, NULL);
+    clFinish(engine->commands);
+    clReleaseMemObject(mem);
+}
+
+void cuboid_engine_stats(const struct cuboid_engine *engine, struct cuboid_engine_stats *stats)
+{
+    *stats = engine->stats;
+    stats->arena_capacity   = engine->arena.capacity;
+    stats->arena_high_water = engine->arena.high_water;
+    stats->sub_buffers      = engine->arena.created;
+    stats->reused_buffers   = engine->arena.reused;
+}
+
+void cuboid_engine_destroy(struct cuboid_engine *engine)
+{
+    if (engine == NULL)
+        return;
+
+    for (int i = 0; i < CUBOID_ENGINE_SLOTS; i++)
+        release_slot(engine, &engine->slot[i]);
+    arena_release(&engine->arena);
+    if (engine->kernel != NULL)
+        clReleaseKernel(engine->kernel);
+    if (engine->program != NULL)
+        clReleaseProgram(engine->program);
+    if (engine->commands != NULL)
+        clReleaseCommandQueue(engine->commands);
+    if (engine->context != NULL)
+        clReleaseContext(engine->context);
+
+    free(engine);
+}
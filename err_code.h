@@ -30,7 +30,7 @@
  #include <cstdio>
 #endif
 
-const char *err_code (cl_int err_in)
+static const char *err_code (cl_int err_in)
 {
     switch (err_in) {
         case CL_SUCCESS:
@@ -140,10 +140,14 @@ const char *err_code (cl_int err_in)
 }
 
 
-void check_error(cl_int err, const char *operation, char *filename, int line)
+// Counts the error for the exported telemetry (telemetry.c)
+void telemetry_error(cl_int err);
+
+static void check_error(cl_int err, const char *operation, char *filename, int line)
 {
     if (err != CL_SUCCESS)
     {
+        telemetry_error(err);
         fprintf(stderr, "Error during operation '%s', ", operation);
         fprintf(stderr, "in '%s' on line %d\n", filename, line);
         fprintf(stderr, "Error code was \"%s\" (%d)\n", err_code(err), err);
@@ -0,0 +1,376 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Cuboid filter from an input stream to an output stream
+//
+//             Records are native-endian {a, b, c} triples of 32-bit integers
+//             on the input, results are one 32-bit integer per record on the
+//             output, in the same order. Three stages run concurrently over
+//             FILTER_FRAMES frames of `frame` records each:
+//
+//                 reader thread -> device (calling thread) -> writer thread
+//
+//             The frames form a ring shared by two single-producer/single-
+//             consumer queues: the reader publishes `filled`, the device
+//             stage `computed` and the writer `written`, each counter is
+//             stored by one thread only and read by its neighbour with
+//             acquire/release ordering. A stage waiting for its neighbour
+//             spins for FILTER_SPINS yields and then sleeps on a condition
+//             variable every store signals, so a filter whose input pipe
+//             is idle uses no CPU. The reader may only refill a frame the
+//             writer is done with, which bounds the memory to FILTER_FRAMES
+//             frames whatever the stream length.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+#define FILTER_FRAMES 4
+
+// Yields a waiting stage spins through before it sleeps
+#define FILTER_SPINS  1000
+
+#define ring_load(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ring_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+struct filter_frame {
+    cl_int *a;
+    cl_int *b;
+    cl_int *c;
+    cl_int *result;
+    size_t  count;      // records in the frame, less than `frame` only at the end
+};
+
+struct filter {
+    struct filter_frame ring[FILTER_FRAMES];
+    size_t  frame;      // records per frame
+
+    int     in_fd;
+    int     out_fd;
+
+    size_t  filled;     // frames published by the reader
+    size_t  computed;   // frames published by the device stage
+    size_t  written;    // frames published by the writer
+    int     eof;        // the reader has published its last frame
+    int     done;       // the device stage has published its last frame
+    int     failed;     // an I/O error stops every stage
+
+    size_t  records;
+    size_t  leftover;   // bytes of an incomplete record at the end of the input
+
+    pthread_mutex_t lock;       // only for sleeping, the counters need none
+    pthread_cond_t  published;  // broadcast by wake()
+};
+
+// Wakes the stages sleeping in wait_for(), after every counter or flag store
+static void wake(struct filter *f)
+{
+    pthread_mutex_lock(&f->lock);
+    pthread_cond_broadcast(&f->published);
+    pthread_mutex_unlock(&f->lock);
+}
+
+// 0 once *counter passes `index`, -1 when the producer has set *end without
+// getting there or a stage failed, 1 while there is still something to wait for
+static int ready(struct filter *f, size_t *counter, size_t index, int *end)
+{
+    if (ring_load(counter) > index)
+        return 0;
+    if (ring_load(&f->failed) || (end != NULL && ring_load(end) && ring_load(counter) <= index))
+        return -1;
+    return 1;
+}
+
+// Waits until *counter passes `index`, spinning politely for a while and then
+// sleeping. Returns -1 instead when the producer has set *end without getting
+// there, or a stage failed.
+static int wait_for(struct filter *f, size_t *counter, size_t index, int *end)
+{
+    int state;
+
+    for (int spin = 0; spin < FILTER_SPINS; spin++)
+    {
+        if ((state = ready(f, counter, index, end)) != 1)
+            return state;
+        sched_yield();
+    }
+
+    // Checked under the lock every wake() takes, so no wakeup is lost
+    pthread_mutex_lock(&f->lock);
+    while ((state = ready(f, counter, index, end)) == 1)
+        pthread_cond_wait(&f->published, &f->lock);
+    pthread_mutex_unlock(&f->lock);
+
+    return state;
+}
+
+// Reads up to `bytes`, fewer only at the end of the input
+static ssize_t read_full(int fd, char *buf, size_t bytes)
+{
+    size_t done = 0;
+
+    while (done < bytes)
+    {
+        ssize_t n = read(fd, buf + done, bytes - done);
+        if (n == 0)
+            break;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += (size_t) n;
+    }
+
+    return (ssize_t) done;
+}
+
+static int write_full(int fd, const char *buf, size_t bytes)
+{
+    size_t done = 0;
+
+    while (done < bytes)
+    {
+        ssize_t n = write(fd, buf + done, bytes - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += (size_t) n;
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+
+static void *filter_reader(void *arg)
+{
+    struct filter *f = (struct filter*) arg;
+    size_t record = 3 * sizeof(cl_int);
+
+    cl_int *raw = (cl_int*) malloc(record * f->frame);
+    if (raw == NULL)
+    {
+        ring_store(&f->failed, 1);
+        wake(f);
+        return NULL;
+    }
+
+    for (size_t n = 0; ; n++)
+    {
+        // The frame is free once the writer has sent its previous contents
+        if (n >= FILTER_FRAMES && wait_for(f, &f->written, n - FILTER_FRAMES, NULL) != 0)
+            break;
+
+        ssize_t bytes = read_full(f->in_fd, (char*) raw, record * f->frame);
+        if (bytes < 0)
+        {
+            fprintf(stderr, "Error: reading the input failed: %s\n", strerror(errno));
+            ring_store(&f->failed, 1);
+            wake(f);
+            break;
+        }
+
+        struct filter_frame *fr = &f->ring[n % FILTER_FRAMES];
+        fr->count = (size_t) bytes / record;
+        f->leftover = (size_t) bytes % record;
+
+        // Split the records into the columns cuboid_area reads
+        for (size_t i = 0; i < fr->count; i++)
+        {
+            fr->a[i] = raw[3 * i];
+            fr->b[i] = raw[3 * i + 1];
+            fr->c[i] = raw[3 * i + 2];
+        }
+
+        if (fr->count > 0)
+        {
+            f->records += fr->count;
+            ring_store(&f->filled, n + 1);
+            wake(f);
+        }
+        if (fr->count < f->frame)
+            break;
+    }
+
+    ring_store(&f->eof, 1);
+    wake(f);
+    free(raw);
+
+    return NULL;
+}
+
+static void *filter_writer(void *arg)
+{
+    struct filter *f = (struct filter*) arg;
+
+    for (size_t n = 0; ; n++)
+    {
+        if (wait_for(f, &f->computed, n, &f->done) != 0)
+            break;
+
+        struct filter_frame *fr = &f->ring[n % FILTER_FRAMES];
+        if (write_full(f->out_fd, (const char*) fr->result, sizeof(cl_int) * fr->count) != 0)
+        {
+            fprintf(stderr, "Error: writing the results failed: %s\n", strerror(errno));
+            ring_store(&f->failed, 1);
+            wake(f);
+            break;
+        }
+
+        ring_store(&f->written, n + 1);
+        wake(f);
+    }
+
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+
+int filter_claim_stdout(void)
+{
+    fflush(stdout);
+
+    int fd = dup(STDOUT_FILENO);
+    if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+    {
+        fprintf(stderr, "Cannot redirect the report to stderr: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+size_t run_filter(cl_context context, cl_command_queue commands, cl_kernel kernel_cuboid_area,
+                  int in_fd, int out_fd, size_t frame, double *filter_time)
+{
+    int err;
+
+    struct filter f;
+    memset(&f, 0, sizeof(f));
+    f.frame  = frame;
+    f.in_fd  = in_fd;
+    f.out_fd = out_fd;
+    pthread_mutex_init(&f.lock, NULL);
+    pthread_cond_init(&f.published, NULL);
+
+    for (int i = 0; i < FILTER_FRAMES; i++)
+    {
+        f.ring[i].a      = (cl_int*) malloc(sizeof(cl_int) * frame);
+        f.ring[i].b      = (cl_int*) malloc(sizeof(cl_int) * frame);
+        f.ring[i].c      = (cl_int*) malloc(sizeof(cl_int) * frame);
+        f.ring[i].result = (cl_int*) malloc(sizeof(cl_int) * frame);
+        if (f.ring[i].a == NULL || f.ring[i].b == NULL || f.ring[i].c == NULL || f.ring[i].result == NULL)
+        {
+            printf("Error: cannot allocate %d filter frames of %zu records\n", FILTER_FRAMES, frame);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // One frame is on the device at a time, the threads keep the others busy
+    size_t bytes = sizeof(cl_int) * frame;
+    cl_mem d_a = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating filter buffer d_a");
+    cl_mem d_b = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating filter buffer d_b");
+    cl_mem d_c = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating filter buffer d_c");
+    cl_mem d_result = clCreateBuffer(context, CL_MEM_WRITE_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating filter buffer d_result");
+
+    err  = clSetKernelArg(kernel_cuboid_area, 0, sizeof(cl_mem), &d_a);
+    err |= clSetKernelArg(kernel_cuboid_area, 1, sizeof(cl_mem), &d_b);
+    err |= clSetKernelArg(kernel_cuboid_area, 2, sizeof(cl_mem), &d_c);
+    err |= clSetKernelArg(kernel_cuboid_area, 3, sizeof(cl_mem), &d_result);
+    checkError(err, "Setting filter kernel arguments");
+
+    *filter_time = wtime();
+
+    pthread_t reader, writer;
+    if (pthread_create(&reader, NULL, filter_reader, &f) != 0 ||
+        pthread_create(&writer, NULL, filter_writer, &f) != 0)
+    {
+        printf("Error: cannot start the filter threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t n = 0; ; n++)
+    {
+        if (wait_for(&f, &f.filled, n, &f.eof) != 0)
+            break;
+
+        struct filter_frame *fr = &f.ring[n % FILTER_FRAMES];
+        size_t count = fr->count;
+        size_t used  = sizeof(cl_int) * count;
+        double start = wtime();
+
+        err  = clEnqueueWriteBuffer(commands, d_a, CL_FALSE, 0, used, fr->a, 0, NULL, NULL);
+        err |= clEnqueueWriteBuffer(commands, d_b, CL_FALSE, 0, used, fr->b, 0, NULL, NULL);
+        err |= clEnqueueWriteBuffer(commands, d_c, CL_FALSE, 0, used, fr->c, 0, NULL, NULL);
+        checkError(err, "Writing a filter frame");
+
+        cl_uint elements = (cl_uint) count;
+        err = clSetKernelArg(kernel_cuboid_area, 4, sizeof(cl_uint), &elements);
+        checkError(err, "Setting filter frame length");
+
+        err = clEnqueueNDRangeKernel(commands, kernel_cuboid_area, 1, NULL, &count, NULL, 0, NULL, NULL);
+        checkError(err, "Enqueueing filter kernel");
+
+        err = clEnqueueReadBuffer(commands, d_result, CL_TRUE, 0, used, fr->result, 0, NULL, NULL);
+        checkError(err, "Reading a filter frame");
+
+        telemetry_observe(TELEMETRY_CHUNK, wtime() - start);
+        telemetry_add(TELEMETRY_BYTES_TO_DEVICE, 3 * used);
+        telemetry_add(TELEMETRY_BYTES_FROM_DEVICE, used);
+        telemetry_add(TELEMETRY_ELEMENTS, count);
+        telemetry_add(TELEMETRY_KERNELS, 1);
+
+        ring_store(&f.computed, n + 1);
+        wake(&f);
+    }
+    ring_store(&f.done, 1);
+    wake(&f);
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+
+    *filter_time = wtime() - *filter_time;
+
+    if (f.leftover > 0)
+        printf("Warning: dropped %zu trailing bytes that do not form a whole record\n", f.leftover);
+
+    clReleaseMemObject(d_a);
+    clReleaseMemObject(d_b);
+    clReleaseMemObject(d_c);
+    clReleaseMemObject(d_result);
+
+    for (int i = 0; i < FILTER_FRAMES; i++)
+    {
+        free(f.ring[i].a);
+        free(f.ring[i].b);
+        free(f.ring[i].c);
+        free(f.ring[i].result);
+    }
+
+    pthread_mutex_destroy(&f.lock);
+    pthread_cond_destroy(&f.published);
+
+    if (f.failed)
+        return (size_t) -1;
+
+    return f.records;
+}
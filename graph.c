@@ -0,0 +1,290 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Chunked execution as a task graph of writes, kernels and reads
+//
+//             Every command is a node whose dependencies are the event wait
+//             list of its enqueue, so only real data dependencies order the
+//             work: the three uploads of a chunk are independent of each
+//             other, its kernel waits for all three, its read waits for the
+//             kernel, and the uploads into a buffer set wait for the last
+//             read out of it. On a device that supports it everything goes
+//             to one CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE queue and the
+//             runtime overlaps what the hardware allows; otherwise each kind
+//             of node gets its own in-order queue (GRAPH_QUEUES of them),
+//             which still lets transfers of one chunk overlap the kernel of
+//             another.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+// Buffer sets in flight, like STREAM_DEPTH
+#define GRAPH_DEPTH  3
+
+// In-order fallback: uploads of a, b and c, kernels, reads
+#define GRAPH_QUEUES 5
+
+enum node_kind { NODE_WRITE_A, NODE_WRITE_B, NODE_WRITE_C, NODE_KERNEL, NODE_READ };
+
+struct task_graph {
+    cl_command_queue queue[GRAPH_QUEUES];
+    int              out_of_order;
+
+    cl_event        *events;    // one per node, indexed by node id
+    cl_uint         *kinds;
+    size_t          *bytes;     // moved by a write or read, elements of a kernel
+    size_t           count;
+    size_t           capacity;
+};
+
+static void graph_init(struct task_graph *g, cl_context context, cl_device_id device_id, size_t nodes)
+{
+    int err;
+
+    cl_command_queue_properties supported = 0;
+    clGetDeviceInfo(device_id, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported), &supported, NULL);
+
+    g->out_of_order = (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+    if (g->out_of_order)
+    {
+        g->queue[0] = clCreateCommandQueue(context, device_id,
+                                           CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | CL_QUEUE_PROFILING_ENABLE, &err);
+        checkError(err, "Creating out-of-order queue");
+        for (int q = 1; q < GRAPH_QUEUES; q++)
+            g->queue[q] = g->queue[0];
+    }
+    else
+    {
+        for (int q = 0; q < GRAPH_QUEUES; q++)
+        {
+            g->queue[q] = clCreateCommandQueue(context, device_id, CL_QUEUE_PROFILING_ENABLE, &err);
+            checkError(err, "Creating graph queue");
+        }
+    }
+
+    g->events   = (cl_event*) malloc(sizeof(cl_event) * nodes);
+    g->kinds    = (cl_uint*) malloc(sizeof(cl_uint) * nodes);
+    g->bytes    = (size_t*) malloc(sizeof(size_t) * nodes);
+    g->count    = 0;
+    g->capacity = nodes;
+    if (g->events == NULL || g->kinds == NULL || g->bytes == NULL)
+    {
+        printf("Error: cannot allocate a graph of %zu nodes\n", nodes);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Turns node ids into the event wait list of an enqueue
+static cl_uint wait_list(const struct task_graph *g, const size_t *deps, cl_uint ndeps, cl_event *list)
+{
+    for (cl_uint d = 0; d < ndeps; d++)
+        list[d] = g->events[deps[d]];
+
+    return ndeps;
+}
+
+static size_t graph_write(struct task_graph *g, enum node_kind kind, cl_mem buffer, size_t bytes,
+                          const void *ptr, const size_t *deps, cl_uint ndeps)
+{
+    cl_event list[4];
+    cl_uint  n = wait_list(g, deps, ndeps, list);
+
+    size_t id = g->count++;
+    int err = clEnqueueWriteBuffer(g->queue[kind], buffer, CL_FALSE, 0, bytes, ptr,
+                                   n, n ? list : NULL, &g->events[id]);
+    checkError(err, "Enqueueing graph write");
+    g->kinds[id] = kind;
+    g->bytes[id] = bytes;
+
+    return id;
+}
+
+static size_t graph_kernel(struct task_graph *g, cl_kernel kernel, size_t global,
+                           const size_t *deps, cl_uint ndeps)
+{
+    cl_event list[4];
+    cl_uint  n = wait_list(g, deps, ndeps, list);
+
+    size_t id = g->count++;
+    int err = clEnqueueNDRangeKernel(g->queue[NODE_KERNEL], kernel, 1, NULL, &global, NULL,
+                                     n, n ? list : NULL, &g->events[id]);
+    checkError(err, "Enqueueing graph kernel");
+    g->kinds[id] = NODE_KERNEL;
+    g->bytes[id] = global;
+
+    return id;
+}
+
+static size_t graph_read(struct task_graph *g, cl_mem buffer, size_t bytes, void *ptr,
+                         const size_t *deps, cl_uint ndeps)
+{
+    cl_event list[4];
+    cl_uint  n = wait_list(g, deps, ndeps, list);
+
+    size_t id = g->count++;
+    int err = clEnqueueReadBuffer(g->queue[NODE_READ], buffer, CL_FALSE, 0, bytes, ptr,
+                                  n, n ? list : NULL, &g->events[id]);
+    checkError(err, "Enqueueing graph read");
+    g->kinds[id] = NODE_READ;
+    g->bytes[id] = bytes;
+
+    return id;
+}
+
+static void graph_flush(struct task_graph *g)
+{
+    for (int q = 0; q < (g->out_of_order ? 1 : GRAPH_QUEUES); q++)
+        clFlush(g->queue[q]);
+}
+
+// Waits for every node, sums each kind's device time and returns the span
+// from the first start to the last end
+static double graph_finish(struct task_graph *g, struct graph_stats *stats)
+{
+    int err = 0;
+    for (int q = 0; q < (g->out_of_order ? 1 : GRAPH_QUEUES); q++)
+        err |= clFinish(g->queue[q]);
+    checkError(err, "Waiting for the graph to finish");
+
+    cl_ulong first = 0, last = 0;
+    stats->transfer_time = 0.0;
+    stats->kernel_time   = 0.0;
+
+    for (size_t id = 0; id < g->count; id++)
+    {
+        cl_ulong start, end;
+        clGetEventProfilingInfo(g->events[id], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+        clGetEventProfilingInfo(g->events[id], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+
+        if (id == 0 || start < first)
+            first = start;
+        if (end > last)
+            last = end;
+
+        double seconds = (end - start) * 1.0e-9;
+        if (g->kinds[id] == NODE_KERNEL)
+        {
+            stats->kernel_time += seconds;
+            telemetry_observe_ns(TELEMETRY_KERNEL, end - start);
+            telemetry_add(TELEMETRY_KERNELS, 1);
+            telemetry_add(TELEMETRY_ELEMENTS, g->bytes[id]);
+        }
+        else if (g->kinds[id] == NODE_READ)
+        {
+            stats->transfer_time += seconds;
+            telemetry_observe_ns(TELEMETRY_READ, end - start);
+            telemetry_add(TELEMETRY_BYTES_FROM_DEVICE, g->bytes[id]);
+        }
+        else
+        {
+            stats->transfer_time += seconds;
+            telemetry_observe_ns(TELEMETRY_WRITE, end - start);
+            telemetry_add(TELEMETRY_BYTES_TO_DEVICE, g->bytes[id]);
+        }
+    }
+
+    return (last - first) * 1.0e-9;
+}
+
+static void graph_release(struct task_graph *g)
+{
+    for (size_t id = 0; id < g->count; id++)
+        clReleaseEvent(g->events[id]);
+    free(g->events);
+    free(g->kinds);
+    free(g->bytes);
+
+    for (int q = 0; q < (g->out_of_order ? 1 : GRAPH_QUEUES); q++)
+        clReleaseCommandQueue(g->queue[q]);
+}
+
+//------------------------------------------------------------------------------
+
+double run_graph(cl_context context, cl_device_id device_id, cl_kernel kernel_cuboid_area,
+                 const int *a, const int *b, const int *c, int *result,
+                 size_t length, size_t chunk, struct graph_stats *stats)
+{
+    int err;
+
+    if (chunk == 0 || chunk > length)
+        chunk = length;
+
+    size_t chunks = (length + chunk - 1) / chunk;
+
+    struct task_graph g;
+    graph_init(&g, context, device_id, 5 * chunks);
+
+    cl_mem d_a[GRAPH_DEPTH], d_b[GRAPH_DEPTH], d_c[GRAPH_DEPTH], d_result[GRAPH_DEPTH];
+    size_t last_read[GRAPH_DEPTH];
+    int    has_read[GRAPH_DEPTH];
+
+    for (int s = 0; s < GRAPH_DEPTH; s++)
+    {
+        d_a[s] = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_int) * chunk, NULL, &err);
+        checkError(err, "Creating graph buffer d_a");
+        d_b[s] = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_int) * chunk, NULL, &err);
+        checkError(err, "Creating graph buffer d_b");
+        d_c[s] = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_int) * chunk, NULL, &err);
+        checkError(err, "Creating graph buffer d_c");
+        d_result[s] = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_int) * chunk, NULL, &err);
+        checkError(err, "Creating graph buffer d_result");
+        has_read[s] = 0;
+    }
+
+    double graph_time = wtime();
+
+    for (size_t n = 0; n < chunks; n++)
+    {
+        int    s      = (int) (n % GRAPH_DEPTH);
+        size_t offset = n * chunk;
+        size_t count  = (offset + chunk > length) ? length - offset : chunk;
+        size_t bytes  = sizeof(cl_int) * count;
+
+        // A buffer set is refilled only after its previous result is out;
+        // the three uploads do not depend on each other
+        cl_uint nfree = has_read[s] ? 1 : 0;
+        size_t  uploads[3];
+        uploads[0] = graph_write(&g, NODE_WRITE_A, d_a[s], bytes, a + offset, &last_read[s], nfree);
+        uploads[1] = graph_write(&g, NODE_WRITE_B, d_b[s], bytes, b + offset, &last_read[s], nfree);
+        uploads[2] = graph_write(&g, NODE_WRITE_C, d_c[s], bytes, c + offset, &last_read[s], nfree);
+
+        // Arguments are captured at enqueue time
+        cl_uint elements = (cl_uint) count;
+        err  = clSetKernelArg(kernel_cuboid_area, 0, sizeof(cl_mem), &d_a[s]);
+        err |= clSetKernelArg(kernel_cuboid_area, 1, sizeof(cl_mem), &d_b[s]);
+        err |= clSetKernelArg(kernel_cuboid_area, 2, sizeof(cl_mem), &d_c[s]);
+        err |= clSetKernelArg(kernel_cuboid_area, 3, sizeof(cl_mem), &d_result[s]);
+        err |= clSetKernelArg(kernel_cuboid_area, 4, sizeof(cl_uint), &elements);
+        checkError(err, "Setting graph kernel arguments");
+
+        size_t kernel = graph_kernel(&g, kernel_cuboid_area, count, uploads, 3);
+
+        last_read[s] = graph_read(&g, d_result[s], bytes, result + offset, &kernel, 1);
+        has_read[s]  = 1;
+
+        graph_flush(&g);
+    }
+
+    stats->device_span  = graph_finish(&g, stats);
+    stats->nodes        = g.count;
+    stats->out_of_order = g.out_of_order;
+
+    graph_time = wtime() - graph_time;
+
+    graph_release(&g);
+    for (int s = 0; s < GRAPH_DEPTH; s++)
+    {
+        clReleaseMemObject(d_a[s]);
+        clReleaseMemObject(d_b[s]);
+        clReleaseMemObject(d_c[s]);
+        clReleaseMemObject(d_result[s]);
+    }
+
+    return graph_time;
+}
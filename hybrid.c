@@ -0,0 +1,234 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Hybrid co-execution of one range on the GPU and the CPU
+//
+//             One host thread feeds the OpenCL device while CPU worker
+//             threads compute with the CPU engine, all of them claiming
+//             their next piece from one shared atomic work counter. The
+//             device claims up to `gpu_chunk` elements at a time, which
+//             amortizes its transfers, the CPU workers HYBRID_CPU_CHUNK.
+//             Claims shrink to a fraction of what is left as the range runs
+//             out, so the device never takes a last piece the CPU could have
+//             finished sooner, and the CPU workers cover the tail. Each side
+//             ends up with a share proportional to its real throughput.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+// Elements per CPU claim, large enough to amortize the atomic, small enough
+// to balance the tail
+#define HYBRID_CPU_CHUNK (64 * 1024)
+
+// A claim is at most 1/HYBRID_TAIL_SHARE of what is left, once that is
+// smaller than the chunk
+#define HYBRID_TAIL_SHARE 4
+
+struct hybrid_work {
+    size_t      next;       // first element not yet claimed, updated atomically
+    size_t      length;
+
+    const int  *a;
+    const int  *b;
+    const int  *c;
+    int        *result;
+};
+
+struct hybrid_worker {
+    struct hybrid_work *work;
+    size_t              chunks;
+    size_t              elements;
+    double              busy_time;
+};
+
+// Claims the next piece of at most `chunk` elements. Returns 0 and the
+// piece in [*begin, *end), or -1 when the range is exhausted.
+static int claim(struct hybrid_work *work, size_t chunk, size_t *begin, size_t *end)
+{
+    size_t next = __atomic_load_n(&work->next, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        if (next >= work->length)
+            return -1;
+
+        size_t left = work->length - next;
+        size_t size = chunk;
+        if (size > left / HYBRID_TAIL_SHARE)
+            size = left / HYBRID_TAIL_SHARE;
+        if (size < HYBRID_CPU_CHUNK)
+            size = HYBRID_CPU_CHUNK;
+        // The device claims into buffers of `chunk` elements
+        if (size > chunk)
+            size = chunk;
+        if (size > left)
+            size = left;
+
+        // On failure next is reloaded with the current value
+        if (__atomic_compare_exchange_n(&work->next, &next, next + size, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            *begin = next;
+            *end   = next + size;
+            return 0;
+        }
+    }
+}
+
+static void *hybrid_cpu_worker(void *arg)
+{
+    struct hybrid_worker *w    = (struct hybrid_worker*) arg;
+    struct hybrid_work   *work = w->work;
+
+    size_t begin, end;
+    while (claim(work, HYBRID_CPU_CHUNK, &begin, &end) == 0)
+    {
+        double start = wtime();
+        cpu_cuboid_area_range(work->a, work->b, work->c, work->result, begin, end);
+        w->busy_time += wtime() - start;
+        w->chunks++;
+        w->elements += end - begin;
+    }
+
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+
+double run_hybrid(cl_context context, cl_command_queue commands, cl_kernel kernel_cuboid_area,
+                  const int *a, const int *b, const int *c, int *result,
+                  size_t length, size_t gpu_chunk, int cpu_workers, struct hybrid_stats *stats)
+{
+    int err;
+
+    if (gpu_chunk == 0 || gpu_chunk > length)
+        gpu_chunk = length;
+    if (cpu_workers < 1)
+        cpu_workers = 1;
+
+    struct hybrid_work work;
+    work.next   = 0;
+    work.length = length;
+    work.a      = a;
+    work.b      = b;
+    work.c      = c;
+    work.result = result;
+
+    size_t bytes = sizeof(cl_int) * gpu_chunk;
+    cl_mem d_a = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_a");
+    cl_mem d_b = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_b");
+    cl_mem d_c = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_c");
+    cl_mem d_result = clCreateBuffer(context, CL_MEM_WRITE_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_result");
+
+    err  = clSetKernelArg(kernel_cuboid_area, 0, sizeof(cl_mem), &d_a);
+    err |= clSetKernelArg(kernel_cuboid_area, 1, sizeof(cl_mem), &d_b);
+    err |= clSetKernelArg(kernel_cuboid_area, 2, sizeof(cl_mem), &d_c);
+    err |= clSetKernelArg(kernel_cuboid_area, 3, sizeof(cl_mem), &d_result);
+    checkError(err, "Setting kernel arguments");
+
+    pthread_t            threads[cpu_workers];
+    struct hybrid_worker workers[cpu_workers];
+
+    double hybrid_time = wtime();
+
+    for (int t = 0; t < cpu_workers; t++)
+    {
+        workers[t].work      = &work;
+        workers[t].chunks    = 0;
+        workers[t].elements  = 0;
+        workers[t].busy_time = 0.0;
+        if (pthread_create(&threads[t], NULL, hybrid_cpu_worker, &workers[t]) != 0)
+        {
+            printf("Error: cannot start CPU worker %d\n", t);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The device is fed from this thread
+    stats->gpu_chunks    = 0;
+    stats->gpu_elements  = 0;
+    stats->gpu_busy_time = 0.0;
+
+    size_t begin, end;
+    while (claim(&work, gpu_chunk, &begin, &end) == 0)
+    {
+        double start = wtime();
+
+        size_t count = end - begin;
+        size_t used  = sizeof(cl_int) * count;
+
+        cl_uint n = (cl_uint) count;
+        err = clSetKernelArg(kernel_cuboid_area, 4, sizeof(cl_uint), &n);
+        checkError(err, "Setting kernel element count");
+
+        err  = clEnqueueWriteBuffer(commands, d_a, CL_FALSE, 0, used, a + begin, 0, NULL, NULL);
+        err |= clEnqueueWriteBuffer(commands, d_b, CL_FALSE, 0, used, b + begin, 0, NULL, NULL);
+        err |= clEnqueueWriteBuffer(commands, d_c, CL_FALSE, 0, used, c + begin, 0, NULL, NULL);
+        checkError(err, "Copying chunk to device");
+
+        err = clEnqueueNDRangeKernel(commands, kernel_cuboid_area, 1, NULL, &count, NULL, 0, NULL, NULL);
+        checkError(err, "Enqueueing kernel");
+
+        err = clEnqueueReadBuffer(commands, d_result, CL_TRUE, 0, used, result + begin, 0, NULL, NULL);
+        checkError(err, "Reading back chunk");
+
+        double busy = wtime() - start;
+        telemetry_observe(TELEMETRY_CHUNK, busy);
+        telemetry_add(TELEMETRY_BYTES_TO_DEVICE, 3 * used);
+        telemetry_add(TELEMETRY_BYTES_FROM_DEVICE, used);
+        telemetry_add(TELEMETRY_ELEMENTS, count);
+        telemetry_add(TELEMETRY_KERNELS, 1);
+
+        stats->gpu_busy_time += busy;
+        stats->gpu_chunks++;
+        stats->gpu_elements += count;
+    }
+
+    stats->cpu_workers   = cpu_workers;
+    stats->cpu_chunks    = 0;
+    stats->cpu_elements  = 0;
+    stats->cpu_busy_time = 0.0;
+    for (int t = 0; t < cpu_workers; t++)
+    {
+        pthread_join(threads[t], NULL);
+        stats->cpu_chunks    += workers[t].chunks;
+        stats->cpu_elements  += workers[t].elements;
+        stats->cpu_busy_time += workers[t].busy_time;
+    }
+
+    hybrid_time = wtime() - hybrid_time;
+
+    clReleaseMemObject(d_a);
+    clReleaseMemObject(d_b);
+    clReleaseMemObject(d_c);
+    clReleaseMemObject(d_result);
+
+    return hybrid_time;
+}
+
+void hybrid_report(const struct hybrid_stats *stats, size_t length, double hybrid_time)
+{
+    // Rates while busy: what each side would sustain on its own
+    double gpu_rate = stats->gpu_busy_time > 0.0 ? stats->gpu_elements / stats->gpu_busy_time / 1.0e6 : 0.0;
+    double cpu_rate = stats->cpu_busy_time > 0.0 ?
+                      stats->cpu_elements / (stats->cpu_busy_time / stats->cpu_workers) / 1.0e6 : 0.0;
+
+    printf("\n%-22s %8s %12s %8s %14s\n", "side", "chunks", "elements", "share", "Melements/s");
+    printf("%-22s %8zu %12zu %7.2lf%% %14.2lf\n", "OpenCL device",
+           stats->gpu_chunks, stats->gpu_elements, 100.0 * stats->gpu_elements / length, gpu_rate);
+    printf("CPU (%3d workers)      %8zu %12zu %7.2lf%% %14.2lf\n", stats->cpu_workers,
+           stats->cpu_chunks, stats->cpu_elements, 100.0 * stats->cpu_elements / length, cpu_rate);
+    printf("Hybrid: %lf Melements/s, the sum of both sides is %lf\n",
+           length / hybrid_time / 1.0e6, gpu_rate + cpu_rate);
+}
@@ -0,0 +1,431 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    OpenCL C source of the cuboid kernels
+//
+//             cuboid_area            one cuboid per work-item, separate a/b/c
+//                                    arrays (SoA)
+//             cuboid_area_items      `items` cuboids per work-item, strided by
+//                                    the NDRange size
+//             cuboid_area_stride     grid-stride loop over 64-bit indices, one
+//                                    launch sized to the device for any n
+//             cuboid_area_vec{4,8,16} N cuboids per work-item with vloadN /
+//                                    vstoreN on the SoA arrays
+//             cuboid_area_packed     one cuboid per work-item, packed
+//                                    {a, b, c, pad} int4 records (AoS)
+//             cuboid_area_{uchar,ushort}
+//                                    8/16-bit SoA inputs, 64-bit results
+//             cuboid_metrics         volume, surface area and space diagonal
+//                                    in one pass, selected by a bitmask
+//             cuboid_area_reduce     sum/min/max of the areas, one partial per
+//                                    work-group (int_reduce: of a buffer)
+//             cuboid_volume_histogram
+//                                    histogram of the volumes
+//             cuboid_generate        Philox4x32-10 inputs from a seed, the
+//                                    same values as cpu_generate()
+//
+//------------------------------------------------------------------------------
+
+#include "cuboid.h"
+
+const char *OpenCL_code = "\n" \
+"// The NDRange may be rounded up to a multiple of the work-group size, so\n" \
+"// every kernel that takes n skips the work-items past the end        \n" \
+"__kernel void cuboid_area(                                            \n" \
+"   __global int* a,                                                   \n" \
+"   __global int* b,                                                   \n" \
+"   __global int* c,                                                   \n" \
+"   __global int* result,                                              \n" \
+"   const uint n)                                                      \n" \
+"{                                                                     \n" \
+"   uint i = get_global_id(0);                                         \n" \
+"   if (i < n)                                                         \n" \
+"      result[i] = 2 * ((a[i] * b[i]) + (b[i] * c[i]) +  (a[i] * c[i]));\n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"// Each work-item handles `items` cuboids spaced one NDRange apart, so\n" \
+"// neighbouring work-items still touch neighbouring elements          \n" \
+"__kernel void cuboid_area_items(                                      \n" \
+"   __global const int* a,                                             \n" \
+"   __global const int* b,                                             \n" \
+"   __global const int* c,                                             \n" \
+"   __global int* result,                                              \n" \
+"   const uint n,                                                      \n" \
+"   const uint items)                                                  \n" \
+"{                                                                     \n" \
+"   uint i = get_global_id(0);                                         \n" \
+"   uint stride = get_global_size(0);                                  \n" \
+"   for (uint k = 0; k < items && i < n; k++, i += stride)             \n" \
+"      result[i] = 2 * ((a[i] * b[i]) + (b[i] * c[i]) + (a[i] * c[i]));\n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"// Grid-stride loop with 64-bit indices: an NDRange sized to the device,\n" \
+"// not to n, covers any number of cuboids in one launch               \n" \
+"__kernel void cuboid_area_stride(                                     \n" \
+"   __global const int* a,                                             \n" \
+"   __global const int* b,                                             \n" \
+"   __global const int* c,                                             \n" \
+"   __global int* result,                                              \n" \
+"   const ulong n)                                                     \n" \
+"{                                                                     \n" \
+"   ulong stride = get_global_size(0);                                 \n" \
+"   for (ulong i = get_global_id(0); i < n; i += stride)               \n" \
+"      result[i] = 2 * ((a[i] * b[i]) + (b[i] * c[i]) + (a[i] * c[i]));\n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"// Vector variants: work-item i handles elements [i*N, i*N+N), the last\n" \
+"// work-item falls back to scalar code for the tail of a non-multiple n\n" \
+"__kernel void cuboid_area_vec4(                                       \n" \
+"   __global const int* a,                                             \n" \
+"   __global const int* b,                                             \n" \
+"   __global const int* c,                                             \n" \
+"   __global int* result,                                              \n" \
+"   const uint n)                                                      \n" \
+"{                                                                     \n" \
+"   uint i = get_global_id(0);                                         \n" \
+"   if ((i + 1) * 4 <= n) {                                            \n" \
+"      int4 va = vload4(i, a);                                         \n" \
+"      int4 vb = vload4(i, b);                                         \n" \
+"      int4 vc = vload4(i, c);                                         \n" \
+"      vstore4(2 * ((va * vb) + (vb * vc) + (va * vc)), i, result);    \n" \
+"   } else {                                                           \n" \
+"      for (uint j = i * 4; j < n; j++)                                \n" \
+"         result[j] = 2 * ((a[j] * b[j]) + (b[j] * c[j]) + (a[j] * c[j]));\n" \
+"   }                                                                  \n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"__kernel void cuboid_area_vec8(                                       \n" \
+"   __global const int* a,                                             \n" \
+"   __global const int* b,                                             \n" \
+"   __global const int* c,                                             \n" \
+"   __global int* result,                                              \n" \
+"   const uint n)                                                      \n" \
+"{                                                                     \n" \
+"   uint i = get_global_id(0);                                         \n" \
+"   if ((i + 1) * 8 <= n) {                                            \n" \
+"      int8 va = vload8(i, a);                                         \n" \
+"      int8 vb = vload8(i, b);                                         \n" \
+"      int8 vc = vload8(i, c);                                         \n" \
+"      vstore8(2 * ((va * vb) + (vb * vc) + (va * vc)), i, result);    \n" \
+"   } else {                                                           \n" \
+"      for (uint j = i * 8; j < n; j++)                                \n" \
+"         result[j] = 2 * ((a[j] * b[j]) + (b[j] * c[j]) + (a[j] * c[j]));\n" \
+"   }                                                                  \n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"__kernel void cuboid_area_vec16(                                      \n" \
+"   __global const int* a,                                             \n" \
+"   __global const int* b,                                             \n" \
+"   __global const int* c,                                             \n" \
+"   __global int* result,                                              \n" \
+"   const uint n)                                                      \n" \
+"{                                                                     \n" \
+"   uint i = get_global_id(0);                                         \n" \
+"   if ((i + 1) * 16 <= n) {                                           \n" \
+"      int16 va = vload16(i, a);                                       \n" \
+"      int16 vb = vload16(i, b);                                       \n" \
+"      int16 vc = vload16(i, c);                                       \n" \
+"      vstore16(2 * ((va * vb) + (vb * vc) + (va * vc)), i, result);   \n" \
+"   } else {                                                           \n" \
+"      for (uint j = i * 16; j < n; j++)                               \n" \
+"         result[j] = 2 * ((a[j] * b[j]) + (b[j] * c[j]) + (a[j] * c[j]));\n" \
+"   }                                                                  \n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"// Packed (AoS) layout: one int4 {a, b, c, pad} per cuboid, fetched with a\n" \
+"// single 16-byte load                                                \n" \
+"__kernel void cuboid_area_packed(                                     \n" \
+"   __global const int4* cuboids,                                      \n" \
+"   __global int* result)                                              \n" \
+"{                                                                     \n" \
+"   int i = get_global_id(0);                                          \n" \
+"   int4 v = cuboids[i];                                               \n" \
+"   result[i] = 2 * ((v.x * v.y) + (v.y * v.z) + (v.x * v.z));         \n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"// Narrow inputs: 8 or 16-bit dimensions cut the input bandwidth by 4x or\n" \
+"// 2x, and the area is accumulated in 64 bits so it cannot overflow   \n" \
+"__kernel void cuboid_area_uchar(                                      \n" \
+"   __global const uchar* a,                                           \n" \
+"   __global const uchar* b,                                           \n" \
+"   __global const uchar* c,                                           \n" \
+"   __global ulong* result)                                            \n" \
+"{                                                                     \n" \
+"   int i = get_global_id(0);                                          \n" \
+"   ulong x = a[i], y = b[i], z = c[i];                                \n" \
+"   result[i] = 2 * ((x * y) + (y * z) + (x * z));                     \n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"__kernel void cuboid_area_ushort(                                     \n" \
+"   __global const ushort* a,                                          \n" \
+"   __global const ushort* b,                                          \n" \
+"   __global const ushort* c,                                          \n" \
+"   __global ulong* result)                                            \n" \
+"{                                                                     \n" \
+"   int i = get_global_id(0);                                          \n" \
+"   ulong x = a[i], y = b[i], z = c[i];                                \n" \
+"   result[i] = 2 * ((x * y) + (y * z) + (x * z));                     \n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"// Fused metrics: a, b and c are read once and only the outputs selected\n" \
+"// in mask are written, the others may be NULL. The bits match enum metric\n" \
+"// in cuboid.h.                                                       \n" \
+"// A specialized build (spec.c) bakes the mask in with -D CUBOID_METRICS,\n" \
+"// so the unused stores are compiled out and the argument is ignored  \n" \
+"#ifdef CUBOID_METRICS                                                 \n" \
+"#define metric_on(m) (CUBOID_METRICS & (m))                           \n" \
+"#else                                                                 \n" \
+"#define metric_on(m) (mask & (m))                                     \n" \
+"#endif                                                                \n" \
+"                                                                      \n" \
+"__kernel void cuboid_metrics(                                         \n" \
+"   __global const int* a,                                             \n" \
+"   __global const int* b,                                             \n" \
+"   __global const int* c,                                             \n" \
+"   __global int* volume,                                              \n" \
+"   __global int* area,                                                \n" \
+"   __global float* diagonal,                                          \n" \
+"   const uint n,                                                      \n" \
+"   const uint mask)                                                   \n" \
+"{                                                                     \n" \
+"   uint i = get_global_id(0);                                         \n" \
+"   if (i >= n)                                                        \n" \
+"      return;                                                         \n" \
+"   int x = a[i], y = b[i], z = c[i];                                  \n" \
+"   if (metric_on(1u))                                                 \n" \
+"      volume[i] = x * y * z;                                          \n" \
+"   if (metric_on(2u))                                                 \n" \
+"      area[i] = 2 * ((x * y) + (y * z) + (x * z));                    \n" \
+"   if (metric_on(4u))                                                 \n" \
+"      diagonal[i] = sqrt((float) (x * x + y * y + z * z));            \n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"// Specialized variant, only in a program built by spec.c: CUBOID_WIDTH\n" \
+"// cuboids per vector and CUBOID_ITEMS vectors per work-item, spaced one\n" \
+"// NDRange apart, are compile-time constants, so the loop has a fixed trip\n" \
+"// count and the loads have a fixed width                             \n" \
+"#ifdef CUBOID_WIDTH                                                   \n" \
+"#define SPEC_CAT_(x, y) x##y                                          \n" \
+"#define SPEC_CAT(x, y) SPEC_CAT_(x, y)                                \n" \
+"#if CUBOID_WIDTH == 1                                                 \n" \
+"#define spec_int int                                                  \n" \
+"#define spec_load(i, p) ((p)[i])                                      \n" \
+"#define spec_store(v, i, p) ((p)[i] = (v))                            \n" \
+"#else                                                                 \n" \
+"#define spec_int SPEC_CAT(int, CUBOID_WIDTH)                          \n" \
+"#define spec_load(i, p) SPEC_CAT(vload, CUBOID_WIDTH)(i, p)           \n" \
+"#define spec_store(v, i, p) SPEC_CAT(vstore, CUBOID_WIDTH)(v, i, p)   \n" \
+"#endif                                                                \n" \
+"                                                                      \n" \
+"__kernel void cuboid_area_spec(                                       \n" \
+"   __global const int* a,                                             \n" \
+"   __global const int* b,                                             \n" \
+"   __global const int* c,                                             \n" \
+"   __global int* result,                                              \n" \
+"   const uint n)                                                      \n" \
+"{                                                                     \n" \
+"   uint v = get_global_id(0);                                         \n" \
+"   uint stride = get_global_size(0);                                  \n" \
+"   for (uint k = 0; k < CUBOID_ITEMS; k++, v += stride) {             \n" \
+"      if ((v + 1) * CUBOID_WIDTH <= n) {                              \n" \
+"         spec_int va = spec_load(v, a);                               \n" \
+"         spec_int vb = spec_load(v, b);                               \n" \
+"         spec_int vc = spec_load(v, c);                               \n" \
+"         spec_store(2 * ((va * vb) + (vb * vc) + (va * vc)), v, result);\n" \
+"      } else if (v * CUBOID_WIDTH < n) {                              \n" \
+"         for (uint j = v * CUBOID_WIDTH; j < n; j++)                  \n" \
+"            result[j] = 2 * ((a[j] * b[j]) + (b[j] * c[j]) + (a[j] * c[j]));\n" \
+"      }                                                               \n" \
+"   }                                                                  \n" \
+"}                                                                     \n" \
+"#endif                                                                \n" \
+"                                                                      \n" \
+"// Aggregates: every work-item folds a grid-strided range into a private\n" \
+"// sum/min/max, the work-group combines them through local memory (after a\n" \
+"// sub-group reduction when cl_khr_subgroups is available) and writes one\n" \
+"// partial per work-group. Only the partials are read back.           \n" \
+"#ifdef cl_khr_subgroups                                               \n" \
+"#pragma OPENCL EXTENSION cl_khr_subgroups : enable                    \n" \
+"#endif                                                                \n" \
+"                                                                      \n" \
+"void reduce_group(long sum, int lo, int hi,                           \n" \
+"                  __local long* lsum, __local int* lmin, __local int* lmax,\n" \
+"                  __global long* part_sum, __global int* part_min, __global int* part_max)\n" \
+"{                                                                     \n" \
+"   uint lid = get_local_id(0);                                        \n" \
+"#ifdef cl_khr_subgroups                                               \n" \
+"   sum = sub_group_reduce_add(sum);                                   \n" \
+"   lo = sub_group_reduce_min(lo);                                     \n" \
+"   hi = sub_group_reduce_max(hi);                                     \n" \
+"   uint active = get_num_sub_groups();                                \n" \
+"   if (get_sub_group_local_id() == 0) {                               \n" \
+"      lsum[get_sub_group_id()] = sum;                                 \n" \
+"      lmin[get_sub_group_id()] = lo;                                  \n" \
+"      lmax[get_sub_group_id()] = hi;                                  \n" \
+"   }                                                                  \n" \
+"#else                                                                 \n" \
+"   uint active = get_local_size(0);                                   \n" \
+"   lsum[lid] = sum;                                                   \n" \
+"   lmin[lid] = lo;                                                    \n" \
+"   lmax[lid] = hi;                                                    \n" \
+"#endif                                                                \n" \
+"   barrier(CLK_LOCAL_MEM_FENCE);                                      \n" \
+"   while (active > 1) {                                               \n" \
+"      uint half = (active + 1) / 2;                                   \n" \
+"      if (lid < active - half) {                                      \n" \
+"         lsum[lid] += lsum[lid + half];                               \n" \
+"         lmin[lid] = min(lmin[lid], lmin[lid + half]);                \n" \
+"         lmax[lid] = max(lmax[lid], lmax[lid + half]);                \n" \
+"      }                                                               \n" \
+"      barrier(CLK_LOCAL_MEM_FENCE);                                   \n" \
+"      active = half;                                                  \n" \
+"   }                                                                  \n" \
+"   if (lid == 0) {                                                    \n" \
+"      part_sum[get_group_id(0)] = lsum[0];                            \n" \
+"      part_min[get_group_id(0)] = lmin[0];                            \n" \
+"      part_max[get_group_id(0)] = lmax[0];                            \n" \
+"   }                                                                  \n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"// Fused: the area of each cuboid only ever lives in a register       \n" \
+"__kernel void cuboid_area_reduce(                                     \n" \
+"   __global const int* a,                                             \n" \
+"   __global const int* b,                                             \n" \
+"   __global const int* c,                                             \n" \
+"   const uint n,                                                      \n" \
+"   __global long* part_sum,                                           \n" \
+"   __global int* part_min,                                            \n" \
+"   __global int* part_max,                                            \n" \
+"   __local long* lsum,                                                \n" \
+"   __local int* lmin,                                                 \n" \
+"   __local int* lmax)                                                 \n" \
+"{                                                                     \n" \
+"   long sum = 0;                                                      \n" \
+"   int lo = INT_MAX, hi = INT_MIN;                                    \n" \
+"   for (uint i = get_global_id(0); i < n; i += get_global_size(0)) {  \n" \
+"      int v = 2 * ((a[i] * b[i]) + (b[i] * c[i]) + (a[i] * c[i]));    \n" \
+"      sum += v;                                                       \n" \
+"      lo = min(lo, v);                                                \n" \
+"      hi = max(hi, v);                                                \n" \
+"   }                                                                  \n" \
+"   reduce_group(sum, lo, hi, lsum, lmin, lmax, part_sum, part_min, part_max);\n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"// Unfused: aggregates a result already in device memory              \n" \
+"__kernel void int_reduce(                                             \n" \
+"   __global const int* values,                                        \n" \
+"   const uint n,                                                      \n" \
+"   __global long* part_sum,                                           \n" \
+"   __global int* part_min,                                            \n" \
+"   __global int* part_max,                                            \n" \
+"   __local long* lsum,                                                \n" \
+"   __local int* lmin,                                                 \n" \
+"   __local int* lmax)                                                 \n" \
+"{                                                                     \n" \
+"   long sum = 0;                                                      \n" \
+"   int lo = INT_MAX, hi = INT_MIN;                                    \n" \
+"   for (uint i = get_global_id(0); i < n; i += get_global_size(0)) {  \n" \
+"      int v = values[i];                                              \n" \
+"      sum += v;                                                       \n" \
+"      lo = min(lo, v);                                                \n" \
+"      hi = max(hi, v);                                                \n" \
+"   }                                                                  \n" \
+"   reduce_group(sum, lo, hi, lsum, lmin, lmax, part_sum, part_min, part_max);\n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"// Histogram of volumes in bins of bin_width, the last bin also takes every\n" \
+"// larger volume. Counted in local memory, merged with one atomic per bin\n" \
+"// and work-group.                                                    \n" \
+"__kernel void cuboid_volume_histogram(                                \n" \
+"   __global const int* a,                                             \n" \
+"   __global const int* b,                                             \n" \
+"   __global const int* c,                                             \n" \
+"   const uint n,                                                      \n" \
+"   const uint bin_width,                                              \n" \
+"   const uint bins,                                                   \n" \
+"   __global uint* hist,                                               \n" \
+"   __local uint* lhist)                                               \n" \
+"{                                                                     \n" \
+"   for (uint j = get_local_id(0); j < bins; j += get_local_size(0))   \n" \
+"      lhist[j] = 0;                                                   \n" \
+"   barrier(CLK_LOCAL_MEM_FENCE);                                      \n" \
+"   for (uint i = get_global_id(0); i < n; i += get_global_size(0)) {  \n" \
+"      int v = a[i] * b[i] * c[i];                                     \n" \
+"      uint bin = v > 0 ? min((uint) v / bin_width, bins - 1) : 0;     \n" \
+"      atomic_inc(&lhist[bin]);                                        \n" \
+"   }                                                                  \n" \
+"   barrier(CLK_LOCAL_MEM_FENCE);                                      \n" \
+"   for (uint j = get_local_id(0); j < bins; j += get_local_size(0))   \n" \
+"      if (lhist[j] != 0)                                              \n" \
+"         atomic_add(&hist[j], lhist[j]);                              \n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"// Philox4x32-10 counter-based generator: the cuboid index is the counter\n" \
+"// and the seed the key, so any element can be generated independently and\n" \
+"// cpu_generate() reproduces exactly the same values on the host      \n" \
+"uint4 philox4x32(uint4 ctr, uint2 key)                                \n" \
+"{                                                                     \n" \
+"   for (int r = 0; r < 10; r++) {                                     \n" \
+"      if (r > 0)                                                      \n" \
+"         key += (uint2) (0x9E3779B9u, 0xBB67AE85u);                   \n" \
+"      uint hi0 = mul_hi(0xD2511F53u, ctr.x), lo0 = 0xD2511F53u * ctr.x;\n" \
+"      uint hi1 = mul_hi(0xCD9E8D57u, ctr.z), lo1 = 0xCD9E8D57u * ctr.z;\n" \
+"      ctr = (uint4) (hi1 ^ ctr.y ^ key.x, lo1, hi0 ^ ctr.w ^ key.y, lo0);\n" \
+"   }                                                                  \n" \
+"   return ctr;                                                        \n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"__kernel void cuboid_generate(                                        \n" \
+"   __global int* a,                                                   \n" \
+"   __global int* b,                                                   \n" \
+"   __global int* c,                                                   \n" \
+"   const uint n,                                                      \n" \
+"   const ulong first,                                                 \n" \
+"   const ulong seed)                                                  \n" \
+"{                                                                     \n" \
+"   uint i = get_global_id(0);                                         \n" \
+"   if (i >= n)                                                        \n" \
+"      return;                                                         \n" \
+"   ulong index = first + i;                                           \n" \
+"   uint4 r = philox4x32((uint4) ((uint) index, (uint) (index >> 32), 0u, 0u),\n" \
+"                        (uint2) ((uint) seed, (uint) (seed >> 32)));  \n" \
+"   a[i] = (int) (r.x % 9u) + 1;                                       \n" \
+"   b[i] = (int) (r.y % 9u) + 1;                                       \n" \
+"   c[i] = (int) (r.z % 9u) + 1;                                       \n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"// SplitMix64 finalizer, the same as mix64() in verify.c              \n" \
+"ulong verify_mix(ulong x)                                             \n" \
+"{                                                                     \n" \
+"   x ^= x >> 30;                                                      \n" \
+"   x *= 0xBF58476D1CE4E5B9UL;                                         \n" \
+"   x ^= x >> 27;                                                      \n" \
+"   x *= 0x94D049BB133111EBUL;                                         \n" \
+"   x ^= x >> 31;                                                      \n" \
+"   return x;                                                          \n" \
+"}                                                                     \n" \
+"                                                                      \n" \
+"// Order-independent checksum of a result: the sum of verify_mix over \n" \
+"// (index, value) pairs, one partial per work-group. The work-group size\n" \
+"// must be a power of two.                                            \n" \
+"__kernel void cuboid_checksum(                                        \n" \
+"   __global const int* values,                                        \n" \
+"   const uint n,                                                      \n" \
+"   __global ulong* partial,                                           \n" \
+"   __local ulong* scratch)                                            \n" \
+"{                                                                     \n" \
+"   ulong sum = 0;                                                     \n" \
+"   for (uint i = get_global_id(0); i < n; i += get_global_size(0))    \n" \
+"      sum += verify_mix(((ulong) i << 32) | (uint) values[i]);        \n" \
+"                                                                      \n" \
+"   uint lid = get_local_id(0);                                        \n" \
+"   scratch[lid] = sum;                                                \n" \
+"   barrier(CLK_LOCAL_MEM_FENCE);                                      \n" \
+"   for (uint half = get_local_size(0) / 2; half > 0; half /= 2) {     \n" \
+"      if (lid < half)                                                 \n" \
+"         scratch[lid] += scratch[lid + half];                         \n" \
+"      barrier(CLK_LOCAL_MEM_FENCE);                                   \n" \
+"   }                                                                  \n" \
+"   if (lid == 0)                                                      \n" \
+"      partial[get_group_id(0)] = scratch[0];                          \n" \
+"}                                                                     \n" \
+"\n";
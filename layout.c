@@ -0,0 +1,74 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Packed (array of structures) input layout
+//
+//             Each cuboid is stored as one cl_int4 {a, b, c, pad}, so the
+//             device fetches a whole cuboid with a single coalesced 16-byte
+//             load instead of three 4-byte loads from separate arrays.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+void pack_cuboids(const int *a, const int *b, const int *c, cl_int4 *packed, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        packed[i].s[0] = a[i];
+        packed[i].s[1] = b[i];
+        packed[i].s[2] = c[i];
+        packed[i].s[3] = 0;
+    }
+}
+
+double run_packed(cl_context context, cl_command_queue commands, cl_kernel kernel_packed,
+                  const cl_int4 *packed, int *result, size_t length, double *total_time)
+{
+    int err;
+
+    size_t global = length;
+
+    cl_mem d_cuboids;
+    cl_mem d_result;
+
+    d_cuboids = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_int4) * length, NULL, &err);
+    checkError(err, "Creating buffer d_cuboids");
+
+    d_result = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_int) * length, NULL, &err);
+    checkError(err, "Creating buffer d_result");
+
+    *total_time = wtime();
+
+    err = clEnqueueWriteBuffer(commands, d_cuboids, CL_TRUE, 0, sizeof(cl_int4) * length, packed, 0, NULL, NULL);
+    checkError(err, "Copying packed cuboids to device at d_cuboids");
+
+    err  = clSetKernelArg(kernel_packed, 0, sizeof(cl_mem), &d_cuboids);
+    err |= clSetKernelArg(kernel_packed, 1, sizeof(cl_mem), &d_result);
+    checkError(err, "Setting packed kernel arguments");
+
+    double cl_time = wtime();
+
+    err = clEnqueueNDRangeKernel(commands, kernel_packed, 1, NULL, &global, NULL, 0, NULL, NULL);
+    checkError(err, "Enqueueing packed kernel");
+
+    err = clFinish(commands);
+    checkError(err, "Waiting for packed kernel to finish");
+
+    cl_time = wtime() - cl_time;
+    printf("\nThe OpenCL kernel ran in %lf seconds (packed layout)\n", cl_time);
+
+    err = clEnqueueReadBuffer(commands, d_result, CL_TRUE, 0, sizeof(cl_int) * length, result, 0, NULL, NULL);
+    checkError(err, "Reading back d_result");
+
+    *total_time = wtime() - *total_time;
+
+    clReleaseMemObject(d_cuboids);
+    clReleaseMemObject(d_result);
+
+    return cl_time;
+}
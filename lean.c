@@ -0,0 +1,178 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Memory-lean copy path for large batches on small nodes
+//
+//             The regular copy path holds five full arrays on the host (three
+//             inputs, the device result and the CPU engine's result) and
+//             four buffers on the device. The lean path keeps three of each:
+//
+//             - the kernel writes its result over d_c, which each work-item
+//               reads before it writes the same element, so there is no
+//               result buffer on the device;
+//             - the result comes back LEAN_CHUNK elements at a time through
+//               one small host buffer, is checked against the inputs with
+//               verify_range() and lands over c. The pages of a and b below
+//               the last checked chunk are then given back to the kernel, so
+//               resident memory shrinks while the result is read.
+//
+//             At the end c holds the results and a and b are empty. The
+//             caller times its host baselines before, while the inputs are
+//             still there.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+size_t peak_rss(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+#ifdef __APPLE__
+    return (size_t) usage.ru_maxrss;            // bytes
+#else
+    return (size_t) usage.ru_maxrss * 1024;     // kilobytes
+#endif
+}
+
+// Gives the whole pages of elements [*from, to) of an array back to the
+// kernel, they read as zero afterwards. *from moves to the first element
+// not given back, the start of a page the next call can complete. Returns
+// the bytes given back.
+static size_t release_pages(int *array, size_t *from, size_t to)
+{
+    size_t page  = (size_t) sysconf(_SC_PAGESIZE);
+    size_t begin = ((size_t) (array + *from) + page - 1) / page * page;
+    size_t end   = (size_t) (array + to) / page * page;
+
+    if (end <= begin)
+        return 0;
+
+    madvise((void*) begin, end - begin, MADV_DONTNEED);
+    *from = (end - (size_t) array) / sizeof(int);
+
+    return end - begin;
+}
+
+//------------------------------------------------------------------------------
+
+double run_lean(cl_context context, cl_command_queue commands, cl_program program,
+                int *a, int *b, int *c, size_t length, const struct launch_config *lc,
+                enum verify_mode mode, size_t samples, struct verify_report *report,
+                struct lean_stats *stats, double *total_time)
+{
+    int err;
+
+    size_t bytes = sizeof(cl_int) * length;
+
+    cl_kernel kernel = clCreateKernel(program, lc->items > 1 ? "cuboid_area_items" : "cuboid_area", &err);
+    checkError(err, "Creating lean kernel");
+
+    cl_mem d_a = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_a");
+    cl_mem d_b = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_b");
+    cl_mem d_c = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_c");
+
+    stats->device_bytes = 3 * (cl_ulong) bytes;
+    stats->copy_bytes   = 4 * (cl_ulong) bytes;
+    stats->released     = 0;
+
+    *total_time = wtime();
+
+    err  = clEnqueueWriteBuffer(commands, d_a, CL_TRUE, 0, bytes, a, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(commands, d_b, CL_TRUE, 0, bytes, b, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(commands, d_c, CL_TRUE, 0, bytes, c, 0, NULL, NULL);
+    checkError(err, "Copying the inputs to the device");
+
+    // d_c is both the third input and the result
+    cl_uint n = (cl_uint) length;
+    err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_a);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_b);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_c);
+    err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_c);
+    err |= clSetKernelArg(kernel, 4, sizeof(cl_uint), &n);
+    if (lc->items > 1)
+        err |= clSetKernelArg(kernel, 5, sizeof(cl_uint), &lc->items);
+    checkError(err, "Setting lean kernel arguments");
+
+    double cl_time = wtime();
+
+    size_t global = launch_global(lc, (length + lc->items - 1) / lc->items);
+    err = clEnqueueNDRangeKernel(commands, kernel, 1, NULL, &global, lc->local > 0 ? &lc->local : NULL,
+                                 0, NULL, NULL);
+    checkError(err, "Enqueueing lean kernel");
+    err = clFinish(commands);
+    checkError(err, "Waiting for lean kernel to finish");
+
+    cl_time = wtime() - cl_time;
+    printf("\nThe OpenCL kernel ran in %lf seconds (result over d_c)\n", cl_time);
+
+    // A checksum is taken of the whole result at once, on the device
+    if (mode == VERIFY_CHECKSUM)
+    {
+        cl_kernel kernel_checksum = clCreateKernel(program, "cuboid_checksum", &err);
+        checkError(err, "Creating checksum kernel");
+        cl_ulong actual = device_checksum(commands, kernel_checksum, d_c, length);
+        clReleaseKernel(kernel_checksum);
+
+        verify_checksum(a, b, c, length, actual, 1, report);
+    }
+    else
+        verify_begin(report, mode);
+
+    size_t chunk = length < LEAN_CHUNK ? length : LEAN_CHUNK;
+    int   *piece = (int*) malloc(sizeof(int) * chunk);
+    if (piece == NULL)
+    {
+        printf("Error: cannot allocate the lean read-back buffer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t freed_a = 0, freed_b = 0;
+    for (size_t offset = 0; offset < length; offset += chunk)
+    {
+        size_t count = offset + chunk > length ? length - offset : chunk;
+
+        err = clEnqueueReadBuffer(commands, d_c, CL_TRUE, sizeof(cl_int) * offset, sizeof(cl_int) * count,
+                                  piece, 0, NULL, NULL);
+        checkError(err, "Reading back a lean result chunk");
+
+        // This chunk's share of the samples, the shares add up to exactly `samples`
+        size_t share = (size_t) ((cl_ulong) samples * (offset + count) / length -
+                                 (cl_ulong) samples * offset / length);
+        verify_range(a, b, c, piece, offset, count, share, report);
+        memcpy(c + offset, piece, sizeof(int) * count);
+
+        // A page that reaches into the next chunk waits for it
+        stats->released += release_pages(a, &freed_a, offset + count);
+        stats->released += release_pages(b, &freed_b, offset + count);
+    }
+
+    *total_time = wtime() - *total_time;
+
+    telemetry_add(TELEMETRY_BYTES_TO_DEVICE, 3 * bytes);
+    telemetry_add(TELEMETRY_BYTES_FROM_DEVICE, bytes);
+    telemetry_add(TELEMETRY_ELEMENTS, length);
+    telemetry_add(TELEMETRY_KERNELS, 1);
+
+    free(piece);
+    clReleaseMemObject(d_a);
+    clReleaseMemObject(d_b);
+    clReleaseMemObject(d_c);
+    clReleaseKernel(kernel);
+
+    return cl_time;
+}
@@ -9,7 +9,7 @@
 //
 //
 //
-// New Purpose:  Calculate surface area of 75 millions of cuboids
+// New Purpose:  Calculate surface area of 75 millions of cuboids (by default)
 //               Show 100 first items of the result (both from OpenCL and sequential code)
 //               Compare the speed difference with sequential code
 //
@@ -20,33 +20,1604 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <sys/types.h>
-#ifdef __APPLE__
-#include <OpenCL/opencl.h>
 #include <unistd.h>
+
+#include "cuboid.h"
+#include "cuboid_engine.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+#define DEFAULT_LENGTH (1024 * 1024 * 75)
+
+//------------------------------------------------------------------------------
+
+enum mem_mode {
+    MEM_COPY,           // calloc'ed host arrays, explicit write/read
+    MEM_ZERO_COPY,      // CL_MEM_ALLOC_HOST_PTR buffers, map/unmap (zerocopy.c)
+    MEM_COMPARE         // run both and compare them
+};
+
+enum layout {
+    LAYOUT_SOA,         // separate a, b and c arrays
+    LAYOUT_AOS          // one packed cl_int4 per cuboid (layout.c)
+};
+
+struct options {
+    size_t length;      // number of cuboids
+    struct launch_config launch; // copy path work-group size and cuboids per work-item
+    int    launch_set;  // launch given on the command line or environment
+    int    tune;        // tune the launch configuration and exit (tune.c)
+    int    stream;      // use the chunked streaming pipeline (stream.c)
+    size_t chunk;       // elements per streamed chunk
+    enum mem_mode mem;  // host/device buffer strategy
+    enum layout layout; // input layout handed to the device
+    int    vector;      // cuboids per work-item for the SoA kernel (1, 4, 8, 16)
+    enum elem_type type;// element type of the inputs (narrow.c)
+    int    multi;       // split the range over every device (multi.c)
+    double peak_bw;     // device peak bandwidth in GB/s for the profile, 0 if unknown
+    int    bench;       // run the benchmark sweep (bench.c)
+    unsigned metrics;   // metric bitmask for the fused kernel (metrics.c), 0 for cuboid_area
+    int    aggregate;   // 0 off, 1 fused with the area, 2 over a stored result (reduce.c)
+    cl_uint bins;       // volume histogram bins
+    cl_uint bin_width;  // volume range of each bin
+    int    generate;    // counter-based inputs instead of rand() (rng.c)
+    cl_ulong seed;      // key of the generator
+    int    batches;     // run this many batches through one engine (engine.c)
+    int    inflight;    // asynchronous batches in flight, 1 for blocking submits
+    const char *input;  // dataset file to process (dataset.c), NULL for generated inputs
+    const char *save;   // dataset file to write the inputs and results to
+    int    filter;      // records from stdin to results on stdout (filter.c)
+    size_t frame;       // records per filter frame
+    enum verify_mode verify; // how the results are checked (verify.c)
+    size_t samples;     // elements checked by --verify=sample
+    int    specialize;  // build a variant for the device (spec.c)
+    int    fast_math;   // relaxed math options in the variant
+    int    hybrid;      // split the range between the device and the CPU (hybrid.c)
+    int    graph;       // stream as a task graph on an out-of-order queue (graph.c)
+    const char *telemetry; // telemetry export file (telemetry.c), "-" for stdout, NULL for none
+    enum telemetry_format telemetry_format;
+    unsigned telemetry_interval; // ms between snapshots, 0 for one at exit
+    int    plan;        // probe the devices and let the planner pick the engine (probe.c)
+    int    coalesce;    // requests of --length cuboids through the coalescer (coalesce.c)
+    int    clients;     // threads submitting them
+    unsigned window;    // coalescing window in microseconds
+    int    pinned;      // stream through pinned host staging buffers (pinned.c)
+    int    stride;      // copy path with the grid-stride kernel (stride.c)
+    int    lean;        // three host arrays and three device buffers (lean.c)
+    int    resilient;   // --batches as resumable jobs with retries and CPU fallback
+    struct bench_options bo;
+};
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options]\n", name);
+    printf("  --length=N      number of cuboids (default %d)\n", DEFAULT_LENGTH);
+    printf("  --local=N       work-group size of the copy path, 0 for the runtime's choice\n");
+    printf("  --items=N       cuboids per work-item of the scalar copy path (default 1)\n");
+    printf("  --tune          find the fastest --local/--items for the device, save it and exit\n");
+    printf("  --stream        stream the input through the device in chunks\n");
+    printf("  --chunk=N       elements per streamed chunk (default %d)\n", 4 * 1024 * 1024);
+    printf("  --mem=MODE      copy (default), zero-copy, or compare to run both\n");
+    printf("  --layout=L      soa (default) or aos for packed int4 records\n");
+    printf("  --vector=N      cuboids per work-item: 1 (default), 4, 8 or 16\n");
+    printf("  --type=T        input element type: int (default), ushort or uchar\n");
+    printf("  --multi         split the work over every device of every platform\n");
+    printf("  --peak-bw=GB/s  device peak memory bandwidth for the profile report\n");
+    printf("  --bench         sweep problem sizes and report per-stage statistics\n");
+    printf("  --warmup=N      unmeasured runs per size (default 2)\n");
+    printf("  --iterations=N  measured runs per size (default 10)\n");
+    printf("  --bench-min=N   first size of the sweep in elements (default 1024)\n");
+    printf("  --bench-max=N   last size of the sweep (default twice device memory)\n");
+    printf("  --format=F      benchmark output: text (default), csv or json\n");
+    printf("  --output=FILE   write the benchmark results to FILE instead of stdout\n");
+    printf("  --metrics=LIST  fused volume,area,diagonal (or all) in one pass\n");
+    printf("  --aggregate[=M] sum/min/max of the areas and a volume histogram on the device,\n");
+    printf("                  fused (default) or unfused over a stored result\n");
+    printf("  --bins=N        volume histogram bins (default 64)\n");
+    printf("  --bin-width=N   volumes per histogram bin (default 16)\n");
+    printf("  --generate[=S]  Philox inputs from seed S (default 1), generated on the device\n");
+    printf("                  by the copy path and on every CPU thread otherwise\n");
+    printf("  --batches=N     submit N batches of up to --length cuboids to one reusable engine\n");
+    printf("  --inflight=K    keep up to K (max %d) --batches in flight asynchronously\n", CUBOID_ENGINE_SLOTS);
+    printf("  --input=FILE    stream the cuboids of a dataset file through the device\n");
+    printf("  --save=FILE     write the inputs and results as a dataset file, in place\n");
+    printf("                  when FILE is the --input file\n");
+    printf("  --filter        read {a,b,c} int32 records from stdin, write int32 areas to stdout\n");
+    printf("  --frame=N       records per --filter frame (default %d)\n", 64 * 1024);
+    printf("  --verify=MODE   full (default), sample, checksum or none\n");
+    printf("  --samples=N     elements checked by --verify=sample (default %d)\n", 1024 * 1024);
+    printf("  --specialize    build a kernel variant specialized for the device with -D defines\n");
+    printf("  --fast-math     add -cl-mad-enable -cl-fast-relaxed-math to the --specialize build\n");
+    printf("  --hybrid        compute on the device and every CPU core at once, --chunk at a time\n");
+    printf("  --graph         stream --chunk at a time as a graph of events on an out-of-order queue\n");
+    printf("  --telemetry=FILE export counters and stage latency histograms to FILE (- for stdout)\n");
+    printf("  --telemetry-format=F  prometheus (default) or json\n");
+    printf("  --telemetry-interval=MS  write a snapshot every MS milliseconds, not just at exit\n");
+    printf("  --plan          probe every device and pick the device, engine, chunk and vector width\n");
+    printf("  --coalesce=N    send N requests of --length cuboids, one launch each, then coalesced\n");
+    printf("                  into dispatches of up to --chunk cuboids\n");
+    printf("  --clients=T     threads sending the --coalesce requests (default: one per CPU thread)\n");
+    printf("  --window=US     longest a request waits for others to join its dispatch (default 200)\n");
+    printf("  --pinned        stage --stream chunks through pinned host memory\n");
+    printf("  --grid-stride   one launch sized to the device, looping over 64-bit indices,\n");
+    printf("                  timed against one work-item per cuboid\n");
+    printf("  --lean          copy path with the result over c, read back and checked in chunks\n");
+    printf("  --resilient     run --batches --chunk at a time, halving the chunk on allocation\n");
+    printf("                  failures and moving to the CPU engine if the device is lost\n");
+    printf("  --help          show this message\n");
+    printf("CUBOID_LENGTH, CUBOID_LOCAL and CUBOID_ITEMS set the defaults of\n");
+    printf("--length, --local and --items. Without either, a configuration saved by\n");
+    printf("--tune for the device is used.\n");
+}
+
+// Exits on anything that is not a whole non-negative number
+static size_t parse_size(const char *value, const char *what)
+{
+    char *end;
+
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 0);
+    if (errno != 0 || end == value || *end != '\0' || value[0] == '-')
+    {
+        fprintf(stderr, "Invalid %s '%s'\n", what, value);
+        exit(EXIT_FAILURE);
+    }
+
+    return (size_t) n;
+}
+
+// parse_size() for the int counts, which must be between min and INT_MAX
+static int parse_count(const char *value, const char *option, int min)
+{
+    size_t n = parse_size(value, option);
+    if (n < (size_t) min || n > INT_MAX)
+    {
+        fprintf(stderr, "%s must be between %d and %d\n", option, min, INT_MAX);
+        exit(EXIT_FAILURE);
+    }
+
+    return (int) n;
+}
+
+static void parse_options(int argc, char **argv, struct options *opts)
+{
+    static struct option long_options[] = {
+        {"length", required_argument, NULL, 'n'},
+        {"local",  required_argument, NULL, 'L'},
+        {"items",  required_argument, NULL, 'i'},
+        {"tune",   no_argument,       NULL, 'T'},
+        {"stream", no_argument,       NULL, 's'},
+        {"chunk",  required_argument, NULL, 'k'},
+        {"mem",    required_argument, NULL, 'm'},
+        {"layout", required_argument, NULL, 'l'},
+        {"vector", required_argument, NULL, 'v'},
+        {"type",   required_argument, NULL, 't'},
+        {"multi",  no_argument,       NULL, 'M'},
+        {"peak-bw", required_argument, NULL, 'P'},
+        {"bench",  no_argument,       NULL, 'B'},
+        {"warmup", required_argument, NULL, 'W'},
+        {"iterations", required_argument, NULL, 'I'},
+        {"bench-min", required_argument, NULL, 'N'},
+        {"bench-max", required_argument, NULL, 'X'},
+        {"format", required_argument, NULL, 'F'},
+        {"output", required_argument, NULL, 'O'},
+        {"metrics", required_argument, NULL, 'R'},
+        {"aggregate", optional_argument, NULL, 'A'},
+        {"bins",   required_argument, NULL, 'b'},
+        {"bin-width", required_argument, NULL, 'w'},
+        {"generate", optional_argument, NULL, 'G'},
+        {"batches", required_argument, NULL, 'Z'},
+        {"inflight", required_argument, NULL, 'K'},
+        {"input",  required_argument, NULL, 'f'},
+        {"save",   required_argument, NULL, 'S'},
+        {"filter", no_argument,       NULL, 'x'},
+        {"frame",  required_argument, NULL, 'q'},
+        {"verify", required_argument, NULL, 'V'},
+        {"samples", required_argument, NULL, 'y'},
+        {"specialize", no_argument,   NULL, 'C'},
+        {"fast-math", no_argument,    NULL, 'Y'},
+        {"hybrid", no_argument,       NULL, 'H'},
+        {"graph",  no_argument,       NULL, 'g'},
+        {"telemetry", required_argument, NULL, 'e'},
+        {"telemetry-format", required_argument, NULL, 'E'},
+        {"telemetry-interval", required_argument, NULL, 'j'},
+        {"plan",   no_argument,       NULL, 'p'},
+        {"coalesce", required_argument, NULL, 'c'},
+        {"clients", required_argument, NULL, 'r'},
+        {"window", required_argument, NULL, 'u'},
+        {"pinned", no_argument,       NULL, 'D'},
+        {"grid-stride", no_argument,  NULL, 'z'},
+        {"lean",   no_argument,       NULL, 'a'},
+        {"resilient", no_argument,    NULL, 'd'},
+        {"help",   no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    opts->length = DEFAULT_LENGTH;
+    opts->launch.local = 0;
+    opts->launch.items = 1;
+    opts->launch_set = 0;
+    opts->tune   = 0;
+    opts->stream = 0;
+    opts->chunk  = 4 * 1024 * 1024;
+    opts->mem    = MEM_COPY;
+    opts->layout = LAYOUT_SOA;
+    opts->vector = 1;
+    opts->type   = ELEM_INT;
+    opts->multi  = 0;
+    opts->peak_bw = 0.0;
+#ifdef CUBOID_BENCH_DEFAULT
+    opts->bench  = 1;       // the cuboid_bench build
 #else
-#include <CL/cl.h>
+    opts->bench  = 0;
 #endif
+    opts->metrics = 0;
+    opts->aggregate = 0;
+    opts->bins   = 64;
+    opts->bin_width = 16;
+    opts->generate = 0;
+    opts->seed   = 1;
+    opts->batches = 0;
+    opts->inflight = 1;
+    opts->input  = NULL;
+    opts->save   = NULL;
+    opts->filter = 0;
+    opts->frame  = 64 * 1024;
+    opts->verify = VERIFY_FULL;
+    opts->samples = 1024 * 1024;
+    opts->specialize = 0;
+    opts->fast_math = 0;
+    opts->hybrid = 0;
+    opts->graph  = 0;
+    opts->telemetry = NULL;
+    opts->telemetry_format = TELEMETRY_PROMETHEUS;
+    opts->telemetry_interval = 0;
+    opts->plan   = 0;
+    opts->coalesce = 0;
+    opts->clients = 0;
+    opts->window = 200;
+    opts->pinned = 0;
+    opts->stride = 0;
+    opts->lean   = 0;
+    opts->resilient = 0;
+    opts->bo.warmup = 2;
+    opts->bo.iterations = 10;
+    opts->bo.min_length = 0;
+    opts->bo.max_length = 0;
+    opts->bo.format = BENCH_TEXT;
+    opts->bo.out = stdout;
+
+    // The environment sets the defaults, the command line overrides them
+    const char *env;
+    if ((env = getenv("CUBOID_LENGTH")) != NULL)
+        opts->length = parse_size(env, "CUBOID_LENGTH");
+    if ((env = getenv("CUBOID_LOCAL")) != NULL)
+    {
+        opts->launch.local = parse_size(env, "CUBOID_LOCAL");
+        opts->launch_set = 1;
+    }
+    if ((env = getenv("CUBOID_ITEMS")) != NULL)
+    {
+        opts->launch.items = (cl_uint) parse_size(env, "CUBOID_ITEMS");
+        opts->launch_set = 1;
+    }
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:L:i:Tsk:m:l:v:t:MP:BW:I:N:X:F:O:R:A::b:w:G::Z:K:f:S:xq:V:y:CYHge:E:j:pc:r:u:Dzadh", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                opts->length = parse_size(optarg, "length");
+                break;
+            case 'L':
+                opts->launch.local = parse_size(optarg, "work-group size");
+                opts->launch_set = 1;
+                break;
+            case 'i':
+                opts->launch.items = (cl_uint) parse_size(optarg, "items per work-item");
+                opts->launch_set = 1;
+                break;
+            case 'T':
+                opts->tune = 1;
+                break;
+            case 's':
+                opts->stream = 1;
+                break;
+            case 'k':
+                opts->chunk = strtoul(optarg, NULL, 0);
+                if (opts->chunk == 0)
+                {
+                    fprintf(stderr, "Invalid chunk size '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                if (strcmp(optarg, "copy") == 0)
+                    opts->mem = MEM_COPY;
+                else if (strcmp(optarg, "zero-copy") == 0)
+                    opts->mem = MEM_ZERO_COPY;
+                else if (strcmp(optarg, "compare") == 0)
+                    opts->mem = MEM_COMPARE;
+                else
+                {
+                    fprintf(stderr, "Unknown memory mode '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                if (strcmp(optarg, "soa") == 0)
+                    opts->layout = LAYOUT_SOA;
+                else if (strcmp(optarg, "aos") == 0)
+                    opts->layout = LAYOUT_AOS;
+                else
+                {
+                    fprintf(stderr, "Unknown layout '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'v':
+                opts->vector = parse_count(optarg, "--vector", 1);
+                if (opts->vector != 1 && opts->vector != 4 && opts->vector != 8 && opts->vector != 16)
+                {
+                    fprintf(stderr, "Vector width must be 1, 4, 8 or 16\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                if (strcmp(optarg, "int") == 0)
+                    opts->type = ELEM_INT;
+                else if (strcmp(optarg, "ushort") == 0)
+                    opts->type = ELEM_USHORT;
+                else if (strcmp(optarg, "uchar") == 0)
+                    opts->type = ELEM_UCHAR;
+                else
+                {
+                    fprintf(stderr, "Unknown element type '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'M':
+                opts->multi = 1;
+                break;
+            case 'P':
+                opts->peak_bw = atof(optarg);
+                break;
+            case 'B':
+                opts->bench = 1;
+                break;
+            case 'W':
+                opts->bo.warmup = parse_count(optarg, "--warmup", 0);
+                break;
+            case 'I':
+                opts->bo.iterations = parse_count(optarg, "--iterations", 1);
+                break;
+            case 'N':
+                opts->bo.min_length = strtoul(optarg, NULL, 0);
+                break;
+            case 'X':
+                opts->bo.max_length = strtoul(optarg, NULL, 0);
+                break;
+            case 'F':
+                if (strcmp(optarg, "text") == 0)
+                    opts->bo.format = BENCH_TEXT;
+                else if (strcmp(optarg, "csv") == 0)
+                    opts->bo.format = BENCH_CSV;
+                else if (strcmp(optarg, "json") == 0)
+                    opts->bo.format = BENCH_JSON;
+                else
+                {
+                    fprintf(stderr, "Unknown output format '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'O':
+                opts->bo.out = fopen(optarg, "w");
+                if (opts->bo.out == NULL)
+                {
+                    fprintf(stderr, "Cannot open '%s' for writing\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'R':
+                opts->metrics = metric_mask(optarg);
+                if (opts->metrics == 0)
+                {
+                    fprintf(stderr, "Unknown metric in '%s', use volume, area, diagonal or all\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'A':
+                if (optarg == NULL || strcmp(optarg, "fused") == 0)
+                    opts->aggregate = 1;
+                else if (strcmp(optarg, "unfused") == 0)
+                    opts->aggregate = 2;
+                else
+                {
+                    fprintf(stderr, "Unknown aggregation mode '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                opts->bins = (cl_uint) parse_size(optarg, "bin count");
+                break;
+            case 'w':
+                opts->bin_width = (cl_uint) parse_size(optarg, "bin width");
+                break;
+            case 'G':
+                opts->generate = 1;
+                if (optarg != NULL)
+                    opts->seed = (cl_ulong) parse_size(optarg, "seed");
+                break;
+            case 'Z':
+                opts->batches = parse_count(optarg, "--batches", 1);
+                break;
+            case 'K':
+                opts->inflight = parse_count(optarg, "--inflight", 1);
+                if (opts->inflight > CUBOID_ENGINE_SLOTS)
+                {
+                    fprintf(stderr, "--inflight must be between 1 and %d\n", CUBOID_ENGINE_SLOTS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                opts->input = optarg;
+                break;
+            case 'S':
+                opts->save = optarg;
+                break;
+            case 'x':
+                opts->filter = 1;
+                break;
+            case 'q':
+                opts->frame = parse_size(optarg, "frame size");
+                if (opts->frame == 0 || opts->frame > UINT_MAX)
+                {
+                    fprintf(stderr, "--frame must be between 1 and %u\n", UINT_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'V':
+                if (strcmp(optarg, "full") == 0)
+                    opts->verify = VERIFY_FULL;
+                else if (strcmp(optarg, "sample") == 0)
+                    opts->verify = VERIFY_SAMPLE;
+                else if (strcmp(optarg, "checksum") == 0)
+                    opts->verify = VERIFY_CHECKSUM;
+                else if (strcmp(optarg, "none") == 0)
+                    opts->verify = VERIFY_NONE;
+                else
+                {
+                    fprintf(stderr, "Unknown verification mode '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'y':
+                opts->samples = parse_size(optarg, "sample count");
+                if (opts->samples == 0)
+                {
+                    fprintf(stderr, "--samples must be at least 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'C':
+                opts->specialize = 1;
+                break;
+            case 'Y':
+                opts->fast_math = 1;
+                break;
+            case 'H':
+                opts->hybrid = 1;
+                break;
+            case 'g':
+                opts->graph = 1;
+                break;
+            case 'e':
+                opts->telemetry = optarg;
+                break;
+            case 'E':
+                if (strcmp(optarg, "prometheus") == 0)
+                    opts->telemetry_format = TELEMETRY_PROMETHEUS;
+                else if (strcmp(optarg, "json") == 0)
+                    opts->telemetry_format = TELEMETRY_JSON;
+                else
+                {
+                    fprintf(stderr, "Unknown telemetry format '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'j':
+                opts->telemetry_interval = (unsigned) parse_size(optarg, "telemetry interval");
+                break;
+            case 'p':
+                opts->plan = 1;
+                break;
+            case 'c':
+                opts->coalesce = parse_count(optarg, "--coalesce", 1);
+                break;
+            case 'r':
+                opts->clients = parse_count(optarg, "--clients", 1);
+                break;
+            case 'u':
+                opts->window = (unsigned) parse_size(optarg, "coalescing window");
+                break;
+            case 'D':
+                opts->pinned = 1;
+                break;
+            case 'z':
+                opts->stride = 1;
+                break;
+            case 'a':
+                opts->lean = 1;
+                break;
+            case 'd':
+                opts->resilient = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // The planner sets the engine options itself
+    if (opts->plan && (opts->stream || opts->stride || opts->lean || opts->graph || opts->hybrid || opts->filter || opts->input || opts->save ||
+                       opts->specialize || opts->batches || opts->aggregate || opts->metrics || opts->multi ||
+                       opts->bench || opts->tune || opts->mem != MEM_COPY || opts->layout != LAYOUT_SOA ||
+                       opts->vector != 1 || opts->type != ELEM_INT || opts->launch.items > 1))
+    {
+        fprintf(stderr, "--plan picks the engine itself, drop the other mode options\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Dataset files always go through the streaming pipeline, so they may
+    // be larger than device memory
+    if ((opts->input || opts->save) &&
+        (opts->batches || opts->aggregate || opts->metrics || opts->multi || opts->bench || opts->tune ||
+         opts->mem != MEM_COPY || opts->layout != LAYOUT_SOA || opts->vector != 1 || opts->type != ELEM_INT ||
+         opts->launch.items > 1))
+    {
+        fprintf(stderr, "--input and --save stream the scalar int kernel, drop the other mode options\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->filter && (opts->input || opts->save || opts->generate || opts->batches || opts->aggregate ||
+                         opts->metrics || opts->multi || opts->bench || opts->tune || opts->mem != MEM_COPY ||
+                         opts->layout != LAYOUT_SOA || opts->vector != 1 || opts->type != ELEM_INT ||
+                         opts->launch.items > 1))
+    {
+        fprintf(stderr, "--filter reads its records from stdin, drop the other mode options\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->input && opts->generate)
+    {
+        fprintf(stderr, "--generate makes inputs, it cannot be combined with --input\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->input || opts->save || opts->filter)
+        opts->stream = 1;
+
+    if (opts->hybrid && (opts->stream || opts->specialize || opts->batches || opts->aggregate || opts->metrics ||
+                         opts->multi || opts->bench || opts->tune || opts->mem != MEM_COPY ||
+                         opts->layout != LAYOUT_SOA || opts->vector != 1 || opts->type != ELEM_INT ||
+                         opts->launch.items > 1))
+    {
+        fprintf(stderr, "--hybrid runs the scalar int kernel next to the CPU engine, drop the other mode options\n");
+        exit(EXIT_FAILURE);
+    }
+    // Hybrid pieces are chunks, so the range may exceed the kernel's index
+    if (opts->hybrid)
+        opts->stream = 1;
+
+    // The graph replaces the streaming pipeline, every --stream check holds
+    if (opts->graph && opts->stream)
+    {
+        fprintf(stderr, "--graph is a streaming pipeline of its own, drop --stream and the other stream modes\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->graph)
+        opts->stream = 1;
+
+    // Only the streaming pipeline has staging rings
+    if (opts->pinned && (!opts->stream || opts->graph || opts->hybrid || opts->filter))
+    {
+        fprintf(stderr, "--pinned only applies to --stream, --input and --save\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts->telemetry_interval > 0 && opts->telemetry == NULL)
+    {
+        fprintf(stderr, "--telemetry-interval only applies to --telemetry\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts->fast_math && !opts->specialize)
+    {
+        fprintf(stderr, "--fast-math only applies to --specialize\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->specialize && (opts->stream || opts->batches || opts->aggregate || opts->multi || opts->bench ||
+                             opts->tune || opts->mem != MEM_COPY || opts->layout != LAYOUT_SOA ||
+                             opts->vector != 1 || opts->type != ELEM_INT || opts->launch.items > 1))
+    {
+        fprintf(stderr, "--specialize picks the width and items itself and applies to the copy path and --metrics\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts->length == 0 || opts->launch.items == 0 || opts->launch.items > 1024)
+    {
+        fprintf(stderr, "--length must be at least 1 and --items between 1 and 1024\n");
+        exit(EXIT_FAILURE);
+    }
+    // The kernels index with 32-bit unsigned integers, only the chunked paths
+    // can go past that
+    if (opts->length > UINT_MAX && !opts->stream && !opts->multi && !opts->plan && !opts->stride &&
+        !opts->resilient)
+    {
+        fprintf(stderr, "--length above %u needs --stream, --multi or --grid-stride\n", UINT_MAX);
+        exit(EXIT_FAILURE);
+    }
+    if (opts->chunk > UINT_MAX)
+    {
+        fprintf(stderr, "--chunk must not exceed %u\n", UINT_MAX);
+        exit(EXIT_FAILURE);
+    }
+    // --local still sets the work-group size of the grid-stride launch
+    if (opts->stride && (opts->stream || opts->multi || opts->bench || opts->tune || opts->batches ||
+                         opts->coalesce || opts->aggregate || opts->metrics || opts->specialize ||
+                         opts->generate || opts->mem != MEM_COPY || opts->layout != LAYOUT_SOA ||
+                         opts->vector != 1 || opts->type != ELEM_INT || opts->launch.items > 1))
+    {
+        fprintf(stderr, "--grid-stride runs its own scalar int copy path, drop the other mode options\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->lean && (opts->stream || opts->stride || opts->multi || opts->bench || opts->tune || opts->batches ||
+                       opts->coalesce || opts->aggregate || opts->metrics || opts->specialize ||
+                       opts->mem != MEM_COPY || opts->layout != LAYOUT_SOA || opts->vector != 1 ||
+                       opts->type != ELEM_INT))
+    {
+        fprintf(stderr, "--lean runs its own scalar int copy path, drop the other mode options\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->launch.items > 1 && (opts->stream || opts->multi || opts->bench || opts->mem == MEM_ZERO_COPY ||
+                                   opts->layout != LAYOUT_SOA || opts->vector != 1 || opts->type != ELEM_INT))
+    {
+        fprintf(stderr, "--items only applies to the scalar int copy path\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->tune && (opts->stream || opts->multi || opts->bench || opts->mem != MEM_COPY ||
+                       opts->layout != LAYOUT_SOA || opts->vector != 1 || opts->type != ELEM_INT))
+    {
+        fprintf(stderr, "--tune tunes the scalar int copy path, drop the other mode options\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts->metrics && (opts->stream || opts->multi || opts->bench || opts->tune || opts->mem != MEM_COPY ||
+                          opts->layout != LAYOUT_SOA || opts->vector != 1 || opts->type != ELEM_INT ||
+                          opts->launch.items > 1))
+    {
+        fprintf(stderr, "--metrics runs its own scalar int copy path, drop the other mode options\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The histogram is counted in local memory
+    if (opts->bins < 1 || opts->bins > 4096 || opts->bin_width < 1)
+    {
+        fprintf(stderr, "--bins must be between 1 and 4096 and --bin-width at least 1\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->aggregate && (opts->metrics || opts->stream || opts->multi || opts->bench || opts->tune ||
+                            opts->mem != MEM_COPY || opts->layout != LAYOUT_SOA || opts->vector != 1 ||
+                            opts->type != ELEM_INT || opts->launch.items > 1))
+    {
+        fprintf(stderr, "--aggregate runs its own kernels, drop the other mode options\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((opts->clients > 0 || opts->window != 200) && !opts->coalesce)
+    {
+        fprintf(stderr, "--clients and --window only apply to --coalesce\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->coalesce && (opts->batches || opts->plan || opts->aggregate || opts->metrics || opts->stream ||
+                           opts->multi || opts->bench || opts->tune || opts->mem != MEM_COPY ||
+                           opts->layout != LAYOUT_SOA || opts->vector != 1 || opts->type != ELEM_INT ||
+                           opts->launch.items > 1))
+    {
+        fprintf(stderr, "--coalesce drives the engine's scalar int copy path, drop the other mode options\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts->inflight > 1 && !opts->batches)
+    {
+        fprintf(stderr, "--inflight only applies to --batches\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->resilient && (!opts->batches || opts->inflight > 1))
+    {
+        fprintf(stderr, "--resilient only applies to blocking --batches\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->batches && (opts->aggregate || opts->metrics || opts->stream || opts->multi || opts->bench ||
+                          opts->tune || opts->mem != MEM_COPY || opts->layout != LAYOUT_SOA || opts->vector != 1 ||
+                          opts->type != ELEM_INT || opts->launch.items > 1))
+    {
+        fprintf(stderr, "--batches drives the engine's scalar int copy path, drop the other mode options\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts->stream && opts->mem != MEM_COPY)
+    {
+        fprintf(stderr, "--stream only supports --mem=copy\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((opts->layout != LAYOUT_SOA || opts->vector != 1) && (opts->stream || opts->mem != MEM_COPY))
+    {
+        fprintf(stderr, "--layout and --vector are only supported by the copy path\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->type != ELEM_INT && (opts->stream || opts->mem != MEM_COPY ||
+                                   opts->layout != LAYOUT_SOA || opts->vector != 1))
+    {
+        fprintf(stderr, "--type=%s only supports the scalar copy path\n", elem_name(opts->type));
+        exit(EXIT_FAILURE);
+    }
+    if (opts->multi && (opts->stream || opts->mem != MEM_COPY || opts->layout != LAYOUT_SOA ||
+                        opts->vector != 1 || opts->type != ELEM_INT))
+    {
+        fprintf(stderr, "--multi only supports the scalar int copy path\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->bench && (opts->stream || opts->multi || opts->mem != MEM_COPY || opts->layout != LAYOUT_SOA ||
+                        opts->vector != 1 || opts->type != ELEM_INT))
+    {
+        fprintf(stderr, "--bench runs the scalar int kernel, drop the other mode options\n");
+        exit(EXIT_FAILURE);
+    }
+    opts->bo.chunk    = opts->chunk;
+    opts->bo.generate = opts->generate;
+    opts->bo.seed     = opts->seed;
+
+    if (opts->layout == LAYOUT_AOS && opts->vector != 1)
+    {
+        fprintf(stderr, "--vector only applies to --layout=soa\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+// Copies the whole input to the device, runs the kernel once and reads the
+// whole result back. Returns the kernel time, the time including both
+// transfers is returned in total_time and the event timestamps of every
+// stage in prof. With width > 1 the kernel is one of the cuboid_area_vecN
+// variants, which handle `width` cuboids per work-item; with lc->items > 1
+// it is cuboid_area_items, which takes the item count as a sixth argument.
+// With a kernel_generate the inputs are generated on the device from seed
+// instead of being copied, and the source arrays are not read. With a
+// kernel_checksum the result is also hashed on the device into checksum,
+// outside of the timings.
+static double run_copy(cl_context context, cl_command_queue commands, cl_kernel kernel_cuboid_area,
+                       const int *source_a, const int *source_b, const int *source_c,
+                       int *result_opencl, size_t length, int width, const struct launch_config *lc,
+                       cl_kernel kernel_generate, cl_ulong seed, cl_kernel kernel_checksum, cl_ulong *checksum,
+                       double *total_time, struct profile *prof)
+{
+    int err;
+
+    size_t global;
+    size_t per_item = width > 1 ? (size_t) width : lc->items;
+    size_t bytes = sizeof(cl_int) * length;
+
+    cl_mem d_a;
+    cl_mem d_b;
+    cl_mem d_c;
+
+    cl_mem d_result;
+
+    cl_event ev_a, ev_b, ev_c, ev_gen, ev_kernel, ev_result;
+
+    // Create the input (a, b) and output (c) arrays in device memory. The
+    // kernels only read the inputs, unless cuboid_generate writes them first
+    cl_mem_flags input_flags = kernel_generate != NULL ? CL_MEM_READ_WRITE : CL_MEM_READ_ONLY;
+
+    d_a  = clCreateBuffer(context,  input_flags, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_a");
+
+    d_b  = clCreateBuffer(context,  input_flags, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_b");
+
+    d_c  = clCreateBuffer(context,  input_flags, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_c");
+
+    d_result  = clCreateBuffer(context,  CL_MEM_WRITE_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_result");
+
+    *total_time = wtime();
+
+    if (kernel_generate != NULL)
+    {
+        // Nothing crosses the bus, the device makes its own inputs
+        double gen_time = device_generate(commands, kernel_generate, d_a, d_b, d_c, length, 0, seed, &ev_gen);
+        printf("\nThe OpenCL generator filled the inputs in %lf seconds\n", gen_time);
+        profile_add(prof, ev_gen, PROFILE_GENERATE, 3 * bytes);
+    }
+    else
+    {
+        // Write a and b vectors into compute device memory
+        err = clEnqueueWriteBuffer(commands, d_a, CL_TRUE, 0, bytes, source_a, 0, NULL, &ev_a);
+        checkError(err, "Copying source_a to device at d_a");
+
+        err = clEnqueueWriteBuffer(commands, d_b, CL_TRUE, 0, bytes, source_b, 0, NULL, &ev_b);
+        checkError(err, "Copying source_b to device at d_b");
+
+        err = clEnqueueWriteBuffer(commands, d_c, CL_TRUE, 0, bytes, source_c, 0, NULL, &ev_c);
+        checkError(err, "Copying source_c to device at d_c");
+
+        profile_add(prof, ev_a, PROFILE_WRITE, bytes);
+        profile_add(prof, ev_b, PROFILE_WRITE, bytes);
+        profile_add(prof, ev_c, PROFILE_WRITE, bytes);
+    }
+
+    // Set the arguments to our compute kernel
+    err  = clSetKernelArg(kernel_cuboid_area, 0, sizeof(cl_mem), &d_a);
+    err |= clSetKernelArg(kernel_cuboid_area, 1, sizeof(cl_mem), &d_b);
+    err |= clSetKernelArg(kernel_cuboid_area, 2, sizeof(cl_mem), &d_c);
+    err |= clSetKernelArg(kernel_cuboid_area, 3, sizeof(cl_mem), &d_result);
+    cl_uint n = (cl_uint) length;
+    err |= clSetKernelArg(kernel_cuboid_area, 4, sizeof(cl_uint), &n);
+    if (width == 1 && lc->items > 1)
+        err |= clSetKernelArg(kernel_cuboid_area, 5, sizeof(cl_uint), &lc->items);
+    checkError(err, "Setting kernel arguments");
+
+    double cl_time = wtime();
+
+    // Execute the kernel over the entire range of our 1d input data set, the
+    // runtime chooses the work-group size unless one was configured
+    global = launch_global(lc, (length + per_item - 1) / per_item);
+    err = clEnqueueNDRangeKernel(commands, kernel_cuboid_area, 1, NULL, &global,
+                                 lc->local > 0 ? &lc->local : NULL, 0, NULL, &ev_kernel);
+    checkError(err, "Enqueueing kernel");
+
+    // Wait for the commands to complete before stopping the timer
+    err = clFinish(commands);
+    checkError(err, "Waiting for kernel to finish");
+
+    cl_time = wtime() - cl_time;
+    printf("\nThe OpenCL kernel ran in %lf seconds\n", cl_time);
+
+    // Read back the results from the compute device
+    err = clEnqueueReadBuffer( commands, d_result, CL_TRUE, 0, bytes, result_opencl, 0, NULL, &ev_result );
+    if (err != CL_SUCCESS)
+    {
+        telemetry_error(err);
+        printf("Error: Failed to read output array!\n%s\n", err_code(err));
+        exit(1);
+    }
+
+    *total_time = wtime() - *total_time;
+
+    // The kernel reads three inputs and writes one result per cuboid
+    profile_add(prof, ev_kernel, PROFILE_KERNEL, 4 * bytes);
+    profile_add(prof, ev_result, PROFILE_READ, bytes);
+    telemetry_observe(TELEMETRY_CHUNK, *total_time);
+    telemetry_add(TELEMETRY_ELEMENTS, length);
+
+    if (kernel_checksum != NULL)
+        *checksum = device_checksum(commands, kernel_checksum, d_result, length);
+
+    clReleaseMemObject(d_a);
+    clReleaseMemObject(d_b);
+    clReleaseMemObject(d_c);
+    clReleaseMemObject(d_result);
+
+    return cl_time;
+}
+
+// Runs the whole range on every available device at once and checks the
+// gathered result against the CPU engine
+static int main_multi(const struct options *opts)
+{
+    struct multi_device *devices;
+
+    int count = multi_discover(&devices);
+    if (count == 0)
+    {
+        printf("Found 0 devices!\n");
+        return EXIT_FAILURE;
+    }
+    printf("Splitting %zu cuboids over %d devices\n", opts->length, count);
+
+    int* source_a = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* source_b = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* source_c = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* result_opencl = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* result_cpu = (int*) cpu_alloc(opts->length, sizeof(int));
+
+    make_inputs(source_a, source_b, source_c, opts->length, 0, opts->generate, opts->seed);
+
+    double cl_time = run_multi(devices, count, source_a, source_b, source_c, result_opencl,
+                               opts->length, opts->chunk);
+    printf("\nThe OpenCL devices ran in %lf seconds including transfers\n", cl_time);
+    multi_report(devices, count, opts->length);
+
+    double cpu_time = wtime();
+    cpu_cuboid_area(source_a, source_b, source_c, result_cpu, opts->length);
+    cpu_time = wtime() - cpu_time;
+    printf("\nThe CPU engine ran in %lf seconds (%d threads, %s)\n", cpu_time, cpu_threads(), cpu_isa());
+    printf("The CPU time is %lfX of the multi-device OpenCL time\n\n", cpu_time / cl_time);
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < opts->length; i++) {
+        if (result_opencl[i] != result_cpu[i])
+            mismatches++;
+    }
+    if (mismatches == 0)
+        printf("All %zu results match the CPU engine\n", opts->length);
+    else
+        printf("Error: %zu results differ from the CPU engine!\n", mismatches);
+
+    multi_release(devices, count);
+
+    free(source_a);
+    free(source_b);
+    free(source_c);
+    free(result_opencl);
+    free(result_cpu);
+
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Host-to-device bandwidth of one chunk of inputs from pageable and from
+// pinned memory
+static void report_pinned(cl_context context, cl_device_id device_id, size_t chunk)
+{
+    double pageable, pinned;
+    pinned_bandwidth(context, device_id, 3 * sizeof(cl_int) * chunk, &pageable, &pinned);
+
+    printf("Host-to-device bandwidth: pageable %.2lf GB/s, pinned %.2lf GB/s (%.2lfx)\n",
+           pageable, pinned, pageable > 0.0 ? pinned / pageable : 0.0);
+}
+
+// Streams a dataset file through the device. The inputs are read from the
+// mapped --input file, or generated straight into the mapped --save file;
+// the results land in the --save mapping, or back in the result column of
+// --input when both name the same file. Only a separate --save of an
+// --input file copies the inputs, every other byte is touched once.
+static int main_dataset(const struct options *opts, cl_context context, cl_device_id device_id,
+                        cl_kernel kernel_cuboid_area)
+{
+    struct dataset in, out;
+    struct dataset *target = NULL;
+    int in_place = opts->input != NULL && opts->save != NULL && dataset_same_file(opts->input, opts->save);
+
+    double io_time = wtime();
+
+    if (opts->input != NULL && dataset_open(opts->input, in_place, &in) != 0)
+        return EXIT_FAILURE;
+
+    size_t length = opts->input != NULL ? (size_t) in.header->count : opts->length;
+
+    if (in_place)
+        target = &in;
+    else if (opts->save != NULL)
+    {
+        if (dataset_create(opts->save, length, &out) != 0)
+        {
+            if (opts->input != NULL)
+                dataset_close(&in);
+            return EXIT_FAILURE;
+        }
+        target = &out;
+
+        if (opts->input != NULL)
+        {
+            memcpy(out.a, in.a, sizeof(int) * length);
+            memcpy(out.b, in.b, sizeof(int) * length);
+            memcpy(out.c, in.c, sizeof(int) * length);
+        }
+        else
+            make_inputs(out.a, out.b, out.c, length, 0, opts->generate, opts->seed);
+    }
+
+    const struct dataset *source = opts->input != NULL ? &in : &out;
+    int *result = target != NULL ? target->result : (int*) cpu_alloc(length, sizeof(int));
+
+    io_time = wtime() - io_time;
+
+    double cl_time = run_streaming(context, device_id, kernel_cuboid_area,
+                                   source->a, source->b, source->c, result, length, opts->chunk,
+                                   opts->pinned);
+
+    // Total surface area for the report, kept or not
+    cl_ulong total = 0;
+    for (size_t i = 0; i < length; i++)
+        total += (cl_ulong) result[i];
+
+    struct verify_report report;
+    verify_result(opts->verify, source->a, source->b, source->c, result, length, opts->samples, &report);
+    int status = verify_print(&report, "Streamed dataset") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    double sync_time = wtime();
+    if (target != NULL && dataset_finish(target) != 0)
+        status = EXIT_FAILURE;
+    sync_time = wtime() - sync_time;
+
+    printf("Streamed %zu cuboids from %s in %lf seconds, %lf GB/s of columns\n", length,
+           opts->input != NULL ? opts->input : "the host generator", cl_time,
+           4.0 * sizeof(int) * length / cl_time / 1e9);
+    printf("Mapping and filling took %lf seconds, writing back %lf seconds\n", io_time, sync_time);
+    if (opts->pinned)
+        report_pinned(context, device_id, opts->chunk < length ? opts->chunk : length);
+    if (target != NULL)
+        printf("Results saved to %s%s\n", in_place ? opts->input : opts->save, in_place ? " in place" : "");
+    printf("Total surface area: %llu\n", (unsigned long long) total);
+
+    if (target == NULL)
+        free(result);
+    if (opts->input != NULL)
+        dataset_close(&in);
+    if (target == &out)
+        dataset_close(&out);
+
+    return status;
+}
+
+// Splits the range between the device and the CPU engine and checks the
+// combined result
+static int main_hybrid(const struct options *opts, cl_context context, cl_command_queue commands,
+                       cl_kernel kernel_cuboid_area)
+{
+    int* source_a = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* source_b = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* source_c = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* result   = (int*) cpu_alloc(opts->length, sizeof(int));
+
+    make_inputs(source_a, source_b, source_c, opts->length, 0, opts->generate, opts->seed);
+
+    // One core feeds the device, the others compute
+    int workers = cpu_threads() > 1 ? cpu_threads() - 1 : 1;
+
+    struct hybrid_stats stats;
+    double hybrid_time = run_hybrid(context, commands, kernel_cuboid_area, source_a, source_b, source_c,
+                                    result, opts->length, opts->chunk, workers, &stats);
+    printf("\nThe hybrid run took %lf seconds (%s on the CPU side)\n", hybrid_time, cpu_isa());
+    hybrid_report(&stats, opts->length, hybrid_time);
+
+    struct verify_report report;
+    verify_result(opts->verify, source_a, source_b, source_c, result, opts->length, opts->samples, &report);
+    size_t mismatches = verify_print(&report, "Hybrid");
+
+    free(source_a);
+    free(source_b);
+    free(source_c);
+    free(result);
+
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// The copy path in three host arrays and three device buffers. The host
+// baselines run first, in LEAN_CHUNK pieces, while the inputs are whole.
+static int main_lean(const struct options *opts, cl_context context, cl_command_queue commands,
+                     cl_program program)
+{
+    int* source_a = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* source_b = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* source_c = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* piece    = (int*) cpu_alloc(LEAN_CHUNK, sizeof(int));
+
+    double fill_time = make_inputs(source_a, source_b, source_c, opts->length, 0, opts->generate, opts->seed);
+    printf("Generating the inputs on the host took %lf seconds\n", fill_time);
+
+    double seq_time = wtime();
+    for (size_t offset = 0; offset < opts->length; offset += LEAN_CHUNK)
+    {
+        size_t end = offset + LEAN_CHUNK < opts->length ? offset + LEAN_CHUNK : opts->length;
+        for (size_t i = offset; i < end; i++)
+            piece[i - offset] = 2 * ((source_a[i] * source_b[i]) + (source_b[i] * source_c[i]) +
+                                     (source_a[i] * source_c[i]));
+    }
+    seq_time = wtime() - seq_time;
+
+    double cpu_time = wtime();
+    for (size_t offset = 0; offset < opts->length; offset += LEAN_CHUNK)
+    {
+        size_t count = offset + LEAN_CHUNK < opts->length ? LEAN_CHUNK : opts->length - offset;
+        cpu_cuboid_area(source_a + offset, source_b + offset, source_c + offset, piece, count);
+    }
+    cpu_time = wtime() - cpu_time;
+    free(piece);
+
+    struct verify_report report;
+    struct lean_stats stats;
+    double cl_total;
+    double cl_time = run_lean(context, commands, program, source_a, source_b, source_c, opts->length,
+                              &opts->launch, opts->verify, opts->samples, &report, &stats, &cl_total);
+    printf("Lean write + kernel + chunked read and check took %lf seconds\n", cl_total);
+    size_t mismatches = verify_print(&report, "OpenCL (lean)");
+
+    printf("The sequential code ran in %lf seconds, the CPU engine in %lf seconds (%d threads, %s)\n",
+           seq_time, cpu_time, cpu_threads(), cpu_isa());
+    double best_cpu = cpu_time < seq_time ? cpu_time : seq_time;
+    printf("The best CPU time is %lfX of the OpenCL kernel time\n", best_cpu / cl_time);
+    printf("The best CPU time is %lfX of the OpenCL time including transfers\n\n", best_cpu / cl_total);
+
+    // The results are in c now
+    cl_ulong total = 0;
+    for (size_t i = 0; i < opts->length; i++)
+        total += (cl_ulong) source_c[i];
+    printf("Total surface area: %llu\n", (unsigned long long) total);
+
+    double mb = 1.0 / (1024 * 1024);
+    printf("Device buffers: %.1lf MB, the copy path allocates %.1lf MB\n",
+           stats.device_bytes * mb, stats.copy_bytes * mb);
+    printf("Peak resident host memory: %.1lf MB, the copy path holds %.1lf MB of arrays\n",
+           peak_rss() * mb, 5.0 * sizeof(int) * opts->length * mb);
+    printf("Gave back %.1lf MB of a and b while reading the result\n", stats.released * mb);
+
+    free(source_a);
+    free(source_b);
+    free(source_c);
+
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Size of batch i: an eighth, a quarter, a half and all of --length in turn
+static size_t batch_length(const struct options *opts, int i)
+{
+    size_t length = opts->length >> (3 - i % 4);
+
+    return length > 0 ? length : opts->length;
+}
+
+// Completions counted by the engine's callback, which runs on a runtime
+// thread
+struct batch_count {
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    size_t          completed;
+};
+
+static void count_batch(cl_int status, void *user_data)
+{
+    struct batch_count *count = (struct batch_count*) user_data;
+    (void) status;
+
+    pthread_mutex_lock(&count->lock);
+    count->completed++;
+    pthread_cond_signal(&count->changed);
+    pthread_mutex_unlock(&count->lock);
+}
+
+// Waits for an asynchronous batch and checks it. Returns 1 if it failed.
+static size_t retire_batch(struct cuboid_batch **batch, const int *result, const int *expected, size_t length)
+{
+    cl_int err = cuboid_batch_wait(*batch);
+
+    cuboid_batch_release(*batch);
+    *batch = NULL;
+
+    return err != CL_SUCCESS || memcmp(result, expected, sizeof(int) * length) != 0;
+}
+
+// Blocking submits, one batch at a time. Returns the failed batches.
+static size_t run_batches(const struct options *opts, struct cuboid_engine *engine,
+                          const int *a, const int *b, const int *c, const int *expected)
+{
+    int* result_opencl = (int*) cpu_alloc(opts->length, sizeof(int));
+
+    printf("\n%8s %12s %12s %14s\n", "batch", "elements", "seconds", "Melements/s");
+
+    size_t failed = 0;
+    for (int i = 0; i < opts->batches; i++)
+    {
+        size_t length = batch_length(opts, i);
+
+        double batch_time = wtime();
+        struct cuboid_job job;
+        cl_int err;
+        if (opts->resilient)
+        {
+            // Without an engine every batch goes to the CPU engine
+            cuboid_job_init(&job, length, opts->chunk);
+            job.device_lost = engine == NULL;
+            err = cuboid_engine_run(engine, &job, a, b, c, result_opencl, 1);
+        }
+        else
+            err = cuboid_engine_submit(engine, a, b, c, result_opencl, length);
+        batch_time = wtime() - batch_time;
+
+        if (err != CL_SUCCESS)
+        {
+            printf("%8d %12zu %12s %14s  %s\n", i, length, "failed", "-", err_code(err));
+            failed++;
+            continue;
+        }
+        if (memcmp(result_opencl, expected, sizeof(int) * length) != 0)
+        {
+            printf("%8d %12zu  wrong results\n", i, length);
+            failed++;
+            continue;
+        }
+        printf("%8d %12zu %12lf %14.2lf", i, length, batch_time, length / batch_time / 1.0e6);
+        if (opts->resilient && job.retries > 0)
+            printf("  %s: %zu retries, chunk %zu, %zu on the CPU", err_code(job.last_error), job.retries,
+                   job.chunk, job.cpu_elements);
+        printf("\n");
+    }
+
+    free(result_opencl);
+
+    return failed;
+}
+
+// Keeps opts->inflight batches queued, each with its own result array, and
+// only waits for a batch when its array is needed again. Returns the failed
+// batches.
+static size_t run_batches_async(const struct options *opts, struct cuboid_engine *engine,
+                                const int *a, const int *b, const int *c, const int *expected)
+{
+    int                  depth = opts->inflight;
+    int                 *results[CUBOID_ENGINE_SLOTS];
+    struct cuboid_batch *pending[CUBOID_ENGINE_SLOTS];
+    size_t               pending_length[CUBOID_ENGINE_SLOTS];
 
-#include "err_code.h"
+    struct batch_count count;
+    pthread_mutex_init(&count.lock, NULL);
+    pthread_cond_init(&count.changed, NULL);
+    count.completed = 0;
+
+    for (int k = 0; k < depth; k++)
+    {
+        results[k] = (int*) cpu_alloc(opts->length, sizeof(int));
+        pending[k] = NULL;
+    }
 
-extern double wtime(void);       // returns time since some fixed past point (wtime.c)
+    size_t failed = 0;
+    size_t queued = 0;
+    size_t elements = 0;
+    double host_time = 0.0;   // spent inside submit calls
+    double wall_time = wtime();
 
-//------------------------------------------------------------------------------
+    for (int i = 0; i < opts->batches; i++)
+    {
+        int k = i % depth;
+
+        // The result array is about to be reused
+        if (pending[k] != NULL)
+            failed += retire_batch(&pending[k], results[k], expected, pending_length[k]);
+
+        size_t length = batch_length(opts, i);
+        cl_int err;
+
+        double submit_time = wtime();
+        pending[k] = cuboid_engine_submit_async(engine, a, b, c, results[k], length, count_batch, &count, &err);
+        host_time += wtime() - submit_time;
+
+        if (pending[k] == NULL)
+        {
+            printf("Batch %d could not be queued: %s\n", i, err_code(err));
+            failed++;
+            continue;
+        }
+        pending_length[k] = length;
+        elements += length;
+        queued++;
+    }
+    for (int k = 0; k < depth; k++)
+    {
+        if (pending[k] != NULL)
+            failed += retire_batch(&pending[k], results[k], expected, pending_length[k]);
+    }
+
+    wall_time = wtime() - wall_time;
+
+    // A callback may run shortly after its event completes, and none may
+    // outlive the counter
+    pthread_mutex_lock(&count.lock);
+    while (count.completed < queued)
+        pthread_cond_wait(&count.changed, &count.lock);
+    pthread_mutex_unlock(&count.lock);
+
+    printf("\n%d batches with up to %d in flight: %zu cuboids in %lf seconds, %.2lf Melements/s\n",
+           opts->batches, depth, elements, wall_time, elements / wall_time / 1.0e6);
+    printf("The host spent %lf seconds queueing, %zu completion callbacks\n", host_time, count.completed);
+
+    pthread_cond_destroy(&count.changed);
+    pthread_mutex_destroy(&count.lock);
+
+    for (int k = 0; k < depth; k++)
+        free(results[k]);
+
+    return failed;
+}
+
+// Pushes a series of batches through one engine, the way a service would,
+// and checks each against the CPU engine. The sizes cycle, so the buffers
+// grow during the first cycle and are reused afterwards.
+static int main_batches(const struct options *opts)
+{
+    cl_int err;
+
+    struct cuboid_engine *engine = cuboid_engine_create(CL_DEVICE_TYPE_GPU, opts->launch.local, &err);
+    if (engine == NULL && !opts->resilient)
+    {
+        printf("Error: Failed to set up the engine!\n%s\n", err_code(err));
+        return EXIT_FAILURE;
+    }
+    if (engine == NULL)
+        printf("No engine (%s), the batches run on the CPU engine\n", err_code(err));
+
+    int* source_a = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* source_b = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* source_c = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* result_cpu = (int*) cpu_alloc(opts->length, sizeof(int));
+
+    make_inputs(source_a, source_b, source_c, opts->length, 0, opts->generate, opts->seed);
+    cpu_cuboid_area(source_a, source_b, source_c, result_cpu, opts->length);
+
+    struct cuboid_engine_stats stats;
+    if (engine != NULL)
+    {
+        cuboid_engine_stats(engine, &stats);
+        printf("Engine on %s set up in %lf seconds\n", cuboid_engine_device(engine), stats.setup_time);
+    }
+
+    size_t failed;
+    if (opts->inflight > 1)
+        failed = run_batches_async(opts, engine, source_a, source_b, source_c, result_cpu);
+    else
+        failed = run_batches(opts, engine, source_a, source_b, source_c, result_cpu);
+
+    if (engine != NULL)
+    {
+        cuboid_engine_stats(engine, &stats);
+        printf("\n%zu batches, %zu cuboids, buffers grew %zu times to %zu elements\n",
+               stats.batches, stats.elements, stats.reallocations, stats.capacity);
+        printf("Arena: %zu of %zu bytes at peak, %zu sub-buffers created, %zu reused\n",
+               stats.arena_high_water, stats.arena_capacity, stats.sub_buffers, stats.reused_buffers);
+        if (opts->inflight == 1 && stats.batches > 0)
+            printf("Setup was paid once, %lfX the mean batch time\n",
+                   stats.setup_time / (stats.busy_time / stats.batches));
+    }
+    if (failed > 0)
+        printf("Error: %zu batches failed or returned wrong results!\n", failed);
+
+    cuboid_engine_destroy(engine);
+
+    free(source_a);
+    free(source_b);
+    free(source_c);
+    free(result_cpu);
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// One client of --coalesce, sending its share of the requests one after
+// the other and timing each
+struct coalesce_client {
+    const struct options    *opts;
+    struct cuboid_engine    *engine;    // one launch per request when not NULL
+    pthread_mutex_t         *engine_lock;
+    struct cuboid_coalescer *co;        // or merged through the coalescer
+    const int  *a;
+    const int  *b;
+    const int  *c;
+    const int  *expected;
+    int        *result;
+    int         requests;
+    double     *latency;    // seconds of each request
+    size_t      failed;
+};
+
+static void *coalesce_client(void *arg)
+{
+    struct coalesce_client *cl = (struct coalesce_client*) arg;
+    size_t length = cl->opts->length;
+
+    for (int i = 0; i < cl->requests; i++)
+    {
+        cl_int err;
+        double start = wtime();
+        if (cl->co != NULL)
+            err = cuboid_coalescer_submit(cl->co, cl->a, cl->b, cl->c, cl->result, length);
+        else
+        {
+            // The engine takes one caller at a time
+            pthread_mutex_lock(cl->engine_lock);
+            err = cuboid_engine_submit(cl->engine, cl->a, cl->b, cl->c, cl->result, length);
+            pthread_mutex_unlock(cl->engine_lock);
+        }
+        cl->latency[i] = wtime() - start;
+
+        if (err != CL_SUCCESS || memcmp(cl->result, cl->expected, sizeof(int) * length) != 0)
+            cl->failed++;
+    }
+
+    return NULL;
+}
+
+static int compare_seconds(const void *x, const void *y)
+{
+    double a = *(const double*) x, b = *(const double*) y;
+
+    return (a > b) - (a < b);
+}
+
+// Runs every request on `clients` threads and prints a line of throughput
+// and latency percentiles. Returns the failed requests.
+static size_t run_clients(const struct options *opts, const char *what, struct cuboid_engine *engine,
+                          struct cuboid_coalescer *co, const int *a, const int *b, const int *c,
+                          const int *expected, int clients)
+{
+    pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t              *threads = (pthread_t*) malloc(sizeof(pthread_t) * clients);
+    struct coalesce_client *client  = (struct coalesce_client*) malloc(sizeof(struct coalesce_client) * clients);
+    double *latency = (double*) malloc(sizeof(double) * opts->coalesce);
+    if (threads == NULL || client == NULL || latency == NULL)
+    {
+        printf("Error: cannot allocate %d clients and %d latencies\n", clients, opts->coalesce);
+        exit(EXIT_FAILURE);
+    }
+
+    double wall_time = wtime();
+
+    int first = 0;
+    for (int t = 0; t < clients; t++)
+    {
+        client[t].opts        = opts;
+        client[t].engine      = co == NULL ? engine : NULL;
+        client[t].engine_lock = &engine_lock;
+        client[t].co          = co;
+        client[t].a           = a;
+        client[t].b           = b;
+        client[t].c           = c;
+        client[t].expected    = expected;
+        client[t].result      = (int*) cpu_alloc(opts->length, sizeof(int));
+        client[t].requests    = opts->coalesce / clients + (t < opts->coalesce % clients);
+        client[t].latency     = latency + first;
+        client[t].failed      = 0;
+        first += client[t].requests;
+
+        if (pthread_create(&threads[t], NULL, coalesce_client, &client[t]) != 0)
+        {
+            printf("Error: cannot start client %d\n", t);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    size_t failed = 0;
+    for (int t = 0; t < clients; t++)
+    {
+        pthread_join(threads[t], NULL);
+        failed += client[t].failed;
+        free(client[t].result);
+    }
+
+    wall_time = wtime() - wall_time;
+
+    qsort(latency, opts->coalesce, sizeof(double), compare_seconds);
+    printf("%-12s %12.0lf %14.2lf %12.1lf %12.1lf %12.1lf\n", what, opts->coalesce / wall_time,
+           (double) opts->coalesce * opts->length / wall_time / 1.0e6,
+           latency[opts->coalesce / 2] * 1.0e6, latency[(size_t) (opts->coalesce * 0.99)] * 1.0e6,
+           latency[opts->coalesce - 1] * 1.0e6);
+
+    free(latency);
+    free(client);
+    free(threads);
+
+    return failed;
+}
+
+// Many small requests from several threads, first one engine launch per
+// request, then merged by the coalescer
+static int main_coalesce(const struct options *opts)
+{
+    cl_int err;
+
+    struct cuboid_engine *engine = cuboid_engine_create(CL_DEVICE_TYPE_GPU, opts->launch.local, &err);
+    if (engine == NULL)
+    {
+        printf("Error: Failed to set up the engine!\n%s\n", err_code(err));
+        return EXIT_FAILURE;
+    }
+
+    int* source_a = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* source_b = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* source_c = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* expected = (int*) cpu_alloc(opts->length, sizeof(int));
+
+    make_inputs(source_a, source_b, source_c, opts->length, 0, opts->generate, opts->seed);
+    cpu_cuboid_area(source_a, source_b, source_c, expected, opts->length);
+
+    int clients = opts->clients > 0 ? opts->clients : cpu_threads();
+    size_t max_elements = opts->chunk;
+    printf("Engine on %s, %d requests of %zu cuboids from %d clients\n", cuboid_engine_device(engine),
+           opts->coalesce, opts->length, clients);
+
+    printf("\n%-12s %12s %14s %12s %12s %12s\n", "mode", "requests/s", "Melements/s",
+           "p50 us", "p99 us", "max us");
+    size_t failed = run_clients(opts, "per request", engine, NULL, source_a, source_b, source_c,
+                                expected, clients);
+
+    struct cuboid_coalescer *co = cuboid_coalescer_create(engine, max_elements, opts->window, &err);
+    if (co == NULL)
+    {
+        printf("Error: Failed to set up the coalescer!\n%s\n", err_code(err));
+        cuboid_engine_destroy(engine);
+        return EXIT_FAILURE;
+    }
+    failed += run_clients(opts, "coalesced", engine, co, source_a, source_b, source_c, expected, clients);
+
+    struct cuboid_coalescer_stats stats;
+    cuboid_coalescer_stats(co, &stats);
+    printf("\n%zu requests in %zu dispatches of %.1lf cuboids on average, %zu sent full, window %u us\n",
+           stats.requests, stats.dispatches,
+           stats.dispatches > 0 ? (double) stats.elements / stats.dispatches : 0.0,
+           stats.full_dispatches, opts->window);
+    if (failed > 0)
+        printf("Error: %zu requests failed or returned wrong results!\n", failed);
+
+    cuboid_coalescer_destroy(co);
+    cuboid_engine_destroy(engine);
 
-const int LENGTH = 1024 * 1024 * 75;
+    free(source_a);
+    free(source_b);
+    free(source_c);
+    free(expected);
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// The planner found no device worth its overhead for this size
+static int main_host(const struct options *opts)
+{
+    int* source_a = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* source_b = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* source_c = (int*) cpu_alloc(opts->length, sizeof(int));
+    int* result   = (int*) cpu_alloc(opts->length, sizeof(int));
+
+    double fill_time = make_inputs(source_a, source_b, source_c, opts->length, 0, opts->generate, opts->seed);
+    printf("Generating the inputs on the host took %lf seconds\n", fill_time);
+
+    double cpu_time = wtime();
+    cpu_cuboid_area(source_a, source_b, source_c, result, opts->length);
+    cpu_time = wtime() - cpu_time;
+    printf("\nThe CPU engine ran in %lf seconds (%d threads, %s)\n", cpu_time, cpu_threads(), cpu_isa());
+
+    struct verify_report report;
+    verify_result(opts->verify, source_a, source_b, source_c, result, opts->length, opts->samples, &report);
+    size_t mismatches = verify_print(&report, "CPU engine");
+
+    free(source_a);
+    free(source_b);
+    free(source_c);
+    free(result);
+
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-const char *OpenCL_code = "\n" \
-"__kernel void cuboid_area(                                          \n" \
-"   __global int* a,                                                    \n" \
-"   __global int* b,                                                    \n" \
-"   __global int* c,                                                    \n" \
-"   __global int* result)                                               \n" \
-"{                                                                      \n" \
-"   int i = get_global_id(0);                                           \n" \
-"   result[i] = 2 * ((a[i] * b[i]) + (b[i] * c[i]) +  (a[i] * c[i]));   \n" \
-"}                                                                      \n" \
-"\n";
+// Turns the plan into the options of the chosen engine
+static void apply_plan(struct options *opts, const struct engine_plan *plan)
+{
+    if (plan->engine == PLAN_STREAM)
+    {
+        opts->stream = 1;
+        opts->chunk  = plan->chunk;
+    }
+    else if (plan->engine == PLAN_ZERO_COPY)
+        opts->mem = MEM_ZERO_COPY;
+    else if (plan->engine == PLAN_COPY)
+        opts->vector = plan->vector;
+}
 
 //------------------------------------------------------------------------------
 
@@ -55,14 +1626,54 @@ int main(int argc, char** argv)
 {
     int          err;
 
-    int*       source_a = (int*) calloc(LENGTH, sizeof(int));
-    int*       source_b = (int*) calloc(LENGTH, sizeof(int));
-    int*       source_c = (int*) calloc(LENGTH, sizeof(int));
+    struct options opts;
+    parse_options(argc, argv, &opts);
 
-    int*       result_opencl = (int*) calloc(LENGTH, sizeof(int));
-    int*       result_sequential = (int*) calloc(LENGTH, sizeof(int));
+    // As a filter stdout carries the results, the report goes to stderr
+    int results_fd = opts.filter ? filter_claim_stdout() : -1;
 
-    size_t global;
+    if (opts.telemetry != NULL)
+        telemetry_start(opts.telemetry, opts.telemetry_format, opts.telemetry_interval);
+
+    if (opts.multi)
+        return main_multi(&opts);
+    if (opts.batches)
+        return main_batches(&opts);
+    if (opts.coalesce)
+        return main_coalesce(&opts);
+
+    // Probe every device and let the planner choose, the host included
+    struct device_probe probes[PROBE_MAX_DEVICES];
+    struct engine_plan  plan;
+    plan.device = -1;
+    if (opts.plan)
+    {
+        int count = probe_devices(probes, PROBE_MAX_DEVICES);
+        probe_report(probes, count);
+        plan_engine(probes, count, opts.length, &plan);
+
+        printf("\nPlan for %zu cuboids: %s", opts.length, plan_name(plan.engine));
+        if (plan.device >= 0)
+            printf(" on device %d (%s)", plan.device, probes[plan.device].name);
+        if (plan.engine == PLAN_STREAM)
+            printf(", %zu elements per chunk", plan.chunk);
+        if (plan.vector > 1)
+            printf(", %d cuboids per work-item", plan.vector);
+        printf("\nEstimated %lf seconds, %lf seconds on the CPU engine\n\n", plan.estimate, plan.host_estimate);
+
+        apply_plan(&opts, &plan);
+        if (plan.engine == PLAN_HOST)
+            return main_host(&opts);
+    }
+
+    int*       source_a;
+    int*       source_b;
+    int*       source_c;
+
+    int*       result_opencl;
+    int*       result_host;
+
+    struct zero_copy zc;
 
     cl_device_id     device_id = NULL;
     cl_context       context;
@@ -70,20 +1681,9 @@ int main(int argc, char** argv)
     cl_program       program;
     cl_kernel        kernel_cuboid_area;
 
-    cl_mem d_a;
-    cl_mem d_b;
-    cl_mem d_c;
-
-    cl_mem d_result;
-
-    // Fill vectors a and b with random integer values
-    for(int i = 0; i < LENGTH; i++) {
-        source_a[i] = (rand() % 9) + 1;
-        source_b[i] = (rand() % 9) + 1;
-        source_c[i] = (rand() % 9) + 1;
-    }
-
-    // Set up platform and GPU device
+    // Set up platform and GPU device, everything up to the kernel object
+    // counts as startup
+    double startup_time = wtime();
 
     cl_uint numPlatforms;
 
@@ -101,168 +1701,473 @@ int main(int argc, char** argv)
     err = clGetPlatformIDs(numPlatforms, Platform, NULL);
     checkError(err, "Getting platforms");
 
-    // Secure a GPU
-    for (int i = 0; i < numPlatforms; i++)
+    // The planned device, or else secure a GPU, or else whatever device
+    // there is
+    if (plan.device >= 0)
+        device_id = probes[plan.device].device_id;
+    for (cl_uint i = 0; i < numPlatforms && device_id == NULL; i++)
     {
         err = clGetDeviceIDs(Platform[i], CL_DEVICE_TYPE_GPU, 1, &device_id, NULL);
-        if (err == CL_SUCCESS)
-        {
-            break;
-        }
+        if (err != CL_SUCCESS)
+            device_id = NULL;
+    }
+    for (cl_uint i = 0; i < numPlatforms && device_id == NULL; i++)
+    {
+        err = clGetDeviceIDs(Platform[i], CL_DEVICE_TYPE_ALL, 1, &device_id, NULL);
+        if (err != CL_SUCCESS)
+            device_id = NULL;
     }
 
     if (device_id == NULL)
         checkError(err, "Finding a device");
 
     // Get device type
-    long int device_type;
+    cl_device_type device_type;
     err = clGetDeviceInfo(device_id, CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
     if (err != CL_SUCCESS)
     {
         printf("Error: Failed to access device type information!\n");
         return EXIT_FAILURE;
     }
-    if(device_type  == CL_DEVICE_TYPE_GPU)
+    if (device_type & CL_DEVICE_TYPE_GPU)
        printf("Device type: GPU \n");
-    else if (device_type == CL_DEVICE_TYPE_CPU)
+    else if (device_type & CL_DEVICE_TYPE_CPU)
        printf("Device type: CPU \n");
     else
        printf("Device type: Not CPU nor GPU \n");
 
     
     // Get total compute units
-    int comp_units;
+    cl_uint comp_units;
     err = clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &comp_units, NULL);
     if (err != CL_SUCCESS)
     {
         printf("Error: Failed to access device number of compute units !\n");
         return EXIT_FAILURE;
     }
-    printf("Total compute units: %d compute units \n", comp_units);
+    printf("Total compute units: %u compute units \n", (unsigned) comp_units);
     
     // Create a compute context
     context = clCreateContext(0, 1, &device_id, NULL, NULL, &err);
     checkError(err, "Creating context");
 
-    // Create a command queue
-    commands = clCreateCommandQueue(context, device_id, 0, &err);
+    // Create a command queue, with profiling so every stage can be timed
+    commands = clCreateCommandQueue(context, device_id, CL_QUEUE_PROFILING_ENABLE, &err);
     checkError(err, "Creating command queue");
 
-    // Create the compute program from the source buffer
-    program = clCreateProgramWithSource(context, 1, (const char **) & OpenCL_code, NULL, &err);
-    checkError(err, "Creating program");
+    // Create and build the compute program, specialized for the device
+    // when asked to
+    struct build_info build;
+    struct kernel_variant variant;
+    if (opts.specialize)
+    {
+        char options[256];
+        variant_select(device_id, opts.metrics, opts.fast_math, &variant);
+        variant_options(&variant, options, sizeof(options));
+        printf("Specialized build: %s\n", options);
 
-    // Build the program
-    err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-    if (err != CL_SUCCESS)
+        program = build_variant(context, device_id, &variant, &build);
+    }
+    else
+        program = build_program(context, device_id, &build);
+
+    // Narrow element types have their own kernels, host data and check
+    if (opts.type != ELEM_INT)
     {
-        size_t len;
-        char buffer[2048];
+        size_t mismatches = run_narrow(context, commands, program, opts.type, opts.length,
+                                       opts.generate, opts.seed);
 
-        printf("Error: Failed to build program executable!\n%s\n", err_code(err));
-        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
-        printf("%s\n", buffer);
-        return EXIT_FAILURE;
+        clReleaseProgram(program);
+        clReleaseCommandQueue(commands);
+        clReleaseContext(context);
+
+        return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // The fused metrics kernel has its own outputs and check
+    if (opts.metrics)
+    {
+        size_t mismatches = run_metrics(context, commands, program, opts.metrics, opts.length, &opts.launch,
+                                        opts.generate, opts.seed);
+
+        clReleaseProgram(program);
+        clReleaseCommandQueue(commands);
+        clReleaseContext(context);
+
+        return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Aggregates are reduced on the device, the per-cuboid results are never
+    // read back
+    if (opts.aggregate)
+    {
+        size_t mismatches = run_aggregate(context, device_id, commands, program, opts.length,
+                                          opts.aggregate == 1, opts.bins, opts.bin_width,
+                                          opts.generate, opts.seed);
+
+        clReleaseProgram(program);
+        clReleaseCommandQueue(commands);
+        clReleaseContext(context);
+
+        return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Sweep the launch configurations of the scalar copy path and keep the
+    // fastest for the next runs on this device
+    if (opts.tune)
+    {
+        struct launch_config best;
+        tune_run(context, device_id, commands, program, opts.length, &best);
+
+        clReleaseProgram(program);
+        clReleaseCommandQueue(commands);
+        clReleaseContext(context);
+
+        return EXIT_SUCCESS;
+    }
+
+    // Without an explicit launch configuration the scalar copy path uses the
+    // one --tune saved for this device
+    if (!opts.launch_set && !opts.specialize && !opts.bench && !opts.stream && !opts.stride &&
+        opts.mem != MEM_ZERO_COPY && opts.layout == LAYOUT_SOA && opts.vector == 1 &&
+        tune_load(device_id, &opts.launch) == 0)
+    {
+        printf("Using tuned launch configuration: local=%zu items=%u\n",
+               opts.launch.local, (unsigned) opts.launch.items);
     }
 
     // Create the compute kernel from the program
-    kernel_cuboid_area = clCreateKernel(program, "cuboid_area", &err);
+    char kernel_name[32] = "cuboid_area";
+    if (opts.specialize)
+        snprintf(kernel_name, sizeof(kernel_name), "cuboid_area_spec");
+    else if (opts.layout == LAYOUT_AOS)
+        snprintf(kernel_name, sizeof(kernel_name), "cuboid_area_packed");
+    else if (opts.vector > 1)
+        snprintf(kernel_name, sizeof(kernel_name), "cuboid_area_vec%d", opts.vector);
+    else if (opts.launch.items > 1)
+        snprintf(kernel_name, sizeof(kernel_name), "cuboid_area_items");
+
+    kernel_cuboid_area = clCreateKernel(program, kernel_name, &err);
     checkError(err, "Creating kernel");
 
-    // Create the input (a, b) and output (c) arrays in device memory
-    d_a  = clCreateBuffer(context,  CL_MEM_READ_ONLY,  sizeof(float) * LENGTH, NULL, &err);
-    checkError(err, "Creating buffer d_a");
+    startup_time = wtime() - startup_time;
+    printf("Startup took %lf seconds, of which the program build took %lf seconds (%s)\n",
+           startup_time, build.build_time, build.cache_hit ? "binary cache hit" : "built from source");
 
-    d_b  = clCreateBuffer(context,  CL_MEM_READ_ONLY,  sizeof(float) * LENGTH, NULL, &err);
-    checkError(err, "Creating buffer d_b");
+    // Dataset files bring their own data and sizes
+    if (opts.input || opts.save)
+    {
+        int status = main_dataset(&opts, context, device_id, kernel_cuboid_area);
 
-    d_c  = clCreateBuffer(context,  CL_MEM_READ_ONLY, sizeof(float) * LENGTH, NULL, &err);
-    checkError(err, "Creating buffer d_c");
+        clReleaseProgram(program);
+        clReleaseKernel(kernel_cuboid_area);
+        clReleaseCommandQueue(commands);
+        clReleaseContext(context);
 
-    d_result  = clCreateBuffer(context,  CL_MEM_WRITE_ONLY, sizeof(float) * LENGTH, NULL, &err);
-    checkError(err, "Creating buffer d_result");
+        return status;
+    }
 
-    // Write a and b vectors into compute device memory
-    err = clEnqueueWriteBuffer(commands, d_a, CL_TRUE, 0, sizeof(float) * LENGTH, source_a, 0, NULL, NULL);
-    checkError(err, "Copying source_a to device at d_a");
+    // The device and the CPU share the range
+    if (opts.hybrid)
+    {
+        int status = main_hybrid(&opts, context, commands, kernel_cuboid_area);
 
-    err = clEnqueueWriteBuffer(commands, d_b, CL_TRUE, 0, sizeof(float) * LENGTH, source_b, 0, NULL, NULL);
-    checkError(err, "Copying source_b to device at d_b");
+        clReleaseProgram(program);
+        clReleaseKernel(kernel_cuboid_area);
+        clReleaseCommandQueue(commands);
+        clReleaseContext(context);
 
-    err = clEnqueueWriteBuffer(commands, d_c, CL_TRUE, 0, sizeof(float) * LENGTH, source_c, 0, NULL, NULL);
-    checkError(err, "Copying source_c to device at d_c");
+        return status;
+    }
 
-    // Set the arguments to our compute kernel
-    err  = clSetKernelArg(kernel_cuboid_area, 0, sizeof(cl_mem), &d_a);
-    err |= clSetKernelArg(kernel_cuboid_area, 1, sizeof(cl_mem), &d_b);
-    err |= clSetKernelArg(kernel_cuboid_area, 2, sizeof(cl_mem), &d_c);
-    err |= clSetKernelArg(kernel_cuboid_area, 3, sizeof(cl_mem), &d_result);
-    checkError(err, "Setting kernel arguments");
+    // Three host arrays and three device buffers
+    if (opts.lean)
+    {
+        int status = main_lean(&opts, context, commands, program);
 
-    double cl_time = wtime();
+        clReleaseProgram(program);
+        clReleaseKernel(kernel_cuboid_area);
+        clReleaseCommandQueue(commands);
+        clReleaseContext(context);
 
-    // Execute the kernel over the entire range of our 1d input data set
-    // letting the OpenCL runtime choose the work-group size
-    global = LENGTH;
-    err = clEnqueueNDRangeKernel(commands, kernel_cuboid_area, 1, NULL, &global, NULL, 0, NULL, NULL);
-    checkError(err, "Enqueueing kernel");
+        return status;
+    }
 
-    // Wait for the commands to complete before stopping the timer
-    err = clFinish(commands);
-    checkError(err, "Waiting for kernel to finish");
+    // A filter runs until its input ends
+    if (opts.filter)
+    {
+        double filter_time;
+        size_t records = run_filter(context, commands, kernel_cuboid_area, STDIN_FILENO, results_fd,
+                                    opts.frame, &filter_time);
+        if (records != (size_t) -1)
+            printf("Filtered %zu records in %lf seconds, %lf million records/s\n",
+                   records, filter_time, records / filter_time / 1e6);
+        close(results_fd);
 
-    cl_time = wtime() - cl_time;
-    printf("\nThe OpenCL kernel ran in %lf seconds\n", cl_time);
+        clReleaseProgram(program);
+        clReleaseKernel(kernel_cuboid_area);
+        clReleaseCommandQueue(commands);
+        clReleaseContext(context);
 
-    // Read back the results from the compute device
-    err = clEnqueueReadBuffer( commands, d_result, CL_TRUE, 0, sizeof(float) * LENGTH, result_opencl, 0, NULL, NULL );
-    if (err != CL_SUCCESS)
+        return records != (size_t) -1 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // The benchmark sweep brings its own data and sizes
+    if (opts.bench)
     {
-        printf("Error: Failed to read output array!\n%s\n", err_code(err));
-        exit(1);
+        run_bench(context, device_id, commands, kernel_cuboid_area, &opts.bo);
+        if (opts.bo.out != stdout)
+            fclose(opts.bo.out);
+
+        clReleaseProgram(program);
+        clReleaseKernel(kernel_cuboid_area);
+        clReleaseCommandQueue(commands);
+        clReleaseContext(context);
+
+        return EXIT_SUCCESS;
     }
-    
-    // Sequential testing;
+
+    // In zero-copy mode the host arrays are the mapped device buffers, so the
+    // inputs are generated straight into device-visible memory
+    if (opts.mem == MEM_ZERO_COPY)
+    {
+        zero_copy_create(context, commands, &zc, opts.length);
+        source_a = zc.a;
+        source_b = zc.b;
+        source_c = zc.c;
+        result_opencl = NULL;   // mapped by zero_copy_run()
+    }
+    else
+    {
+        // Placed on the NUMA node of the CPU thread that will read them
+        source_a = (int*) cpu_alloc(opts.length, sizeof(int));
+        source_b = (int*) cpu_alloc(opts.length, sizeof(int));
+        source_c = (int*) cpu_alloc(opts.length, sizeof(int));
+        result_opencl = (int*) calloc(opts.length, sizeof(int));
+    }
+
+    double fill_time = make_inputs(source_a, source_b, source_c, opts.length, 0, opts.generate, opts.seed);
+    printf("Generating the inputs on the host took %lf seconds (%s)\n", fill_time,
+           opts.generate ? "Philox on every CPU thread" : "rand() on one thread");
+
+    double cl_time;
+    double cl_total;
+    int    device_inputs = 0;   // the device generated its own inputs
+    int    device_hashed = 0;   // checksum holds the device's hash of its result
+    cl_ulong checksum = 0;
+
+    if (opts.graph)
+    {
+        struct graph_stats gs;
+        cl_time = run_graph(context, device_id, kernel_cuboid_area,
+                            source_a, source_b, source_c, result_opencl,
+                            opts.length, opts.chunk, &gs);
+        printf("\nThe OpenCL task graph ran in %lf seconds (%zu nodes, %s)\n", cl_time, gs.nodes,
+               gs.out_of_order ? "one out-of-order queue" : "in-order queue per node kind");
+        printf("Device time: transfers %lf s, kernels %lf s, span %lf s, overlap %.2lfx\n",
+               gs.transfer_time, gs.kernel_time, gs.device_span,
+               gs.device_span > 0.0 ? (gs.transfer_time + gs.kernel_time) / gs.device_span : 0.0);
+        cl_total = cl_time;
+    }
+    else if (opts.stream)
+    {
+        // Stream the input through the device in chunks, the timing then
+        // covers the transfers as well as the kernel
+        cl_time = run_streaming(context, device_id, kernel_cuboid_area,
+                                source_a, source_b, source_c, result_opencl,
+                                opts.length, opts.chunk, opts.pinned);
+        printf("\nThe OpenCL streaming pipeline ran in %lf seconds (%zu elements per chunk%s)\n",
+               cl_time, opts.chunk < opts.length ? opts.chunk : opts.length,
+               opts.pinned ? ", pinned staging" : "");
+        if (opts.pinned)
+            report_pinned(context, device_id, opts.chunk < opts.length ? opts.chunk : opts.length);
+        cl_total = cl_time;
+    }
+    else if (opts.stride)
+    {
+        struct stride_report sr;
+        cl_time = run_stride(context, device_id, commands, program, source_a, source_b, source_c,
+                             result_opencl, opts.length, opts.launch.local, &sr, &cl_total);
+        printf("Grid-stride write + kernel + read took %lf seconds\n", cl_total);
+        printf("Grid-stride launch: %zu work-items, %zu groups of %zu on %u compute units\n",
+               sr.global, sr.groups, sr.local, (unsigned) sr.compute_units);
+        printf("Best kernel: grid-stride %lf s", sr.stride_time);
+        if (sr.item_time > 0.0)
+            printf(", one work-item per cuboid %lf s (%.2lfx)\n", sr.item_time,
+                   sr.stride_time > 0.0 ? sr.item_time / sr.stride_time : 0.0);
+        else
+            printf(", one work-item per cuboid cannot index %zu cuboids\n", opts.length);
+    }
+    else if (opts.mem == MEM_ZERO_COPY)
+    {
+        cl_total = zero_copy_run(commands, kernel_cuboid_area, &zc, &cl_time);
+        printf("\nThe OpenCL kernel ran in %lf seconds (zero-copy)\n", cl_time);
+        printf("Zero-copy unmap + kernel + map took %lf seconds\n", cl_total);
+
+        source_a = zc.a;
+        source_b = zc.b;
+        source_c = zc.c;
+        result_opencl = zc.result;
+    }
+    else if (opts.layout == LAYOUT_AOS)
+    {
+        // Hand the inputs to the device as packed {a, b, c, pad} records
+        cl_int4 *packed = (cl_int4*) calloc(opts.length, sizeof(cl_int4));
+        pack_cuboids(source_a, source_b, source_c, packed, opts.length);
+
+        cl_time = run_packed(context, commands, kernel_cuboid_area,
+                             packed, result_opencl, opts.length, &cl_total);
+        printf("Packed write + kernel + read took %lf seconds\n", cl_total);
+
+        free(packed);
+    }
+    else
+    {
+        struct profile prof;
+        profile_init(&prof);
+
+        cl_kernel kernel_generate = NULL;
+        if (opts.generate)
+        {
+            kernel_generate = clCreateKernel(program, "cuboid_generate", &err);
+            checkError(err, "Creating generator kernel");
+        }
+        cl_kernel kernel_checksum = NULL;
+        if (opts.verify == VERIFY_CHECKSUM)
+        {
+            kernel_checksum = clCreateKernel(program, "cuboid_checksum", &err);
+            checkError(err, "Creating checksum kernel");
+        }
+
+        // A variant handles width * items cuboids per work-item
+        int width = opts.specialize ? (int) (variant.width * variant.items) : opts.vector;
+
+        cl_time = run_copy(context, commands, kernel_cuboid_area,
+                           source_a, source_b, source_c, result_opencl, opts.length, width, &opts.launch,
+                           kernel_generate, opts.seed, kernel_checksum, &checksum, &cl_total, &prof);
+        if (kernel_generate != NULL)
+        {
+            clReleaseKernel(kernel_generate);
+            device_inputs = 1;
+        }
+        if (kernel_checksum != NULL)
+        {
+            clReleaseKernel(kernel_checksum);
+            device_hashed = 1;
+        }
+        if (opts.specialize)
+            printf("(%s, %u cuboids per vector, %u vectors per work-item)\n", kernel_name,
+                   (unsigned) variant.width, (unsigned) variant.items);
+        else if (opts.vector > 1)
+            printf("(%s, %d cuboids per work-item)\n", kernel_name, opts.vector);
+        else if (opts.launch.items > 1)
+            printf("(%s, %u cuboids per work-item)\n", kernel_name, (unsigned) opts.launch.items);
+        printf("Copy write + kernel + read took %lf seconds\n", cl_total);
+        profile_report(&prof, cl_total, opts.peak_bw);
+
+        if (opts.mem == MEM_COMPARE)
+        {
+            // Run the zero-copy path on the same data and check it agrees
+            // with the copy path
+            double zc_kernel;
+
+            zero_copy_create(context, commands, &zc, opts.length);
+            make_inputs(zc.a, zc.b, zc.c, opts.length, 0, opts.generate, opts.seed);
+            double zc_total = zero_copy_run(commands, kernel_cuboid_area, &zc, &zc_kernel);
+
+            size_t mismatches = 0;
+            for (size_t i = 0; i < opts.length; i++) {
+                if (zc.result[i] != result_opencl[i])
+                    mismatches++;
+            }
+            zero_copy_release(commands, &zc);
+
+            printf("\n%-10s %14s %14s\n", "path", "kernel (s)", "end-to-end (s)");
+            printf("%-10s %14lf %14lf\n", "copy", cl_time, cl_total);
+            printf("%-10s %14lf %14lf\n", "zero-copy", zc_kernel, zc_total);
+            printf("Zero-copy end-to-end is %lfX of the copy path, %zu mismatching results\n\n",
+                   zc_total / cl_total, mismatches);
+        }
+    }
+
+    // Sequential testing; the loop is only the timing baseline, its results
+    // land in the buffer the CPU engine reuses below
+    result_host = (int*) cpu_alloc(opts.length, sizeof(int));
+
     double seq_time = wtime();
-    for (int i = 0; i < LENGTH; i++) {
-        result_sequential[i] =  2 * ((source_a[i] * source_b[i]) + (source_b[i] * source_c[i]) +  (source_a[i] * source_c[i]));
+    for (size_t i = 0; i < opts.length; i++) {
+        result_host[i] =  2 * ((source_a[i] * source_b[i]) + (source_b[i] * source_c[i]) +  (source_a[i] * source_c[i]));
     }
     seq_time = wtime() - seq_time;
     printf("The sequential code ran in %lf seconds\n\n", seq_time);
+
+    // The results are recomputed from the inputs while checking, so no
+    // reference array is needed. On device-generated inputs this also checks
+    // that the host generator reproduced the device's.
+    struct verify_report report;
+    double verify_time = wtime();
+    if (device_hashed)
+        verify_checksum(source_a, source_b, source_c, opts.length, checksum, 1, &report);
+    else
+        verify_result(opts.verify, source_a, source_b, source_c, result_opencl, opts.length,
+                      opts.samples, &report);
+    verify_time = wtime() - verify_time;
+    size_t mismatches = verify_print(&report, device_inputs ? "OpenCL on device-generated inputs" : "OpenCL");
+    if (opts.verify != VERIFY_NONE)
+        printf("Verification took %lf seconds\n\n", verify_time);
     
     double ratio = seq_time / cl_time;
 
     printf("The sequential time is %lfX of the OpenCL time\n\n", ratio);
 
+    // Multithreaded SIMD CPU engine, the fair baseline for the OpenCL numbers
+    double cpu_time = wtime();
+    cpu_cuboid_area(source_a, source_b, source_c, result_host, opts.length);
+    cpu_time = wtime() - cpu_time;
+    printf("The CPU engine ran in %lf seconds (%d threads, %s)\n", cpu_time, cpu_threads(), cpu_isa());
+
+    verify_result(opts.verify, source_a, source_b, source_c, result_host, opts.length, opts.samples, &report);
+    mismatches += verify_print(&report, "CPU engine");
+
+    double best_cpu = cpu_time < seq_time ? cpu_time : seq_time;
+    printf("The best CPU time is %lfX of the OpenCL kernel time\n", best_cpu / cl_time);
+    printf("The best CPU time is %lfX of the OpenCL time including transfers\n\n", best_cpu / cl_total);
+
     // Print Result
-    for(int i = 0; i < 100; i++) {
+    size_t shown = opts.length < 100 ? opts.length : 100;
+    for(size_t i = 0; i < shown; i++) {
         printf("a=%d\tb=%d\tc=%d\t\topencl=%d\t\tseq=%d\n",
                source_a[i],
                source_b[i],
                source_c[i],
                result_opencl[i],
-               result_sequential[i]
+               result_host[i]
                );
     }
-    printf("... %d more items\n", LENGTH - 100);
+    if (opts.length > shown)
+        printf("... %zu more items\n", opts.length - shown);
+    printf("Peak resident host memory: %.1lf MB\n", peak_rss() / (1024.0 * 1024.0));
         
     // cleanup then shutdown
-    clReleaseMemObject(d_a);
-    clReleaseMemObject(d_b);
-    clReleaseMemObject(d_c);
+    if (opts.mem == MEM_ZERO_COPY)
+        zero_copy_release(commands, &zc);
+
     clReleaseProgram(program);
     clReleaseKernel(kernel_cuboid_area);
     clReleaseCommandQueue(commands);
     clReleaseContext(context);
 
-    free(source_a);
-    free(source_b);
-    free(source_c);
-    free(result_opencl);
-    free(result_sequential);
+    if (opts.mem != MEM_ZERO_COPY)
+    {
+        free(source_a);
+        free(source_b);
+        free(source_c);
+        free(result_opencl);
+    }
+    free(result_host);
 
     printf("\n");
 
-    return 0;
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
@@ -0,0 +1,243 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Volume, surface area and space diagonal in one fused pass
+//
+//             cuboid_metrics reads every a, b and c once and writes only the
+//             outputs selected by the metric bitmask, each to its own
+//             buffer; unselected outputs are passed as NULL. For comparison
+//             every selected metric is also run as a separate pass over the
+//             same device-resident inputs, which is what computing them one
+//             kernel at a time costs.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+static const char *metric_names[] = { "volume", "area", "diagonal" };
+
+#define METRIC_COUNT 3
+
+unsigned metric_mask(const char *list)
+{
+    unsigned mask = 0;
+
+    while (*list)
+    {
+        size_t len = strcspn(list, ",");
+        unsigned bit = 0;
+
+        if (len == 3 && strncmp(list, "all", 3) == 0)
+            bit = METRIC_ALL;
+        for (int m = 0; m < METRIC_COUNT; m++)
+        {
+            if (len == strlen(metric_names[m]) && strncmp(list, metric_names[m], len) == 0)
+                bit = 1u << m;
+        }
+        if (bit == 0)
+            return 0;
+
+        mask |= bit;
+        list += len;
+        if (*list == ',')
+            list++;
+    }
+
+    return mask;
+}
+
+// One launch of cuboid_metrics for the metrics in mask, returns the kernel
+// time from its profiling event
+static double metrics_pass(cl_command_queue commands, cl_kernel kernel, cl_mem d_out[METRIC_COUNT],
+                           unsigned mask, size_t length, const struct launch_config *lc)
+{
+    int err;
+
+    for (int m = 0; m < METRIC_COUNT; m++)
+    {
+        cl_mem *out = (mask & (1u << m)) ? &d_out[m] : NULL;
+        err = clSetKernelArg(kernel, 3 + m, sizeof(cl_mem), out);
+        checkError(err, "Setting metric output");
+    }
+    cl_uint n = (cl_uint) length;
+    err  = clSetKernelArg(kernel, 6, sizeof(cl_uint), &n);
+    err |= clSetKernelArg(kernel, 7, sizeof(cl_uint), &mask);
+    checkError(err, "Setting metric count and mask");
+
+    cl_event event;
+    cl_ulong start, end;
+    size_t   global = launch_global(lc, length);
+
+    err = clEnqueueNDRangeKernel(commands, kernel, 1, NULL, &global,
+                                 lc->local > 0 ? &lc->local : NULL, 0, NULL, &event);
+    checkError(err, "Enqueueing metrics kernel");
+
+    err = clWaitForEvents(1, &event);
+    checkError(err, "Waiting for metrics kernel to finish");
+
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+    clReleaseEvent(event);
+
+    return (end - start) * 1.0e-9;
+}
+
+// Three ulp, the accuracy OpenCL requires of single precision sqrt
+static int diagonal_matches(float device, float host)
+{
+    return fabsf(device - host) <= 3.0f * 1.1920929e-7f * fabsf(host);
+}
+
+//------------------------------------------------------------------------------
+
+size_t run_metrics(cl_context context, cl_command_queue commands, cl_program program,
+                   unsigned mask, size_t length, const struct launch_config *lc,
+                   int generate, cl_ulong seed)
+{
+    int err;
+
+    size_t in_bytes = sizeof(cl_int) * length;
+    size_t out_bytes[METRIC_COUNT] = { sizeof(cl_int) * length, sizeof(cl_int) * length,
+                                       sizeof(cl_float) * length };
+
+    cl_kernel kernel = clCreateKernel(program, "cuboid_metrics", &err);
+    checkError(err, "Creating metrics kernel");
+
+    int   *a = (int*) cpu_alloc(length, sizeof(int));
+    int   *b = (int*) cpu_alloc(length, sizeof(int));
+    int   *c = (int*) cpu_alloc(length, sizeof(int));
+    void  *out[METRIC_COUNT] = { NULL, NULL, NULL };
+    cl_mem d_out[METRIC_COUNT] = { NULL, NULL, NULL };
+
+    if (a == NULL || b == NULL || c == NULL)
+    {
+        fprintf(stderr, "Error: Failed to allocate host memory for %zu elements!\n", length);
+        exit(EXIT_FAILURE);
+    }
+
+    make_inputs(a, b, c, length, 0, generate, seed);
+
+    cl_mem d_a = clCreateBuffer(context, CL_MEM_READ_ONLY, in_bytes, NULL, &err);
+    checkError(err, "Creating buffer d_a");
+    cl_mem d_b = clCreateBuffer(context, CL_MEM_READ_ONLY, in_bytes, NULL, &err);
+    checkError(err, "Creating buffer d_b");
+    cl_mem d_c = clCreateBuffer(context, CL_MEM_READ_ONLY, in_bytes, NULL, &err);
+    checkError(err, "Creating buffer d_c");
+
+    // Only the selected outputs take device and host memory
+    size_t written = 0;
+    for (int m = 0; m < METRIC_COUNT; m++)
+    {
+        if (!(mask & (1u << m)))
+            continue;
+        d_out[m] = clCreateBuffer(context, CL_MEM_WRITE_ONLY, out_bytes[m], NULL, &err);
+        checkError(err, "Creating metric buffer");
+        out[m] = malloc(out_bytes[m]);
+        if (out[m] == NULL)
+        {
+            fprintf(stderr, "Error: Failed to allocate host memory for %zu elements!\n", length);
+            exit(EXIT_FAILURE);
+        }
+        written += out_bytes[m];
+    }
+
+    double total_time = wtime();
+
+    err  = clEnqueueWriteBuffer(commands, d_a, CL_FALSE, 0, in_bytes, a, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(commands, d_b, CL_FALSE, 0, in_bytes, b, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(commands, d_c, CL_FALSE, 0, in_bytes, c, 0, NULL, NULL);
+    checkError(err, "Copying inputs to the device");
+
+    err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_a);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_b);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_c);
+    checkError(err, "Setting metrics kernel arguments");
+
+    double fused_time = metrics_pass(commands, kernel, d_out, mask, length, lc);
+
+    for (int m = 0; m < METRIC_COUNT; m++)
+    {
+        if (d_out[m] == NULL)
+            continue;
+        err = clEnqueueReadBuffer(commands, d_out[m], CL_FALSE, 0, out_bytes[m], out[m], 0, NULL, NULL);
+        checkError(err, "Reading back metric");
+    }
+    err = clFinish(commands);
+    checkError(err, "Waiting for metric read back");
+
+    total_time = wtime() - total_time;
+
+    printf("\nThe fused metrics kernel ran in %lf seconds (", fused_time);
+    for (int m = 0, first = 1; m < METRIC_COUNT; m++)
+    {
+        if (mask & (1u << m))
+        {
+            printf("%s%s", first ? "" : ", ", metric_names[m]);
+            first = 0;
+        }
+    }
+    printf("), %.2lf GB/s\n", fused_time > 0.0 ? (3 * in_bytes + written) / fused_time / 1.0e9 : 0.0);
+    printf("Write + kernel + read took %lf seconds\n", total_time);
+
+    // The same metrics one kernel launch at a time, each reading all three
+    // inputs again
+    if (mask & (mask - 1))
+    {
+        double separate_time = 0.0;
+        for (int m = 0; m < METRIC_COUNT; m++)
+        {
+            if (mask & (1u << m))
+                separate_time += metrics_pass(commands, kernel, d_out, 1u << m, length, lc);
+        }
+        printf("One pass per metric took %lf seconds, the fused kernel is %lfX faster\n",
+               separate_time, fused_time > 0.0 ? separate_time / fused_time : 0.0);
+    }
+
+    // Sequential check of every selected output
+    size_t mismatches = 0;
+    int   *volume   = (int*) out[0];
+    int   *area     = (int*) out[1];
+    float *diagonal = (float*) out[2];
+
+    double seq_time = wtime();
+    for (size_t i = 0; i < length; i++) {
+        int x = a[i], y = b[i], z = c[i];
+        if (volume != NULL && volume[i] != x * y * z)
+            mismatches++;
+        if (area != NULL && area[i] != 2 * ((x * y) + (y * z) + (x * z)))
+            mismatches++;
+        if (diagonal != NULL && !diagonal_matches(diagonal[i], sqrtf((float) (x * x + y * y + z * z))))
+            mismatches++;
+    }
+    seq_time = wtime() - seq_time;
+    printf("The sequential check ran in %lf seconds\n", seq_time);
+
+    if (mismatches == 0)
+        printf("All %zu cuboids match the sequential code\n", length);
+    else
+        printf("Error: %zu values differ from the sequential code!\n", mismatches);
+
+    for (int m = 0; m < METRIC_COUNT; m++)
+    {
+        if (d_out[m] != NULL)
+            clReleaseMemObject(d_out[m]);
+        free(out[m]);
+    }
+    clReleaseMemObject(d_a);
+    clReleaseMemObject(d_b);
+    clReleaseMemObject(d_c);
+    clReleaseKernel(kernel);
+
+    free(a);
+    free(b);
+    free(c);
+
+    return mismatches;
+}
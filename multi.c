@@ -0,0 +1,248 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Split one cuboid range across every OpenCL device of every
+//             platform
+//
+//             Each device gets its own context, queue, program and a set of
+//             chunk-sized buffers, and is driven by its own host thread.
+//             The threads pull chunks from a shared work counter, so a
+//             device takes new work as soon as it finishes the previous
+//             chunk and every device's share ends up proportional to its
+//             real throughput. Results are read straight into their place in
+//             the single output array.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+struct multi_work {
+    pthread_mutex_t lock;
+    size_t          next;       // first element not yet handed out
+
+    size_t          length;
+    size_t          chunk;
+
+    const int      *a;
+    const int      *b;
+    const int      *c;
+    int            *result;
+};
+
+struct multi_thread {
+    struct multi_device *dev;
+    struct multi_work   *work;
+};
+
+//------------------------------------------------------------------------------
+
+int multi_discover(struct multi_device **devices)
+{
+    int err;
+
+    cl_uint numPlatforms;
+    err = clGetPlatformIDs(0, NULL, &numPlatforms);
+    checkError(err, "Finding platforms");
+    if (numPlatforms == 0)
+        return 0;
+
+    cl_platform_id Platform[numPlatforms];
+    err = clGetPlatformIDs(numPlatforms, Platform, NULL);
+    checkError(err, "Getting platforms");
+
+    int count = 0;
+    *devices = NULL;
+
+    for (cl_uint p = 0; p < numPlatforms; p++)
+    {
+        cl_uint numDevices;
+        err = clGetDeviceIDs(Platform[p], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices);
+        if (err != CL_SUCCESS || numDevices == 0)
+            continue;
+
+        cl_device_id ids[numDevices];
+        err = clGetDeviceIDs(Platform[p], CL_DEVICE_TYPE_ALL, numDevices, ids, NULL);
+        checkError(err, "Getting devices");
+
+        *devices = (struct multi_device*) realloc(*devices, (count + numDevices) * sizeof(struct multi_device));
+
+        for (cl_uint d = 0; d < numDevices; d++)
+        {
+            struct multi_device *dev = &(*devices)[count++];
+
+            dev->device_id = ids[d];
+            clGetDeviceInfo(ids[d], CL_DEVICE_NAME, sizeof(dev->name), dev->name, NULL);
+
+            dev->context = clCreateContext(0, 1, &ids[d], NULL, NULL, &err);
+            checkError(err, "Creating context");
+            dev->commands = clCreateCommandQueue(dev->context, ids[d], 0, &err);
+            checkError(err, "Creating command queue");
+            dev->program = build_program(dev->context, ids[d], NULL);
+            dev->kernel = clCreateKernel(dev->program, "cuboid_area", &err);
+            checkError(err, "Creating kernel");
+
+            dev->d_a = dev->d_b = dev->d_c = dev->d_result = NULL;
+            dev->chunks = 0;
+            dev->elements = 0;
+            dev->busy_time = 0.0;
+        }
+    }
+
+    return count;
+}
+
+//------------------------------------------------------------------------------
+
+static void *multi_worker(void *arg)
+{
+    struct multi_thread *t    = (struct multi_thread*) arg;
+    struct multi_device *dev  = t->dev;
+    struct multi_work   *work = t->work;
+
+    int err;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&work->lock);
+        size_t offset = work->next;
+        if (offset < work->length)
+            work->next += work->chunk;
+        pthread_mutex_unlock(&work->lock);
+
+        if (offset >= work->length)
+            break;
+
+        size_t count = (offset + work->chunk > work->length) ? work->length - offset : work->chunk;
+        size_t bytes = sizeof(cl_int) * count;
+
+        double start = wtime();
+
+        // Only the element count changes from chunk to chunk
+        cl_uint n = (cl_uint) count;
+        err = clSetKernelArg(dev->kernel, 4, sizeof(cl_uint), &n);
+        checkError(err, "Setting kernel element count");
+
+        err  = clEnqueueWriteBuffer(dev->commands, dev->d_a, CL_FALSE, 0, bytes, work->a + offset, 0, NULL, NULL);
+        err |= clEnqueueWriteBuffer(dev->commands, dev->d_b, CL_FALSE, 0, bytes, work->b + offset, 0, NULL, NULL);
+        err |= clEnqueueWriteBuffer(dev->commands, dev->d_c, CL_FALSE, 0, bytes, work->c + offset, 0, NULL, NULL);
+        checkError(err, "Copying chunk to device");
+
+        err = clEnqueueNDRangeKernel(dev->commands, dev->kernel, 1, NULL, &count, NULL, 0, NULL, NULL);
+        checkError(err, "Enqueueing kernel");
+
+        err = clEnqueueReadBuffer(dev->commands, dev->d_result, CL_TRUE, 0, bytes, work->result + offset, 0, NULL, NULL);
+        checkError(err, "Reading back chunk");
+
+        dev->busy_time += wtime() - start;
+        dev->chunks++;
+        dev->elements += count;
+    }
+
+    return NULL;
+}
+
+double run_multi(struct multi_device *devices, int count,
+                 const int *a, const int *b, const int *c, int *result,
+                 size_t length, size_t chunk)
+{
+    int err;
+
+    struct multi_work work;
+
+    if (chunk == 0 || chunk > length)
+        chunk = length;
+
+    pthread_mutex_init(&work.lock, NULL);
+    work.next   = 0;
+    work.length = length;
+    work.chunk  = chunk;
+    work.a      = a;
+    work.b      = b;
+    work.c      = c;
+    work.result = result;
+
+    // The buffer arguments never change, only the buffer contents do
+    for (int d = 0; d < count; d++)
+    {
+        struct multi_device *dev = &devices[d];
+
+        dev->d_a = clCreateBuffer(dev->context, CL_MEM_READ_ONLY, sizeof(cl_int) * chunk, NULL, &err);
+        checkError(err, "Creating buffer d_a");
+        dev->d_b = clCreateBuffer(dev->context, CL_MEM_READ_ONLY, sizeof(cl_int) * chunk, NULL, &err);
+        checkError(err, "Creating buffer d_b");
+        dev->d_c = clCreateBuffer(dev->context, CL_MEM_READ_ONLY, sizeof(cl_int) * chunk, NULL, &err);
+        checkError(err, "Creating buffer d_c");
+        dev->d_result = clCreateBuffer(dev->context, CL_MEM_WRITE_ONLY, sizeof(cl_int) * chunk, NULL, &err);
+        checkError(err, "Creating buffer d_result");
+
+        err  = clSetKernelArg(dev->kernel, 0, sizeof(cl_mem), &dev->d_a);
+        err |= clSetKernelArg(dev->kernel, 1, sizeof(cl_mem), &dev->d_b);
+        err |= clSetKernelArg(dev->kernel, 2, sizeof(cl_mem), &dev->d_c);
+        err |= clSetKernelArg(dev->kernel, 3, sizeof(cl_mem), &dev->d_result);
+        checkError(err, "Setting kernel arguments");
+
+        dev->chunks = 0;
+        dev->elements = 0;
+        dev->busy_time = 0.0;
+    }
+
+    pthread_t           threads[count];
+    struct multi_thread args[count];
+
+    double multi_time = wtime();
+
+    for (int d = 0; d < count; d++)
+    {
+        args[d].dev  = &devices[d];
+        args[d].work = &work;
+        pthread_create(&threads[d], NULL, multi_worker, &args[d]);
+    }
+    for (int d = 0; d < count; d++)
+        pthread_join(threads[d], NULL);
+
+    multi_time = wtime() - multi_time;
+
+    pthread_mutex_destroy(&work.lock);
+
+    for (int d = 0; d < count; d++)
+    {
+        clReleaseMemObject(devices[d].d_a);
+        clReleaseMemObject(devices[d].d_b);
+        clReleaseMemObject(devices[d].d_c);
+        clReleaseMemObject(devices[d].d_result);
+        devices[d].d_a = devices[d].d_b = devices[d].d_c = devices[d].d_result = NULL;
+    }
+
+    return multi_time;
+}
+
+void multi_report(const struct multi_device *devices, int count, size_t length)
+{
+    printf("\n%-3s %-40s %8s %12s %8s %14s\n", "#", "device", "chunks", "elements", "share", "Melements/s");
+    for (int d = 0; d < count; d++)
+    {
+        const struct multi_device *dev = &devices[d];
+        double rate = dev->busy_time > 0.0 ? dev->elements / dev->busy_time / 1.0e6 : 0.0;
+
+        printf("%-3d %-40.40s %8zu %12zu %7.2lf%% %14.2lf\n", d, dev->name,
+               dev->chunks, dev->elements, 100.0 * dev->elements / length, rate);
+    }
+}
+
+void multi_release(struct multi_device *devices, int count)
+{
+    for (int d = 0; d < count; d++)
+    {
+        clReleaseKernel(devices[d].kernel);
+        clReleaseProgram(devices[d].program);
+        clReleaseCommandQueue(devices[d].commands);
+        clReleaseContext(devices[d].context);
+    }
+    free(devices);
+}
@@ -0,0 +1,214 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Narrow input types with widened 64-bit results
+//
+//             The dimensions only need 8 or 16 bits, storing them as
+//             cl_uchar or cl_ushort cuts the input bandwidth by 4x or 2x.
+//             The area is computed and stored in 64 bits, so
+//             2 * (a*b + b*c + a*c) cannot overflow for any input of these
+//             types.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+size_t elem_size(enum elem_type type)
+{
+    switch (type) {
+        case ELEM_USHORT:
+            return sizeof(cl_ushort);
+        case ELEM_UCHAR:
+            return sizeof(cl_uchar);
+        default:
+            return sizeof(cl_int);
+    }
+}
+
+const char *elem_name(enum elem_type type)
+{
+    switch (type) {
+        case ELEM_USHORT:
+            return "ushort";
+        case ELEM_UCHAR:
+            return "uchar";
+        default:
+            return "int";
+    }
+}
+
+// Inputs per make_inputs() call, converted to the narrow type from there
+#define NARROW_FILL_CHUNK (64 * 1024)
+
+// The same values as make_inputs() gives the int paths
+static void fill_narrow(enum elem_type type, void *a, void *b, void *c, size_t length,
+                        int generate, cl_ulong seed)
+{
+    int *x = (int*) malloc(3 * sizeof(int) * NARROW_FILL_CHUNK);
+    if (x == NULL)
+    {
+        fprintf(stderr, "Error: Failed to allocate the narrow fill buffer!\n");
+        exit(EXIT_FAILURE);
+    }
+    int *y = x + NARROW_FILL_CHUNK;
+    int *z = y + NARROW_FILL_CHUNK;
+
+    for (size_t first = 0; first < length; first += NARROW_FILL_CHUNK)
+    {
+        size_t count = length - first < NARROW_FILL_CHUNK ? length - first : NARROW_FILL_CHUNK;
+        make_inputs(x, y, z, count, first, generate, seed);
+
+        for (size_t k = 0; k < count; k++)
+        {
+            size_t i = first + k;
+            if (type == ELEM_UCHAR)
+            {
+                ((cl_uchar*) a)[i] = (cl_uchar) x[k];
+                ((cl_uchar*) b)[i] = (cl_uchar) y[k];
+                ((cl_uchar*) c)[i] = (cl_uchar) z[k];
+            }
+            else
+            {
+                ((cl_ushort*) a)[i] = (cl_ushort) x[k];
+                ((cl_ushort*) b)[i] = (cl_ushort) y[k];
+                ((cl_ushort*) c)[i] = (cl_ushort) z[k];
+            }
+        }
+    }
+
+    free(x);
+}
+
+// The sequential reference for the narrow kernels, one loop per type so the
+// loads are not behind a per-element branch
+static void sequential_narrow(enum elem_type type, const void *a, const void *b, const void *c,
+                              cl_ulong *result, size_t length)
+{
+    if (type == ELEM_UCHAR)
+    {
+        const cl_uchar *x = a, *y = b, *z = c;
+        for (size_t i = 0; i < length; i++) {
+            cl_ulong p = x[i], q = y[i], r = z[i];
+            result[i] = 2 * ((p * q) + (q * r) + (p * r));
+        }
+    }
+    else
+    {
+        const cl_ushort *x = a, *y = b, *z = c;
+        for (size_t i = 0; i < length; i++) {
+            cl_ulong p = x[i], q = y[i], r = z[i];
+            result[i] = 2 * ((p * q) + (q * r) + (p * r));
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+size_t run_narrow(cl_context context, cl_command_queue commands, cl_program program,
+                  enum elem_type type, size_t length, int generate, cl_ulong seed)
+{
+    int err;
+
+    size_t global = length;
+    size_t in_bytes  = elem_size(type) * length;
+    size_t out_bytes = sizeof(cl_ulong) * length;
+
+    char kernel_name[32];
+    snprintf(kernel_name, sizeof(kernel_name), "cuboid_area_%s", elem_name(type));
+
+    cl_kernel kernel = clCreateKernel(program, kernel_name, &err);
+    checkError(err, "Creating narrow kernel");
+
+    void     *a = calloc(length, elem_size(type));
+    void     *b = calloc(length, elem_size(type));
+    void     *c = calloc(length, elem_size(type));
+    cl_ulong *result_opencl     = (cl_ulong*) calloc(length, sizeof(cl_ulong));
+    cl_ulong *result_sequential = (cl_ulong*) calloc(length, sizeof(cl_ulong));
+
+    fill_narrow(type, a, b, c, length, generate, seed);
+
+    cl_mem d_a = clCreateBuffer(context, CL_MEM_READ_ONLY, in_bytes, NULL, &err);
+    checkError(err, "Creating buffer d_a");
+    cl_mem d_b = clCreateBuffer(context, CL_MEM_READ_ONLY, in_bytes, NULL, &err);
+    checkError(err, "Creating buffer d_b");
+    cl_mem d_c = clCreateBuffer(context, CL_MEM_READ_ONLY, in_bytes, NULL, &err);
+    checkError(err, "Creating buffer d_c");
+    cl_mem d_result = clCreateBuffer(context, CL_MEM_WRITE_ONLY, out_bytes, NULL, &err);
+    checkError(err, "Creating buffer d_result");
+
+    double total_time = wtime();
+
+    err = clEnqueueWriteBuffer(commands, d_a, CL_TRUE, 0, in_bytes, a, 0, NULL, NULL);
+    checkError(err, "Copying a to device at d_a");
+    err = clEnqueueWriteBuffer(commands, d_b, CL_TRUE, 0, in_bytes, b, 0, NULL, NULL);
+    checkError(err, "Copying b to device at d_b");
+    err = clEnqueueWriteBuffer(commands, d_c, CL_TRUE, 0, in_bytes, c, 0, NULL, NULL);
+    checkError(err, "Copying c to device at d_c");
+
+    err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_a);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_b);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_c);
+    err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_result);
+    checkError(err, "Setting narrow kernel arguments");
+
+    double cl_time = wtime();
+
+    err = clEnqueueNDRangeKernel(commands, kernel, 1, NULL, &global, NULL, 0, NULL, NULL);
+    checkError(err, "Enqueueing narrow kernel");
+
+    err = clFinish(commands);
+    checkError(err, "Waiting for narrow kernel to finish");
+
+    cl_time = wtime() - cl_time;
+
+    err = clEnqueueReadBuffer(commands, d_result, CL_TRUE, 0, out_bytes, result_opencl, 0, NULL, NULL);
+    checkError(err, "Reading back d_result");
+
+    total_time = wtime() - total_time;
+
+    printf("\nThe OpenCL kernel ran in %lf seconds (%s inputs, ulong results)\n", cl_time, elem_name(type));
+    printf("Write + kernel + read took %lf seconds, %zu input bytes per cuboid instead of %zu\n",
+           total_time, 3 * elem_size(type), 3 * sizeof(cl_int));
+
+    double seq_time = wtime();
+    sequential_narrow(type, a, b, c, result_sequential, length);
+    seq_time = wtime() - seq_time;
+    printf("The sequential code ran in %lf seconds\n\n", seq_time);
+
+    printf("The sequential time is %lfX of the OpenCL time\n\n", seq_time / cl_time);
+
+    size_t mismatches = 0;
+    size_t first_mismatch = length;
+    for (size_t i = 0; i < length; i++) {
+        if (result_opencl[i] != result_sequential[i])
+        {
+            if (mismatches == 0)
+                first_mismatch = i;
+            mismatches++;
+        }
+    }
+    if (mismatches == 0)
+        printf("All %zu %s results match the sequential code\n", length, elem_name(type));
+    else
+        printf("%zu of %zu %s results differ from the sequential code, first at index %zu\n",
+               mismatches, length, elem_name(type), first_mismatch);
+
+    clReleaseMemObject(d_a);
+    clReleaseMemObject(d_b);
+    clReleaseMemObject(d_c);
+    clReleaseMemObject(d_result);
+    clReleaseKernel(kernel);
+
+    free(a);
+    free(b);
+    free(c);
+    free(result_opencl);
+    free(result_sequential);
+
+    return mismatches;
+}
@@ -0,0 +1,316 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Device capability probing and the engine planner
+//
+//             probe_devices() collects what the planner needs from every
+//             device of every platform: memory and allocation limits,
+//             whether memory is shared with the host, the preferred int
+//             vector width, the OpenCL version and sub-group support, and a
+//             measured host-to-device bandwidth and round-trip latency.
+//
+//             plan_engine() then estimates each way of computing `length`
+//             cuboids and keeps the cheapest. A device costs its round trip
+//             plus 16 bytes per cuboid over the measured bandwidth; the host
+//             costs its measured CPU engine rate. Within a device the
+//             engine follows from the limits: zero-copy on unified memory,
+//             the copy path when everything fits, streaming in chunks when
+//             it does not.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+// Largest transfer timed for the bandwidth, and repetitions of each timing
+#define PROBE_BYTES   (64 * 1024 * 1024)
+#define PROBE_REPEATS 3
+
+// Elements timed on the CPU engine for the host rate
+#define PLAN_HOST_SAMPLE (1024 * 1024)
+
+// Bytes moved per cuboid: three inputs and one result
+#define PLAN_BYTES_PER_ELEMENT (4 * sizeof(cl_int))
+
+// A chunk should take this many round trips to transfer, so the latency is
+// amortized
+#define PLAN_CHUNK_LATENCIES 64
+
+// Best of PROBE_REPEATS blocking writes of `bytes`, then a tiny round trip
+static void probe_measure(struct device_probe *p)
+{
+    int err;
+
+    p->bandwidth = 0.0;
+    p->latency   = 0.0;
+
+    cl_context context = clCreateContext(0, 1, &p->device_id, NULL, NULL, &err);
+    if (err != CL_SUCCESS)
+        return;
+    cl_command_queue commands = clCreateCommandQueue(context, p->device_id, 0, &err);
+    if (err != CL_SUCCESS)
+    {
+        clReleaseContext(context);
+        return;
+    }
+
+    size_t bytes = PROBE_BYTES;
+    if (bytes > p->max_alloc / 4)
+        bytes = (size_t) (p->max_alloc / 4);
+
+    char  *host = (char*) calloc(bytes, 1);
+    cl_mem d    = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &err);
+    if (host != NULL && err == CL_SUCCESS)
+    {
+        // The first write also pays for the allocation on the device
+        clEnqueueWriteBuffer(commands, d, CL_TRUE, 0, bytes, host, 0, NULL, NULL);
+
+        double best = 0.0;
+        for (int r = 0; r < PROBE_REPEATS; r++)
+        {
+            double t = wtime();
+            err = clEnqueueWriteBuffer(commands, d, CL_TRUE, 0, bytes, host, 0, NULL, NULL);
+            t = wtime() - t;
+            if (err == CL_SUCCESS && (best == 0.0 || t < best))
+                best = t;
+        }
+        if (best > 0.0)
+            p->bandwidth = bytes / best * 1.0e-9;
+
+        best = 0.0;
+        for (int r = 0; r < PROBE_REPEATS; r++)
+        {
+            double t = wtime();
+            err  = clEnqueueWriteBuffer(commands, d, CL_TRUE, 0, sizeof(cl_int), host, 0, NULL, NULL);
+            err |= clEnqueueReadBuffer(commands, d, CL_TRUE, 0, sizeof(cl_int), host, 0, NULL, NULL);
+            t = wtime() - t;
+            if (err == CL_SUCCESS && (best == 0.0 || t < best))
+                best = t;
+        }
+        p->latency = best;
+    }
+
+    free(host);
+    if (d != NULL)
+        clReleaseMemObject(d);
+    clReleaseCommandQueue(commands);
+    clReleaseContext(context);
+}
+
+static void probe_device(cl_platform_id platform, cl_device_id device_id, struct device_probe *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->platform  = platform;
+    p->device_id = device_id;
+
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(p->name), p->name, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_TYPE, sizeof(cl_device_type), &p->type, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &p->compute_units, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &p->global_mem, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &p->max_alloc, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &p->unified_memory, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, sizeof(cl_uint), &p->vector_int, NULL);
+
+    // "OpenCL <major>.<minor> <vendor-specific>"
+    char version[128] = "";
+    clGetDeviceInfo(device_id, CL_DEVICE_VERSION, sizeof(version), version, NULL);
+    if (sscanf(version, "OpenCL %d.%d", &p->version_major, &p->version_minor) != 2)
+        p->version_major = p->version_minor = 0;
+
+    // Core from 2.1, an extension before
+    size_t size = 0;
+    clGetDeviceInfo(device_id, CL_DEVICE_EXTENSIONS, 0, NULL, &size);
+    char *extensions = (char*) calloc(size + 1, 1);
+    if (extensions != NULL)
+    {
+        clGetDeviceInfo(device_id, CL_DEVICE_EXTENSIONS, size, extensions, NULL);
+        p->subgroups = strstr(extensions, "cl_khr_subgroups") != NULL;
+        free(extensions);
+    }
+    if (p->version_major > 2 || (p->version_major == 2 && p->version_minor >= 1))
+        p->subgroups = 1;
+
+    probe_measure(p);
+}
+
+int probe_devices(struct device_probe *probes, int max)
+{
+    int err;
+
+    cl_uint numPlatforms;
+    err = clGetPlatformIDs(0, NULL, &numPlatforms);
+    if (err != CL_SUCCESS || numPlatforms == 0)
+        return 0;
+
+    cl_platform_id Platform[numPlatforms];
+    err = clGetPlatformIDs(numPlatforms, Platform, NULL);
+    checkError(err, "Getting platforms");
+
+    int count = 0;
+    for (cl_uint p = 0; p < numPlatforms && count < max; p++)
+    {
+        cl_uint numDevices;
+        err = clGetDeviceIDs(Platform[p], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices);
+        if (err != CL_SUCCESS || numDevices == 0)
+            continue;
+
+        cl_device_id ids[numDevices];
+        err = clGetDeviceIDs(Platform[p], CL_DEVICE_TYPE_ALL, numDevices, ids, NULL);
+        checkError(err, "Getting devices");
+
+        for (cl_uint d = 0; d < numDevices && count < max; d++)
+            probe_device(Platform[p], ids[d], &probes[count++]);
+    }
+
+    return count;
+}
+
+static const char *type_name(cl_device_type type)
+{
+    if (type & CL_DEVICE_TYPE_GPU)
+        return "GPU";
+    if (type & CL_DEVICE_TYPE_CPU)
+        return "CPU";
+    if (type & CL_DEVICE_TYPE_ACCELERATOR)
+        return "ACCEL";
+
+    return "other";
+}
+
+void probe_report(const struct device_probe *probes, int count)
+{
+    printf("\n%-3s %-28s %-5s %4s %9s %9s %7s %4s %6s %4s %9s %10s\n", "#", "device", "type", "CUs",
+           "mem (MB)", "alloc", "unified", "vec", "OpenCL", "sub", "GB/s", "latency us");
+    for (int i = 0; i < count; i++)
+    {
+        const struct device_probe *p = &probes[i];
+        printf("%-3d %-28.28s %-5s %4u %9llu %9llu %7s %4u %4d.%-1d %4s %9.2lf %10.1lf\n", i, p->name,
+               type_name(p->type), (unsigned) p->compute_units,
+               (unsigned long long) (p->global_mem >> 20), (unsigned long long) (p->max_alloc >> 20),
+               p->unified_memory ? "yes" : "no", (unsigned) p->vector_int,
+               p->version_major, p->version_minor, p->subgroups ? "yes" : "no",
+               p->bandwidth, p->latency * 1.0e6);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+const char *plan_name(enum plan_engine engine)
+{
+    switch (engine)
+    {
+        case PLAN_HOST:      return "host CPU engine";
+        case PLAN_COPY:      return "copy path";
+        case PLAN_ZERO_COPY: return "zero-copy path";
+        case PLAN_STREAM:    return "streaming pipeline";
+    }
+
+    return "unknown";
+}
+
+// Elements per second of the CPU engine on this host
+static double host_rate(size_t length)
+{
+    size_t n = length < PLAN_HOST_SAMPLE ? length : PLAN_HOST_SAMPLE;
+
+    int *a = (int*) cpu_alloc(n, sizeof(int));
+    int *b = (int*) cpu_alloc(n, sizeof(int));
+    int *c = (int*) cpu_alloc(n, sizeof(int));
+    int *r = (int*) cpu_alloc(n, sizeof(int));
+
+    // The first pass pays for the page faults, time the second
+    cpu_cuboid_area(a, b, c, r, n);
+    double t = wtime();
+    cpu_cuboid_area(a, b, c, r, n);
+    t = wtime() - t;
+
+    free(a);
+    free(b);
+    free(c);
+    free(r);
+
+    return t > 0.0 ? n / t : 0.0;
+}
+
+// The engine, chunk and vector width for `length` cuboids on one device,
+// and its estimated seconds
+static double plan_device(const struct device_probe *p, size_t length, struct engine_plan *plan)
+{
+    cl_ulong bytes = (cl_ulong) length * PLAN_BYTES_PER_ELEMENT;
+
+    // Each buffer must fit one allocation, all of them device memory, with
+    // room to spare for the runtime
+    int fits = length <= UINT_MAX && length * sizeof(cl_int) <= p->max_alloc && bytes <= p->global_mem / 2;
+
+    plan->chunk = 0;
+
+    if (!fits)
+    {
+        plan->engine = PLAN_STREAM;
+
+        // Large enough to amortize the round trip, small enough that
+        // STREAM_DEPTH buffer sets fit the same limits
+        size_t chunk = 1024 * 1024;
+        double amortized = p->latency * PLAN_CHUNK_LATENCIES * p->bandwidth * 1.0e9 / PLAN_BYTES_PER_ELEMENT;
+        while (chunk < amortized && chunk < UINT_MAX / 2)
+            chunk *= 2;
+        while (chunk > 1024 && (chunk * sizeof(cl_int) > p->max_alloc ||
+                                (cl_ulong) STREAM_DEPTH * chunk * PLAN_BYTES_PER_ELEMENT > p->global_mem / 2))
+            chunk /= 2;
+        plan->chunk = chunk;
+    }
+    else if (p->unified_memory)
+        plan->engine = PLAN_ZERO_COPY;
+    else
+        plan->engine = PLAN_COPY;
+
+    // Only the copy path has the vector kernels
+    plan->vector = 1;
+    if (plan->engine == PLAN_COPY)
+    {
+        if (p->vector_int >= 16)
+            plan->vector = 16;
+        else if (p->vector_int >= 8)
+            plan->vector = 8;
+        else if (p->vector_int >= 4)
+            plan->vector = 4;
+    }
+
+    if (p->bandwidth <= 0.0)
+        return -1.0;
+
+    // Zero-copy moves nothing, the kernel still streams every byte once
+    return p->latency + bytes / (p->bandwidth * 1.0e9);
+}
+
+void plan_engine(const struct device_probe *probes, int count, size_t length, struct engine_plan *plan)
+{
+    double rate = host_rate(length);
+    double host = rate > 0.0 ? length / rate : 0.0;
+
+    plan->engine        = PLAN_HOST;
+    plan->device        = -1;
+    plan->chunk         = 0;
+    plan->vector        = 1;
+    plan->host_estimate = host;
+    plan->estimate      = host;
+
+    for (int i = 0; i < count; i++)
+    {
+        struct engine_plan candidate;
+        double estimate = plan_device(&probes[i], length, &candidate);
+        if (estimate < 0.0 || estimate >= plan->estimate)
+            continue;
+
+        *plan = candidate;
+        plan->device        = i;
+        plan->estimate      = estimate;
+        plan->host_estimate = host;
+    }
+}
@@ -0,0 +1,135 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Per-stage timing from OpenCL profiling events
+//
+//             The command queue is created with CL_QUEUE_PROFILING_ENABLE
+//             and every write, kernel and read carries an event. The
+//             QUEUED/SUBMIT/START/END timestamps of each event are collected
+//             into a profile and reported relative to the first command,
+//             together with the effective bandwidth of every stage.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+// Every profiled command also feeds the process-wide telemetry
+static void telemetry_stage(const struct profile_stage *stage)
+{
+    cl_ulong ns = stage->end - stage->start;
+
+    if (strcmp(stage->name, PROFILE_WRITE) == 0)
+    {
+        telemetry_add(TELEMETRY_BYTES_TO_DEVICE, stage->bytes);
+        telemetry_observe_ns(TELEMETRY_WRITE, ns);
+    }
+    else if (strcmp(stage->name, PROFILE_READ) == 0)
+    {
+        telemetry_add(TELEMETRY_BYTES_FROM_DEVICE, stage->bytes);
+        telemetry_observe_ns(TELEMETRY_READ, ns);
+    }
+    else if (strcmp(stage->name, PROFILE_KERNEL) == 0)
+    {
+        telemetry_add(TELEMETRY_KERNELS, 1);
+        telemetry_observe_ns(TELEMETRY_KERNEL, ns);
+    }
+    else if (strcmp(stage->name, PROFILE_GENERATE) == 0)
+        telemetry_observe_ns(TELEMETRY_GENERATE, ns);
+}
+
+void profile_init(struct profile *prof)
+{
+    prof->count = 0;
+}
+
+void profile_add(struct profile *prof, cl_event event, const char *name, size_t bytes)
+{
+    int err;
+
+    if (prof->count >= PROFILE_MAX_STAGES)
+    {
+        clReleaseEvent(event);
+        return;
+    }
+
+    struct profile_stage *stage = &prof->stage[prof->count++];
+    stage->name  = name;
+    stage->bytes = bytes;
+
+    err = clWaitForEvents(1, &event);
+    checkError(err, "Waiting for profiled event");
+
+    err  = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &stage->queued, NULL);
+    err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &stage->submit, NULL);
+    err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &stage->start, NULL);
+    err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &stage->end, NULL);
+    checkError(err, "Reading event profiling info");
+
+    clReleaseEvent(event);
+
+    telemetry_stage(stage);
+}
+
+double profile_seconds(const struct profile *prof, const char *name)
+{
+    double seconds = 0.0;
+    for (int i = 0; i < prof->count; i++) {
+        if (strcmp(prof->stage[i].name, name) == 0)
+            seconds += (prof->stage[i].end - prof->stage[i].start) * 1.0e-9;
+    }
+    return seconds;
+}
+
+void profile_report(const struct profile *prof, double wall_time, double peak_gbps)
+{
+    if (prof->count == 0)
+        return;
+
+    // All timestamps relative to the first command queued
+    cl_ulong origin = prof->stage[0].queued;
+    for (int i = 1; i < prof->count; i++) {
+        if (prof->stage[i].queued < origin)
+            origin = prof->stage[i].queued;
+    }
+
+    double device_busy = 0.0;
+
+    printf("\n%-10s %11s %11s %11s %11s %11s %12s %9s\n",
+           "stage", "queued(ms)", "submit(ms)", "start(ms)", "end(ms)", "run(ms)", "bytes", "GB/s");
+    for (int i = 0; i < prof->count; i++)
+    {
+        const struct profile_stage *s = &prof->stage[i];
+        double run = (s->end - s->start) * 1.0e-9;
+
+        printf("%-10s %11.3lf %11.3lf %11.3lf %11.3lf %11.3lf %12zu %9.2lf\n", s->name,
+               (s->queued - origin) * 1.0e-6, (s->submit - origin) * 1.0e-6,
+               (s->start - origin) * 1.0e-6, (s->end - origin) * 1.0e-6,
+               run * 1.0e3, s->bytes, run > 0.0 ? s->bytes / run * 1.0e-9 : 0.0);
+
+        device_busy += run;
+    }
+
+    double kernel_time  = profile_seconds(prof, PROFILE_KERNEL);
+    size_t kernel_bytes = 0;
+    for (int i = 0; i < prof->count; i++) {
+        if (strcmp(prof->stage[i].name, PROFILE_KERNEL) == 0)
+            kernel_bytes += prof->stage[i].bytes;
+    }
+
+    if (kernel_time > 0.0)
+    {
+        double achieved = kernel_bytes / kernel_time * 1.0e-9;
+        if (peak_gbps > 0.0)
+            printf("Kernel achieved %.2lf GB/s, %.1lf%% of the %.2lf GB/s device peak\n",
+                   achieved, 100.0 * achieved / peak_gbps, peak_gbps);
+        else
+            printf("Kernel achieved %.2lf GB/s (pass --peak-bw to compare with the device peak)\n", achieved);
+    }
+    printf("Device busy %.3lf ms, end-to-end wall time %.3lf ms\n", device_busy * 1.0e3, wall_time * 1.0e3);
+}
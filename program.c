@@ -0,0 +1,310 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Build the cuboid program for a device, through an on-disk
+//             cache of compiled program binaries
+//
+//             Building OpenCL_code from source can take hundreds of
+//             milliseconds on some drivers. After a source build the binary
+//             is fetched with CL_PROGRAM_BINARIES and stored under a key
+//             made of the device name, the driver version, the build
+//             options and a hash of the kernel source; later runs load it with
+//             clCreateProgramWithBinary and fall back to a source build if
+//             the driver rejects it.
+//
+//             The cache lives in $CUBOID_CACHE_DIR, or else
+//             $XDG_CACHE_HOME/cuboid-opencl or $HOME/.cache/cuboid-opencl.
+//             Setting CUBOID_CACHE_DIR to an empty string disables it.
+//             Other per-device state, such as the tuned launch configuration
+//             (tune.c), is kept in the same directory.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+#define CACHE_MAGIC "CUBOIDBIN1"
+
+// FNV-1a, good enough to tell kernel sources and devices apart
+static cl_ulong hash_string(cl_ulong hash, const char *s)
+{
+    while (*s)
+    {
+        hash ^= (unsigned char) *s++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Returns 0 and the cache directory in dir, or -1 when caching is disabled
+static int cache_dir(char *dir, size_t size)
+{
+    const char *env = getenv("CUBOID_CACHE_DIR");
+    if (env != NULL)
+    {
+        if (env[0] == '\0')
+            return -1;
+        snprintf(dir, size, "%s", env);
+    }
+    else if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != '\0')
+    {
+        snprintf(dir, size, "%s/cuboid-opencl", env);
+    }
+    else if ((env = getenv("HOME")) != NULL && env[0] != '\0')
+    {
+        char parent[1000];
+        snprintf(parent, sizeof(parent), "%s/.cache", env);
+        mkdir(parent, 0755);
+        snprintf(dir, size, "%s/cuboid-opencl", parent);
+    }
+    else
+    {
+        return -1;
+    }
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return -1;
+
+    return 0;
+}
+
+// Hash of the device name and driver version, the part of every cache key
+// that ties an entry to one device
+static cl_ulong device_hash(cl_device_id device_id)
+{
+    char name[256] = "";
+    char driver[256] = "";
+
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(name), name, NULL);
+    clGetDeviceInfo(device_id, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+
+    cl_ulong hash = 14695981039346656037ULL;
+    hash = hash_string(hash, name);
+    hash = hash_string(hash, "\n");
+    hash = hash_string(hash, driver);
+
+    return hash;
+}
+
+// Cache file for this device, driver, build options and kernel source
+static int cache_path(cl_device_id device_id, const char *options, char *path, size_t size, cl_ulong *key)
+{
+    char dir[1024];
+
+    if (cache_dir(dir, sizeof(dir)) != 0)
+        return -1;
+
+    cl_ulong hash = device_hash(device_id);
+    hash = hash_string(hash, "\n");
+    hash = hash_string(hash, options);
+    hash = hash_string(hash, "\n");
+    hash = hash_string(hash, OpenCL_code);
+
+    *key = hash;
+    snprintf(path, size, "%s/%016llx.bin", dir, (unsigned long long) hash);
+
+    return 0;
+}
+
+int cache_device_path(cl_device_id device_id, const char *suffix, char *path, size_t size)
+{
+    char dir[1024];
+
+    if (cache_dir(dir, sizeof(dir)) != 0)
+        return -1;
+
+    snprintf(path, size, "%s/%016llx.%s", dir, (unsigned long long) device_hash(device_id), suffix);
+
+    return 0;
+}
+
+static unsigned char *cache_load(const char *path, cl_ulong key, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    char          magic[sizeof(CACHE_MAGIC)];
+    cl_ulong      stored_key;
+    cl_ulong      stored_size;
+    unsigned char *binary = NULL;
+
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+        memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0 &&
+        fread(&stored_key, sizeof(stored_key), 1, file) == 1 && stored_key == key &&
+        fread(&stored_size, sizeof(stored_size), 1, file) == 1 && stored_size > 0)
+    {
+        binary = (unsigned char*) malloc(stored_size);
+        if (binary != NULL && fread(binary, 1, stored_size, file) == stored_size)
+        {
+            *size = (size_t) stored_size;
+        }
+        else
+        {
+            free(binary);
+            binary = NULL;
+        }
+    }
+
+    fclose(file);
+    return binary;
+}
+
+static void cache_store(const char *path, cl_ulong key, cl_program program)
+{
+    size_t size = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || size == 0)
+        return;
+
+    unsigned char *binary = (unsigned char*) malloc(size);
+    if (binary == NULL)
+        return;
+
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) == CL_SUCCESS)
+    {
+        // Write to a temporary file and rename it, so concurrent runs never
+        // see a partial binary
+        char tmp[1200];
+        snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long) getpid());
+
+        FILE *file = fopen(tmp, "wb");
+        if (file != NULL)
+        {
+            cl_ulong stored_size = size;
+            int ok = fwrite(CACHE_MAGIC, 1, sizeof(CACHE_MAGIC), file) == sizeof(CACHE_MAGIC) &&
+                     fwrite(&key, sizeof(key), 1, file) == 1 &&
+                     fwrite(&stored_size, sizeof(stored_size), 1, file) == 1 &&
+                     fwrite(binary, 1, size, file) == size;
+            ok = (fclose(file) == 0) && ok;
+
+            if (!ok || rename(tmp, path) != 0)
+                remove(tmp);
+        }
+    }
+
+    free(binary);
+}
+
+//------------------------------------------------------------------------------
+
+// Prints the build log to stderr and returns NULL on failure
+static cl_program build_from_source(cl_context context, cl_device_id device_id, const char *options,
+                                    cl_int *err)
+{
+    // Create the compute program from the source buffer
+    cl_program program = clCreateProgramWithSource(context, 1, (const char **) & OpenCL_code, NULL, err);
+    if (*err != CL_SUCCESS)
+    {
+        fprintf(stderr, "Error: Failed to create program!\n%s\n", err_code(*err));
+        return NULL;
+    }
+
+    // Build the program
+    *err = clBuildProgram(program, 1, &device_id, options, NULL, NULL);
+    if (*err != CL_SUCCESS)
+    {
+        char buffer[2048] = "";
+
+        fprintf(stderr, "Error: Failed to build program executable!\n%s\n", err_code(*err));
+        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer) - 1, buffer, NULL);
+        fprintf(stderr, "%s\n", buffer);
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    return program;
+}
+
+static cl_program build_from_binary(cl_context context, cl_device_id device_id, const char *options,
+                                    const unsigned char *binary, size_t size)
+{
+    int err;
+    cl_int status;
+
+    cl_program program = clCreateProgramWithBinary(context, 1, &device_id, &size, &binary, &status, &err);
+    if (err != CL_SUCCESS || status != CL_SUCCESS)
+    {
+        if (program != NULL)
+            clReleaseProgram(program);
+        return NULL;
+    }
+
+    if (clBuildProgram(program, 1, &device_id, options, NULL, NULL) != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    return program;
+}
+
+cl_program build_program(cl_context context, cl_device_id device_id, struct build_info *info)
+{
+    return build_program_options(context, device_id, "", info);
+}
+
+cl_program build_program_options(cl_context context, cl_device_id device_id, const char *options,
+                                 struct build_info *info)
+{
+    cl_int err;
+
+    // The command line paths cannot go on without their program
+    cl_program program = build_program_err(context, device_id, options, info, &err);
+    checkError(err, "Building program");
+
+    return program;
+}
+
+cl_program build_program_err(cl_context context, cl_device_id device_id, const char *options,
+                             struct build_info *info, cl_int *err)
+{
+    char     path[1100];
+    cl_ulong key;
+
+    double build_time = wtime();
+
+    int cached = cache_path(device_id, options, path, sizeof(path), &key) == 0;
+    cl_program program = NULL;
+
+    if (cached)
+    {
+        size_t size;
+        unsigned char *binary = cache_load(path, key, &size);
+        if (binary != NULL)
+        {
+            // A driver update can make an old binary unusable, rebuild then
+            program = build_from_binary(context, device_id, options, binary, size);
+            free(binary);
+        }
+    }
+
+    int hit = program != NULL;
+    *err = CL_SUCCESS;
+    if (!hit)
+    {
+        program = build_from_source(context, device_id, options, err);
+        if (program == NULL)
+            return NULL;
+        if (cached)
+            cache_store(path, key, program);
+    }
+
+    telemetry_add(hit ? TELEMETRY_CACHE_HITS : TELEMETRY_CACHE_MISSES, 1);
+
+    if (info != NULL)
+    {
+        info->cache_hit  = hit;
+        info->build_time = wtime() - build_time;
+    }
+
+    return program;
+}
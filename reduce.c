@@ -0,0 +1,302 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    On-device aggregation of the cuboid results
+//
+//             Instead of reading every area back, the sum, minimum and
+//             maximum of the areas are reduced on the device to one partial
+//             per work-group, and the volumes are counted into a histogram
+//             in local memory. Only the partials and the histogram cross the
+//             bus. The fused mode computes the areas inside the reduction so
+//             they are never stored; the unfused mode runs cuboid_area into
+//             a device buffer first and reduces that, which is what an
+//             existing result costs to aggregate.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+// Upper bound of the reduction work-group size, which sizes the local arrays
+#define REDUCE_LOCAL_MAX 256
+
+// Work-groups per compute unit, enough to hide memory latency while keeping
+// the partials tiny
+#define REDUCE_GROUPS_PER_CU 8
+
+static double event_seconds(cl_event event)
+{
+    cl_ulong start, end;
+
+    clWaitForEvents(1, &event);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+    clReleaseEvent(event);
+
+    return (end - start) * 1.0e-9;
+}
+
+// Work-group size for a reduction kernel: what the device allows, capped
+// at REDUCE_LOCAL_MAX and rounded down to a power of two
+static size_t reduce_local(cl_kernel kernel, cl_device_id device_id)
+{
+    size_t max_local;
+    int err = clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE,
+                                       sizeof(size_t), &max_local, NULL);
+    checkError(err, "Querying reduction work-group size");
+
+    size_t local = 1;
+    while (local * 2 <= max_local && local * 2 <= REDUCE_LOCAL_MAX)
+        local *= 2;
+
+    return local;
+}
+
+//------------------------------------------------------------------------------
+
+size_t run_aggregate(cl_context context, cl_device_id device_id, cl_command_queue commands,
+                     cl_program program, size_t length, int fused, cl_uint bins, cl_uint bin_width,
+                     int generate, cl_ulong seed)
+{
+    int err;
+
+    size_t bytes = sizeof(cl_int) * length;
+
+    cl_uint comp_units;
+    err = clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &comp_units, NULL);
+    checkError(err, "Querying compute units");
+
+    cl_kernel k_reduce = clCreateKernel(program, fused ? "cuboid_area_reduce" : "int_reduce", &err);
+    checkError(err, "Creating reduction kernel");
+    cl_kernel k_hist = clCreateKernel(program, "cuboid_volume_histogram", &err);
+    checkError(err, "Creating histogram kernel");
+    cl_kernel k_area = NULL;
+    if (!fused)
+    {
+        k_area = clCreateKernel(program, "cuboid_area", &err);
+        checkError(err, "Creating kernel");
+    }
+
+    size_t local  = reduce_local(k_reduce, device_id);
+    size_t groups = (size_t) comp_units * REDUCE_GROUPS_PER_CU;
+    if (groups > (length + local - 1) / local)
+        groups = (length + local - 1) / local;
+    size_t global = groups * local;
+
+    size_t hist_local = reduce_local(k_hist, device_id);
+
+    int      *a = (int*) cpu_alloc(length, sizeof(int));
+    int      *b = (int*) cpu_alloc(length, sizeof(int));
+    int      *c = (int*) cpu_alloc(length, sizeof(int));
+    cl_long  *part_sum = (cl_long*) malloc(sizeof(cl_long) * groups);
+    cl_int   *part_min = (cl_int*) malloc(sizeof(cl_int) * groups);
+    cl_int   *part_max = (cl_int*) malloc(sizeof(cl_int) * groups);
+    cl_uint  *hist     = (cl_uint*) malloc(sizeof(cl_uint) * bins);
+    size_t   *hist_seq = (size_t*) calloc(bins, sizeof(size_t));
+
+    if (a == NULL || b == NULL || c == NULL || part_sum == NULL || part_min == NULL ||
+        part_max == NULL || hist == NULL || hist_seq == NULL)
+    {
+        fprintf(stderr, "Error: Failed to allocate host memory for %zu elements!\n", length);
+        exit(EXIT_FAILURE);
+    }
+
+    make_inputs(a, b, c, length, 0, generate, seed);
+
+    cl_mem d_a = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_a");
+    cl_mem d_b = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_b");
+    cl_mem d_c = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_c");
+    cl_mem d_sum = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_long) * groups, NULL, &err);
+    checkError(err, "Creating buffer d_sum");
+    cl_mem d_min = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_int) * groups, NULL, &err);
+    checkError(err, "Creating buffer d_min");
+    cl_mem d_max = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_int) * groups, NULL, &err);
+    checkError(err, "Creating buffer d_max");
+    cl_mem d_hist = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * bins, NULL, &err);
+    checkError(err, "Creating buffer d_hist");
+    cl_mem d_result = NULL;
+    if (!fused)
+    {
+        d_result = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &err);
+        checkError(err, "Creating buffer d_result");
+    }
+
+    cl_uint n = (cl_uint) length;
+
+    // Reduction arguments: the inputs (fused) or the area buffer, then the
+    // partials and their local scratch
+    int arg = 0;
+    if (fused)
+    {
+        err  = clSetKernelArg(k_reduce, arg++, sizeof(cl_mem), &d_a);
+        err |= clSetKernelArg(k_reduce, arg++, sizeof(cl_mem), &d_b);
+        err |= clSetKernelArg(k_reduce, arg++, sizeof(cl_mem), &d_c);
+    }
+    else
+    {
+        err  = clSetKernelArg(k_reduce, arg++, sizeof(cl_mem), &d_result);
+
+        err |= clSetKernelArg(k_area, 0, sizeof(cl_mem), &d_a);
+        err |= clSetKernelArg(k_area, 1, sizeof(cl_mem), &d_b);
+        err |= clSetKernelArg(k_area, 2, sizeof(cl_mem), &d_c);
+        err |= clSetKernelArg(k_area, 3, sizeof(cl_mem), &d_result);
+        err |= clSetKernelArg(k_area, 4, sizeof(cl_uint), &n);
+    }
+    err |= clSetKernelArg(k_reduce, arg++, sizeof(cl_uint), &n);
+    err |= clSetKernelArg(k_reduce, arg++, sizeof(cl_mem), &d_sum);
+    err |= clSetKernelArg(k_reduce, arg++, sizeof(cl_mem), &d_min);
+    err |= clSetKernelArg(k_reduce, arg++, sizeof(cl_mem), &d_max);
+    err |= clSetKernelArg(k_reduce, arg++, sizeof(cl_long) * local, NULL);
+    err |= clSetKernelArg(k_reduce, arg++, sizeof(cl_int) * local, NULL);
+    err |= clSetKernelArg(k_reduce, arg++, sizeof(cl_int) * local, NULL);
+    checkError(err, "Setting reduction kernel arguments");
+
+    err  = clSetKernelArg(k_hist, 0, sizeof(cl_mem), &d_a);
+    err |= clSetKernelArg(k_hist, 1, sizeof(cl_mem), &d_b);
+    err |= clSetKernelArg(k_hist, 2, sizeof(cl_mem), &d_c);
+    err |= clSetKernelArg(k_hist, 3, sizeof(cl_uint), &n);
+    err |= clSetKernelArg(k_hist, 4, sizeof(cl_uint), &bin_width);
+    err |= clSetKernelArg(k_hist, 5, sizeof(cl_uint), &bins);
+    err |= clSetKernelArg(k_hist, 6, sizeof(cl_mem), &d_hist);
+    err |= clSetKernelArg(k_hist, 7, sizeof(cl_uint) * bins, NULL);
+    checkError(err, "Setting histogram kernel arguments");
+
+    double total_time = wtime();
+
+    err  = clEnqueueWriteBuffer(commands, d_a, CL_FALSE, 0, bytes, a, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(commands, d_b, CL_FALSE, 0, bytes, b, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(commands, d_c, CL_FALSE, 0, bytes, c, 0, NULL, NULL);
+    checkError(err, "Copying inputs to the device");
+
+    cl_uint zero = 0;
+    err = clEnqueueFillBuffer(commands, d_hist, &zero, sizeof(zero), 0, sizeof(cl_uint) * bins, 0, NULL, NULL);
+    checkError(err, "Clearing the histogram");
+
+    cl_event ev_area = NULL, ev_reduce, ev_hist;
+    if (!fused)
+    {
+        size_t area_global = length;
+        err = clEnqueueNDRangeKernel(commands, k_area, 1, NULL, &area_global, NULL, 0, NULL, &ev_area);
+        checkError(err, "Enqueueing kernel");
+    }
+
+    err = clEnqueueNDRangeKernel(commands, k_reduce, 1, NULL, &global, &local, 0, NULL, &ev_reduce);
+    checkError(err, "Enqueueing reduction kernel");
+
+    size_t hist_global = groups * hist_local;
+    err = clEnqueueNDRangeKernel(commands, k_hist, 1, NULL, &hist_global, &hist_local, 0, NULL, &ev_hist);
+    checkError(err, "Enqueueing histogram kernel");
+
+    size_t read_bytes = (sizeof(cl_long) + 2 * sizeof(cl_int)) * groups + sizeof(cl_uint) * bins;
+    err  = clEnqueueReadBuffer(commands, d_sum, CL_FALSE, 0, sizeof(cl_long) * groups, part_sum, 0, NULL, NULL);
+    err |= clEnqueueReadBuffer(commands, d_min, CL_FALSE, 0, sizeof(cl_int) * groups, part_min, 0, NULL, NULL);
+    err |= clEnqueueReadBuffer(commands, d_max, CL_FALSE, 0, sizeof(cl_int) * groups, part_max, 0, NULL, NULL);
+    err |= clEnqueueReadBuffer(commands, d_hist, CL_FALSE, 0, sizeof(cl_uint) * bins, hist, 0, NULL, NULL);
+    checkError(err, "Reading back the aggregates");
+
+    err = clFinish(commands);
+    checkError(err, "Waiting for the aggregates");
+
+    // The partials are few enough to finish on the host
+    long long sum = 0;
+    int       lo = INT_MAX, hi = INT_MIN;
+    for (size_t g = 0; g < groups; g++) {
+        sum += part_sum[g];
+        lo = part_min[g] < lo ? part_min[g] : lo;
+        hi = part_max[g] > hi ? part_max[g] : hi;
+    }
+
+    total_time = wtime() - total_time;
+
+    double area_time   = ev_area != NULL ? event_seconds(ev_area) : 0.0;
+    double reduce_time = event_seconds(ev_reduce);
+    double hist_time   = event_seconds(ev_hist);
+
+    printf("\nAggregated %zu cuboids on the device (%s, %zu work-groups of %zu)\n",
+           length, fused ? "fused with the area" : "cuboid_area then int_reduce", groups, local);
+    if (!fused)
+        printf("cuboid_area         %lf seconds\n", area_time);
+    printf("sum/min/max         %lf seconds\n", reduce_time);
+    printf("volume histogram    %lf seconds\n", hist_time);
+    printf("Write + kernels + read took %lf seconds, read back %zu bytes instead of %zu\n",
+           total_time, read_bytes, bytes);
+
+    printf("\nTotal surface area  %lld\n", sum);
+    printf("Smallest area       %d\n", lo);
+    printf("Largest area        %d\n", hi);
+
+    // Sequential check
+    long long seq_sum = 0;
+    int       seq_lo = INT_MAX, seq_hi = INT_MIN;
+
+    double seq_time = wtime();
+    for (size_t i = 0; i < length; i++) {
+        int v = 2 * ((a[i] * b[i]) + (b[i] * c[i]) + (a[i] * c[i]));
+        seq_sum += v;
+        seq_lo = v < seq_lo ? v : seq_lo;
+        seq_hi = v > seq_hi ? v : seq_hi;
+
+        int vol = a[i] * b[i] * c[i];
+        cl_uint bin = vol > 0 ? (cl_uint) vol / bin_width : 0;
+        hist_seq[bin < bins ? bin : bins - 1]++;
+    }
+    seq_time = wtime() - seq_time;
+
+    size_t mismatches = (sum != seq_sum) + (lo != seq_lo) + (hi != seq_hi);
+    for (cl_uint j = 0; j < bins; j++) {
+        if (hist[j] != hist_seq[j])
+            mismatches++;
+    }
+
+    printf("\n%-14s %12s\n", "volume", "cuboids");
+    for (cl_uint j = 0; j < bins; j++) {
+        if (hist[j] == 0)
+            continue;
+        char range[32];
+        if (j == bins - 1)
+            snprintf(range, sizeof(range), ">= %u", j * bin_width);
+        else
+            snprintf(range, sizeof(range), "%u-%u", j * bin_width, (j + 1) * bin_width - 1);
+        printf("%-14s %12u\n", range, hist[j]);
+    }
+
+    printf("\nThe sequential aggregation ran in %lf seconds\n", seq_time);
+    if (mismatches == 0)
+        printf("All aggregates match the sequential code\n");
+    else
+        printf("Error: %zu aggregates differ from the sequential code!\n", mismatches);
+
+    clReleaseMemObject(d_a);
+    clReleaseMemObject(d_b);
+    clReleaseMemObject(d_c);
+    clReleaseMemObject(d_sum);
+    clReleaseMemObject(d_min);
+    clReleaseMemObject(d_max);
+    clReleaseMemObject(d_hist);
+    if (d_result != NULL)
+        clReleaseMemObject(d_result);
+    if (k_area != NULL)
+        clReleaseKernel(k_area);
+    clReleaseKernel(k_reduce);
+    clReleaseKernel(k_hist);
+
+    free(a);
+    free(b);
+    free(c);
+    free(part_sum);
+    free(part_min);
+    free(part_max);
+    free(hist);
+    free(hist_seq);
+
+    return mismatches;
+}
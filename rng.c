@@ -0,0 +1,127 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Counter-based generation of the cuboid inputs
+//
+//             Element i of a, b and c comes from Philox4x32-10 with the
+//             counter {i, 0, 0} and the 64-bit seed as key, reduced to 1..9.
+//             Nothing depends on the previous element, so the device fills
+//             its buffers with cuboid_generate and the host reproduces the
+//             same data on every thread with cpu_generate(), instead of one
+//             thread calling rand() three times per cuboid.
+//
+//             make_inputs() is where every path gets its inputs: this
+//             generator with --generate, the rand() sequence otherwise.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+// Same rounds and constants as philox4x32() in kernels.c
+static void philox4x32(cl_uint ctr[4], cl_uint k0, cl_uint k1)
+{
+    for (int r = 0; r < 10; r++)
+    {
+        if (r > 0)
+        {
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        cl_ulong p0 = (cl_ulong) 0xD2511F53u * ctr[0];
+        cl_ulong p1 = (cl_ulong) 0xCD9E8D57u * ctr[2];
+
+        cl_uint c0 = (cl_uint) (p1 >> 32) ^ ctr[1] ^ k0;
+        cl_uint c1 = (cl_uint) p1;
+        cl_uint c2 = (cl_uint) (p0 >> 32) ^ ctr[3] ^ k1;
+        cl_uint c3 = (cl_uint) p0;
+
+        ctr[0] = c0;
+        ctr[1] = c1;
+        ctr[2] = c2;
+        ctr[3] = c3;
+    }
+}
+
+void cpu_generate(int *a, int *b, int *c, size_t length, size_t first, cl_ulong seed)
+{
+    cl_uint k0 = (cl_uint) seed;
+    cl_uint k1 = (cl_uint) (seed >> 32);
+
+    // Same static schedule as cpu_alloc(), so the pages stay where they were
+    // first touched
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < (long) length; i++)
+    {
+        cl_ulong index = first + (size_t) i;
+        cl_uint  ctr[4] = { (cl_uint) index, (cl_uint) (index >> 32), 0, 0 };
+
+        philox4x32(ctr, k0, k1);
+
+        a[i] = (int) (ctr[0] % 9u) + 1;
+        b[i] = (int) (ctr[1] % 9u) + 1;
+        c[i] = (int) (ctr[2] % 9u) + 1;
+    }
+}
+
+void fill_inputs(int *a, int *b, int *c, size_t length, size_t first)
+{
+    if (first == 0)
+        srand(1);
+    for (size_t i = 0; i < length; i++) {
+        a[i] = (rand() % 9) + 1;
+        b[i] = (rand() % 9) + 1;
+        c[i] = (rand() % 9) + 1;
+    }
+}
+
+double make_inputs(int *a, int *b, int *c, size_t length, size_t first, int generate, cl_ulong seed)
+{
+    double fill_time = wtime();
+
+    if (generate)
+        cpu_generate(a, b, c, length, first, seed);
+    else
+        fill_inputs(a, b, c, length, first);
+
+    return wtime() - fill_time;
+}
+
+//------------------------------------------------------------------------------
+
+double device_generate(cl_command_queue commands, cl_kernel kernel_generate,
+                       cl_mem d_a, cl_mem d_b, cl_mem d_c, size_t length, size_t first,
+                       cl_ulong seed, cl_event *event)
+{
+    int err;
+
+    cl_uint  n = (cl_uint) length;
+    cl_ulong offset = first;
+
+    err  = clSetKernelArg(kernel_generate, 0, sizeof(cl_mem), &d_a);
+    err |= clSetKernelArg(kernel_generate, 1, sizeof(cl_mem), &d_b);
+    err |= clSetKernelArg(kernel_generate, 2, sizeof(cl_mem), &d_c);
+    err |= clSetKernelArg(kernel_generate, 3, sizeof(cl_uint), &n);
+    err |= clSetKernelArg(kernel_generate, 4, sizeof(cl_ulong), &offset);
+    err |= clSetKernelArg(kernel_generate, 5, sizeof(cl_ulong), &seed);
+    checkError(err, "Setting generator kernel arguments");
+
+    double gen_time = wtime();
+
+    size_t global = length;
+    err = clEnqueueNDRangeKernel(commands, kernel_generate, 1, NULL, &global, NULL, 0, NULL, event);
+    checkError(err, "Enqueueing generator kernel");
+
+    err = clFinish(commands);
+    checkError(err, "Waiting for generator kernel to finish");
+
+    return wtime() - gen_time;
+}
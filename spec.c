@@ -0,0 +1,82 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Specialized builds of the cuboid program
+//
+//             The same OpenCL_code is built with -D defines that turn the
+//             runtime parameters of the generic kernels into compile-time
+//             constants: CUBOID_WIDTH and CUBOID_ITEMS shape
+//             cuboid_area_spec, CUBOID_METRICS bakes the metric mask into
+//             cuboid_metrics. The width follows the device's preferred int
+//             vector width, the items per work-item come from the tuned
+//             configuration (tune.c) when there is one, or more work per
+//             work-item on CPU devices. -cl-fast-relaxed-math and
+//             -cl-mad-enable are only added on request, since they loosen
+//             the diagonal.
+//
+//             The options are part of the binary cache key (program.c), so
+//             each device keeps its own compiled variant.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cuboid.h"
+
+//------------------------------------------------------------------------------
+
+// Vectors per work-item of the CPU variant, enough to amortize the
+// per-work-item overhead of CPU runtimes
+#define SPEC_CPU_ITEMS 4
+
+void variant_select(cl_device_id device_id, unsigned metrics, int fast_math, struct kernel_variant *variant)
+{
+    cl_uint preferred = 1;
+    clGetDeviceInfo(device_id, CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, sizeof(cl_uint), &preferred, NULL);
+
+    if (preferred >= 16)
+        variant->width = 16;
+    else if (preferred >= 8)
+        variant->width = 8;
+    else if (preferred >= 4)
+        variant->width = 4;
+    else
+        variant->width = 1;
+
+    cl_device_type type = CL_DEVICE_TYPE_GPU;
+    clGetDeviceInfo(device_id, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+
+    // The tuner measured cuboids per work-item for the scalar kernel, which
+    // is the same thing as vectors per work-item at width 1
+    struct launch_config tuned;
+    if (variant->width == 1 && tune_load(device_id, &tuned) == 0)
+        variant->items = tuned.items;
+    else if (type & CL_DEVICE_TYPE_CPU)
+        variant->items = SPEC_CPU_ITEMS;
+    else
+        variant->items = 1;
+
+    variant->metrics   = metrics;
+    variant->fast_math = fast_math;
+}
+
+void variant_options(const struct kernel_variant *variant, char *options, size_t size)
+{
+    int n = snprintf(options, size, "-D CUBOID_WIDTH=%u -D CUBOID_ITEMS=%u",
+                     (unsigned) variant->width, (unsigned) variant->items);
+
+    if (variant->metrics != 0 && n > 0 && (size_t) n < size)
+        n += snprintf(options + n, size - n, " -D CUBOID_METRICS=%uu", variant->metrics);
+    if (variant->fast_math && n > 0 && (size_t) n < size)
+        snprintf(options + n, size - n, " -cl-mad-enable -cl-fast-relaxed-math");
+}
+
+cl_program build_variant(cl_context context, cl_device_id device_id, const struct kernel_variant *variant,
+                         struct build_info *info)
+{
+    char options[256];
+    variant_options(variant, options, sizeof(options));
+
+    return build_program_options(context, device_id, options, info);
+}
@@ -0,0 +1,221 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Chunked, multi-buffered streaming of the cuboid_area kernel
+//             for datasets larger than device memory
+//
+//             Three in-order command queues are used: one for uploads, one
+//             for the kernel and one for downloads. Each chunk owns one of
+//             STREAM_DEPTH device buffer sets, and the stages are chained
+//             with events, so while chunk N runs, chunk N+1 is uploaded and
+//             chunk N-1 is read back.
+//
+//             With pinned staging each slot also owns one pinned host
+//             allocation for its inputs and result. Once the slot's previous
+//             chunk is back, its result is copied out of the staging set and
+//             the next chunk's inputs are copied in, so every DMA transfer
+//             runs from page-locked memory while the other slots stay busy.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+struct stream_slot {
+    cl_mem   d_a;
+    cl_mem   d_b;
+    cl_mem   d_c;
+    cl_mem   d_result;
+
+    cl_event uploaded;   // last write of the chunk's inputs
+    cl_event computed;   // kernel on the chunk
+    cl_event downloaded; // read of the chunk's result, the slot is free after it
+
+    struct pinned_buffer staging;   // a, b, c and result of one chunk, when pinned
+    int     *h_a;
+    int     *h_b;
+    int     *h_c;
+    int     *h_result;
+    int     *target;     // where the staged result goes, NULL when nothing is staged
+    size_t   staged;     // elements of the staged result
+};
+
+static void release_event(cl_event *event)
+{
+    if (*event != NULL)
+    {
+        clReleaseEvent(*event);
+        *event = NULL;
+    }
+}
+
+// Copies a slot's result out of its staging set once it has been read back
+static void drain_slot(struct stream_slot *s)
+{
+    if (s->target == NULL)
+        return;
+
+    int err = clWaitForEvents(1, &s->downloaded);
+    checkError(err, "Waiting for a staged result");
+    memcpy(s->target, s->h_result, sizeof(int) * s->staged);
+    s->target = NULL;
+}
+
+//------------------------------------------------------------------------------
+
+double run_streaming(cl_context context, cl_device_id device_id, cl_kernel kernel_cuboid_area,
+                     const int *a, const int *b, const int *c, int *result,
+                     size_t length, size_t chunk, int pinned)
+{
+    int err;
+
+    cl_command_queue upload;
+    cl_command_queue compute;
+    cl_command_queue download;
+
+    struct stream_slot slot[STREAM_DEPTH];
+
+    if (chunk == 0 || chunk > length)
+        chunk = length;
+
+    upload = clCreateCommandQueue(context, device_id, 0, &err);
+    checkError(err, "Creating upload queue");
+    compute = clCreateCommandQueue(context, device_id, 0, &err);
+    checkError(err, "Creating compute queue");
+    download = clCreateCommandQueue(context, device_id, 0, &err);
+    checkError(err, "Creating download queue");
+
+    // Only STREAM_DEPTH chunks are ever resident on the device
+    for (int s = 0; s < STREAM_DEPTH; s++)
+    {
+        slot[s].d_a = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_int) * chunk, NULL, &err);
+        checkError(err, "Creating stream buffer d_a");
+        slot[s].d_b = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_int) * chunk, NULL, &err);
+        checkError(err, "Creating stream buffer d_b");
+        slot[s].d_c = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_int) * chunk, NULL, &err);
+        checkError(err, "Creating stream buffer d_c");
+        slot[s].d_result = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_int) * chunk, NULL, &err);
+        checkError(err, "Creating stream buffer d_result");
+
+        slot[s].uploaded = NULL;
+        slot[s].computed = NULL;
+        slot[s].downloaded = NULL;
+
+        slot[s].staging.mem = NULL;
+        slot[s].target = NULL;
+        if (pinned)
+        {
+            int *base = (int*) pinned_alloc(context, upload, 4 * sizeof(cl_int) * chunk, &slot[s].staging);
+            slot[s].h_a      = base;
+            slot[s].h_b      = base + chunk;
+            slot[s].h_c      = base + 2 * chunk;
+            slot[s].h_result = base + 3 * chunk;
+        }
+    }
+
+    double stream_time = wtime();
+
+    size_t chunks = (length + chunk - 1) / chunk;
+    for (size_t n = 0; n < chunks; n++)
+    {
+        struct stream_slot *s = &slot[n % STREAM_DEPTH];
+        size_t offset = n * chunk;
+        size_t count  = (offset + chunk > length) ? length - offset : chunk;
+        size_t bytes  = sizeof(cl_int) * count;
+
+        // The slot may only be overwritten once its previous chunk has been
+        // read back; the first write waits for that, the upload queue is
+        // in-order so the other two follow it.
+        cl_uint  num_wait = s->downloaded != NULL ? 1 : 0;
+        cl_event wait = s->downloaded;
+
+        // The staging set is reused the same way, but by the host: the
+        // previous result must be out of it before the next inputs go in
+        const int *src_a = a + offset, *src_b = b + offset, *src_c = c + offset;
+        int       *dst   = result + offset;
+        if (pinned)
+        {
+            drain_slot(s);
+            memcpy(s->h_a, src_a, bytes);
+            memcpy(s->h_b, src_b, bytes);
+            memcpy(s->h_c, src_c, bytes);
+            src_a = s->h_a;
+            src_b = s->h_b;
+            src_c = s->h_c;
+            dst   = s->h_result;
+        }
+
+        err = clEnqueueWriteBuffer(upload, s->d_a, CL_FALSE, 0, bytes, src_a, num_wait, num_wait ? &wait : NULL, NULL);
+        checkError(err, "Streaming a chunk to d_a");
+        err = clEnqueueWriteBuffer(upload, s->d_b, CL_FALSE, 0, bytes, src_b, 0, NULL, NULL);
+        checkError(err, "Streaming b chunk to d_b");
+        release_event(&s->uploaded);
+        err = clEnqueueWriteBuffer(upload, s->d_c, CL_FALSE, 0, bytes, src_c, 0, NULL, &s->uploaded);
+        checkError(err, "Streaming c chunk to d_c");
+
+        // Kernel arguments are captured at enqueue time, so the same kernel
+        // object can be pointed at a different slot for every chunk
+        err  = clSetKernelArg(kernel_cuboid_area, 0, sizeof(cl_mem), &s->d_a);
+        err |= clSetKernelArg(kernel_cuboid_area, 1, sizeof(cl_mem), &s->d_b);
+        err |= clSetKernelArg(kernel_cuboid_area, 2, sizeof(cl_mem), &s->d_c);
+        err |= clSetKernelArg(kernel_cuboid_area, 3, sizeof(cl_mem), &s->d_result);
+        cl_uint elements = (cl_uint) count;
+        err |= clSetKernelArg(kernel_cuboid_area, 4, sizeof(cl_uint), &elements);
+        checkError(err, "Setting stream kernel arguments");
+
+        release_event(&s->computed);
+        err = clEnqueueNDRangeKernel(compute, kernel_cuboid_area, 1, NULL, &count, NULL, 1, &s->uploaded, &s->computed);
+        checkError(err, "Enqueueing stream kernel");
+
+        release_event(&s->downloaded);
+        err = clEnqueueReadBuffer(download, s->d_result, CL_FALSE, 0, bytes, dst, 1, &s->computed, &s->downloaded);
+        checkError(err, "Streaming result chunk from d_result");
+        if (pinned)
+        {
+            s->target = result + offset;
+            s->staged = count;
+        }
+
+        telemetry_add(TELEMETRY_BYTES_TO_DEVICE, 3 * bytes);
+        telemetry_add(TELEMETRY_BYTES_FROM_DEVICE, bytes);
+        telemetry_add(TELEMETRY_ELEMENTS, count);
+        telemetry_add(TELEMETRY_KERNELS, 1);
+
+        // Make sure every stage is submitted before going on to the next chunk
+        clFlush(upload);
+        clFlush(compute);
+        clFlush(download);
+    }
+
+    err  = clFinish(upload);
+    err |= clFinish(compute);
+    err |= clFinish(download);
+    checkError(err, "Waiting for stream to finish");
+
+    for (int s = 0; s < STREAM_DEPTH; s++)
+        drain_slot(&slot[s]);
+
+    stream_time = wtime() - stream_time;
+
+    for (int s = 0; s < STREAM_DEPTH; s++)
+    {
+        release_event(&slot[s].uploaded);
+        release_event(&slot[s].computed);
+        release_event(&slot[s].downloaded);
+        clReleaseMemObject(slot[s].d_a);
+        clReleaseMemObject(slot[s].d_b);
+        clReleaseMemObject(slot[s].d_c);
+        clReleaseMemObject(slot[s].d_result);
+        pinned_free(&slot[s].staging);
+    }
+    clReleaseCommandQueue(upload);
+    clReleaseCommandQueue(compute);
+    clReleaseCommandQueue(download);
+
+    return stream_time;
+}
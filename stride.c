@@ -0,0 +1,178 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Grid-stride launch of the copy path for very large inputs
+//
+//             cuboid_area launches one work-item per cuboid and indexes with
+//             a 32-bit uint, so one launch stops at UINT_MAX cuboids and a
+//             huge range is mostly scheduling work. cuboid_area_stride
+//             instead runs a fixed NDRange of compute units x
+//             STRIDE_GROUPS_PER_CU work-groups, enough resident groups to
+//             hide memory latency, and every work-item loops over the range
+//             one NDRange apart with 64-bit indices. One launch then covers
+//             any buffer the device can allocate.
+//
+//             After the results are read back, both kernels are timed on the
+//             same device buffers, best of STRIDE_RUNS profiled runs each, so
+//             every device class reports which launch suits it.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+// Work-groups per compute unit, and the largest work-group used when the
+// launch configuration leaves the size to us
+#define STRIDE_GROUPS_PER_CU 8
+#define STRIDE_LOCAL_MAX     256
+
+#define STRIDE_RUNS 3
+
+// Best kernel time of STRIDE_RUNS runs after one warmup
+static double time_kernel(cl_command_queue commands, cl_kernel kernel, size_t global, size_t local)
+{
+    int err;
+    double best = 0.0;
+
+    for (int run = -1; run < STRIDE_RUNS; run++)
+    {
+        cl_event event;
+        cl_ulong start, end;
+
+        err = clEnqueueNDRangeKernel(commands, kernel, 1, NULL, &global, &local, 0, NULL, &event);
+        checkError(err, "Enqueueing timed kernel");
+        err = clWaitForEvents(1, &event);
+        checkError(err, "Waiting for timed kernel");
+
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+        clReleaseEvent(event);
+
+        double seconds = (end - start) * 1.0e-9;
+        if (run >= 0 && (best == 0.0 || seconds < best))
+            best = seconds;
+    }
+
+    return best;
+}
+
+static void set_arguments(cl_kernel kernel, cl_mem d_a, cl_mem d_b, cl_mem d_c, cl_mem d_result)
+{
+    int err;
+
+    err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_a);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_b);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_c);
+    err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_result);
+    checkError(err, "Setting grid-stride kernel arguments");
+}
+
+//------------------------------------------------------------------------------
+
+double run_stride(cl_context context, cl_device_id device_id, cl_command_queue commands, cl_program program,
+                  const int *a, const int *b, const int *c, int *result, size_t length, size_t local,
+                  struct stride_report *report, double *total_time)
+{
+    int err;
+
+    size_t bytes = sizeof(cl_int) * length;
+
+    cl_kernel kernel_stride = clCreateKernel(program, "cuboid_area_stride", &err);
+    checkError(err, "Creating grid-stride kernel");
+
+    // Size the NDRange to the device, never past the rounded-up range
+    if (local == 0)
+    {
+        err = clGetKernelWorkGroupInfo(kernel_stride, device_id, CL_KERNEL_WORK_GROUP_SIZE,
+                                       sizeof(size_t), &local, NULL);
+        checkError(err, "Getting grid-stride work-group size");
+        if (local > STRIDE_LOCAL_MAX)
+            local = STRIDE_LOCAL_MAX;
+    }
+
+    cl_uint units;
+    err = clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &units, NULL);
+    checkError(err, "Getting compute units");
+
+    size_t groups = (size_t) units * STRIDE_GROUPS_PER_CU;
+    size_t needed = (length + local - 1) / local;
+    if (groups > needed)
+        groups = needed;
+
+    report->compute_units = units;
+    report->groups        = groups;
+    report->local         = local;
+    report->global        = groups * local;
+    report->item_time     = 0.0;
+
+    cl_mem d_a = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_a");
+    cl_mem d_b = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_b");
+    cl_mem d_c = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_c");
+    cl_mem d_result = clCreateBuffer(context, CL_MEM_WRITE_ONLY, bytes, NULL, &err);
+    checkError(err, "Creating buffer d_result");
+
+    *total_time = wtime();
+
+    err  = clEnqueueWriteBuffer(commands, d_a, CL_TRUE, 0, bytes, a, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(commands, d_b, CL_TRUE, 0, bytes, b, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(commands, d_c, CL_TRUE, 0, bytes, c, 0, NULL, NULL);
+    checkError(err, "Copying the inputs to the device");
+
+    set_arguments(kernel_stride, d_a, d_b, d_c, d_result);
+    cl_ulong n = length;
+    err = clSetKernelArg(kernel_stride, 4, sizeof(cl_ulong), &n);
+    checkError(err, "Setting grid-stride kernel arguments");
+
+    double cl_time = wtime();
+
+    err = clEnqueueNDRangeKernel(commands, kernel_stride, 1, NULL, &report->global, &local, 0, NULL, NULL);
+    checkError(err, "Enqueueing grid-stride kernel");
+    err = clFinish(commands);
+    checkError(err, "Waiting for grid-stride kernel to finish");
+
+    cl_time = wtime() - cl_time;
+    printf("\nThe OpenCL kernel ran in %lf seconds (grid-stride)\n", cl_time);
+
+    err = clEnqueueReadBuffer(commands, d_result, CL_TRUE, 0, bytes, result, 0, NULL, NULL);
+    checkError(err, "Reading back d_result");
+
+    *total_time = wtime() - *total_time;
+
+    telemetry_add(TELEMETRY_BYTES_TO_DEVICE, 3 * bytes);
+    telemetry_add(TELEMETRY_BYTES_FROM_DEVICE, bytes);
+    telemetry_add(TELEMETRY_ELEMENTS, length);
+    telemetry_add(TELEMETRY_KERNELS, 1);
+
+    // The comparison rewrites the same results, nothing is read back
+    report->stride_time = time_kernel(commands, kernel_stride, report->global, local);
+
+    if (length <= UINT_MAX)
+    {
+        cl_kernel kernel_item = clCreateKernel(program, "cuboid_area", &err);
+        checkError(err, "Creating kernel");
+
+        set_arguments(kernel_item, d_a, d_b, d_c, d_result);
+        cl_uint items = (cl_uint) length;
+        err = clSetKernelArg(kernel_item, 4, sizeof(cl_uint), &items);
+        checkError(err, "Setting kernel arguments");
+
+        report->item_time = time_kernel(commands, kernel_item, needed * local, local);
+        clReleaseKernel(kernel_item);
+    }
+
+    clReleaseMemObject(d_a);
+    clReleaseMemObject(d_b);
+    clReleaseMemObject(d_c);
+    clReleaseMemObject(d_result);
+    clReleaseKernel(kernel_stride);
+
+    return cl_time;
+}
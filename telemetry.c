@@ -0,0 +1,305 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Process-wide counters and stage latency histograms, exported
+//             in the Prometheus text format or as JSON snapshots
+//
+//             Every update is one relaxed atomic add on a static counter, so
+//             the hot paths take no lock and the counters can stay on under
+//             full load. Latencies go into TELEMETRY_BUCKETS power-of-two
+//             buckets from 1 us up, plus one for everything slower.
+//
+//             telemetry_start() writes a snapshot every `interval` ms from a
+//             background thread and a last one when the process exits, also
+//             after a fatal checkError(). Prometheus snapshots replace the
+//             file through a rename, so a textfile collector never reads a
+//             partial one; JSON snapshots are appended one per line.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cuboid.h"
+
+//------------------------------------------------------------------------------
+
+#define tm_add(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define tm_load(p)   __atomic_load_n(p, __ATOMIC_RELAXED)
+
+struct telemetry_metric {
+    const char *name;
+    const char *type;       // Prometheus type, "counter" or "gauge"
+    const char *help;
+};
+
+static const struct telemetry_metric metric_info[TELEMETRY_COUNTERS] = {
+    { "bytes_to_device_total",   "counter", "Bytes written to device buffers" },
+    { "bytes_from_device_total", "counter", "Bytes read back from device buffers" },
+    { "elements_total",          "counter", "Cuboids computed on the device" },
+    { "kernels_total",           "counter", "Kernel launches" },
+    { "cache_hits_total",        "counter", "Programs loaded from the binary cache" },
+    { "cache_misses_total",      "counter", "Programs built from source" },
+    { "device_errors_total",     "counter", "OpenCL calls that returned an error" },
+    { "pool_bytes_in_use",       "gauge",   "Bytes of the device arena handed out" },
+    { "pool_bytes_capacity",     "gauge",   "Bytes of the device arena" },
+};
+
+static const char *stage_names[TELEMETRY_STAGES] = {
+    "write", "kernel", "read", "generate", "chunk", "batch"
+};
+
+struct telemetry_histogram {
+    cl_ulong bucket[TELEMETRY_BUCKETS + 1];   // the last one has no upper bound
+    cl_ulong count;
+    cl_ulong sum_ns;
+};
+
+static cl_ulong counters[TELEMETRY_COUNTERS];
+static struct telemetry_histogram stages[TELEMETRY_STAGES];
+
+// Export state, only touched off the hot path
+static struct {
+    pthread_mutex_t lock;
+    const char     *path;
+    enum telemetry_format format;
+    unsigned        interval_ms;
+    double          started;
+    int             stopped;
+} exporter = { PTHREAD_MUTEX_INITIALIZER, NULL, TELEMETRY_PROMETHEUS, 0, 0.0, 0 };
+
+//------------------------------------------------------------------------------
+
+void telemetry_add(enum telemetry_counter counter, cl_ulong value)
+{
+    tm_add(&counters[counter], value);
+}
+
+void telemetry_set(enum telemetry_counter counter, cl_ulong value)
+{
+    __atomic_store_n(&counters[counter], value, __ATOMIC_RELAXED);
+}
+
+void telemetry_observe_ns(enum telemetry_stage stage, cl_ulong ns)
+{
+    // Bucket k holds latencies below 2^k us
+    cl_ulong us = ns / 1000;
+    int k = 0;
+    while (k < TELEMETRY_BUCKETS && us >= ((cl_ulong) 1 << k))
+        k++;
+
+    tm_add(&stages[stage].bucket[k], 1);
+    tm_add(&stages[stage].count, 1);
+    tm_add(&stages[stage].sum_ns, ns);
+}
+
+void telemetry_observe(enum telemetry_stage stage, double seconds)
+{
+    telemetry_observe_ns(stage, seconds > 0.0 ? (cl_ulong) (seconds * 1.0e9) : 0);
+}
+
+void telemetry_error(cl_int err)
+{
+    if (err != CL_SUCCESS)
+        tm_add(&counters[TELEMETRY_DEVICE_ERRORS], 1);
+}
+
+//------------------------------------------------------------------------------
+
+// Upper bound of bucket k in seconds
+static double bucket_bound(int k)
+{
+    return (double) ((cl_ulong) 1 << k) * 1.0e-6;
+}
+
+// Upper bound of the bucket holding quantile q, 0 without observations.
+// Latencies past the last bucket report its bound.
+static double quantile(const cl_ulong *bucket, cl_ulong count, double q)
+{
+    if (count == 0)
+        return 0.0;
+
+    cl_ulong rank = (cl_ulong) (q * count), seen = 0;
+    for (int k = 0; k < TELEMETRY_BUCKETS; k++)
+    {
+        seen += bucket[k];
+        if (seen > rank)
+            return bucket_bound(k);
+    }
+
+    return bucket_bound(TELEMETRY_BUCKETS);
+}
+
+static void write_prometheus(FILE *out, const cl_ulong *value, const struct telemetry_histogram *h,
+                             double uptime)
+{
+    for (int i = 0; i < TELEMETRY_COUNTERS; i++)
+    {
+        fprintf(out, "# HELP cuboid_%s %s\n", metric_info[i].name, metric_info[i].help);
+        fprintf(out, "# TYPE cuboid_%s %s\n", metric_info[i].name, metric_info[i].type);
+        fprintf(out, "cuboid_%s %llu\n", metric_info[i].name, (unsigned long long) value[i]);
+    }
+
+    fprintf(out, "# HELP cuboid_uptime_seconds Seconds since telemetry started\n");
+    fprintf(out, "# TYPE cuboid_uptime_seconds gauge\n");
+    fprintf(out, "cuboid_uptime_seconds %.6f\n", uptime);
+    fprintf(out, "# HELP cuboid_elements_per_second Cuboids per second since telemetry started\n");
+    fprintf(out, "# TYPE cuboid_elements_per_second gauge\n");
+    fprintf(out, "cuboid_elements_per_second %.3f\n",
+            uptime > 0.0 ? value[TELEMETRY_ELEMENTS] / uptime : 0.0);
+
+    fprintf(out, "# HELP cuboid_stage_seconds Latency of each device stage\n");
+    fprintf(out, "# TYPE cuboid_stage_seconds histogram\n");
+    for (int s = 0; s < TELEMETRY_STAGES; s++)
+    {
+        // Prometheus buckets are cumulative
+        cl_ulong cumulative = 0;
+        for (int k = 0; k < TELEMETRY_BUCKETS; k++)
+        {
+            cumulative += h[s].bucket[k];
+            fprintf(out, "cuboid_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                    stage_names[s], bucket_bound(k), (unsigned long long) cumulative);
+        }
+        cumulative += h[s].bucket[TELEMETRY_BUCKETS];
+        fprintf(out, "cuboid_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                stage_names[s], (unsigned long long) cumulative);
+        fprintf(out, "cuboid_stage_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[s], h[s].sum_ns * 1.0e-9);
+        fprintf(out, "cuboid_stage_seconds_count{stage=\"%s\"} %llu\n",
+                stage_names[s], (unsigned long long) h[s].count);
+    }
+}
+
+static void write_json(FILE *out, const cl_ulong *value, const struct telemetry_histogram *h, double uptime)
+{
+    fprintf(out, "{\"time\":%lld,\"uptime_seconds\":%.6f,\"counters\":{", (long long) time(NULL), uptime);
+    for (int i = 0; i < TELEMETRY_COUNTERS; i++)
+        fprintf(out, "%s\"%s\":%llu", i ? "," : "", metric_info[i].name, (unsigned long long) value[i]);
+    fprintf(out, "},\"elements_per_second\":%.3f,\"stages\":{",
+            uptime > 0.0 ? value[TELEMETRY_ELEMENTS] / uptime : 0.0);
+
+    for (int s = 0; s < TELEMETRY_STAGES; s++)
+    {
+        fprintf(out, "%s\"%s\":{\"count\":%llu,\"sum_seconds\":%.9f,\"p50_seconds\":%g,\"p99_seconds\":%g,"
+                     "\"buckets\":[", s ? "," : "", stage_names[s], (unsigned long long) h[s].count,
+                h[s].sum_ns * 1.0e-9, quantile(h[s].bucket, h[s].count, 0.50),
+                quantile(h[s].bucket, h[s].count, 0.99));
+        for (int k = 0; k <= TELEMETRY_BUCKETS; k++)
+            fprintf(out, "%s%llu", k ? "," : "", (unsigned long long) h[s].bucket[k]);
+        fprintf(out, "]}");
+    }
+    fprintf(out, "}}\n");
+}
+
+void telemetry_write(FILE *out, enum telemetry_format format)
+{
+    // One relaxed pass over the counters; a snapshot taken under load may be
+    // off by the updates that raced with it, never torn within a counter
+    cl_ulong value[TELEMETRY_COUNTERS];
+    struct telemetry_histogram h[TELEMETRY_STAGES];
+
+    for (int i = 0; i < TELEMETRY_COUNTERS; i++)
+        value[i] = tm_load(&counters[i]);
+    for (int s = 0; s < TELEMETRY_STAGES; s++)
+    {
+        for (int k = 0; k <= TELEMETRY_BUCKETS; k++)
+            h[s].bucket[k] = tm_load(&stages[s].bucket[k]);
+        h[s].count  = tm_load(&stages[s].count);
+        h[s].sum_ns = tm_load(&stages[s].sum_ns);
+    }
+
+    double uptime = exporter.started > 0.0 ? wtime() - exporter.started : 0.0;
+
+    if (format == TELEMETRY_JSON)
+        write_json(out, value, h, uptime);
+    else
+        write_prometheus(out, value, h, uptime);
+    fflush(out);
+}
+
+//------------------------------------------------------------------------------
+
+// Writes one snapshot to the configured path; the caller holds the lock
+static void export_snapshot(void)
+{
+    if (strcmp(exporter.path, "-") == 0)
+    {
+        telemetry_write(stdout, exporter.format);
+        return;
+    }
+
+    if (exporter.format == TELEMETRY_JSON)
+    {
+        FILE *out = fopen(exporter.path, "a");
+        if (out == NULL)
+            return;
+        telemetry_write(out, exporter.format);
+        fclose(out);
+        return;
+    }
+
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", exporter.path);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL)
+        return;
+    telemetry_write(out, exporter.format);
+    if (fclose(out) == 0)
+        rename(tmp, exporter.path);
+}
+
+static void *telemetry_thread(void *arg)
+{
+    (void) arg;
+
+    struct timespec pause;
+    pause.tv_sec  = exporter.interval_ms / 1000;
+    pause.tv_nsec = (long) (exporter.interval_ms % 1000) * 1000000L;
+
+    for (;;)
+    {
+        nanosleep(&pause, NULL);
+
+        pthread_mutex_lock(&exporter.lock);
+        int stopped = exporter.stopped;
+        if (!stopped)
+            export_snapshot();
+        pthread_mutex_unlock(&exporter.lock);
+
+        if (stopped)
+            return NULL;
+    }
+}
+
+static void telemetry_exit(void)
+{
+    pthread_mutex_lock(&exporter.lock);
+    if (!exporter.stopped)
+    {
+        export_snapshot();
+        exporter.stopped = 1;
+    }
+    pthread_mutex_unlock(&exporter.lock);
+}
+
+void telemetry_start(const char *path, enum telemetry_format format, unsigned interval_ms)
+{
+    exporter.path        = path;
+    exporter.format      = format;
+    exporter.interval_ms = interval_ms;
+    exporter.started     = wtime();
+
+    atexit(telemetry_exit);
+
+    if (interval_ms > 0)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, telemetry_thread, NULL) != 0)
+        {
+            printf("Error: cannot start the telemetry thread\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+}
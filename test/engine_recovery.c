@@ -0,0 +1,100 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Test of a job that survives its device (fake_opencl.c)
+//
+//             The device is lost part way through a cuboid_engine_run(), and
+//             recreating the engine then fails to build the program. The
+//             failed cuboid_engine_create() must come back with the error,
+//             not exit, and the job must finish on the CPU engine with the
+//             same results as cpu_cuboid_area().
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cuboid.h"
+#include "cuboid_engine.h"
+#include "fake_opencl.h"
+
+#define LENGTH 100000
+#define CHUNK  10000
+#define KERNELS_BEFORE_LOSS 3
+
+static int failures = 0;
+
+static void expect(int condition, const char *what)
+{
+    if (!condition)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+int main(void)
+{
+    int *a        = (int*) malloc(LENGTH * sizeof(int));
+    int *b        = (int*) malloc(LENGTH * sizeof(int));
+    int *c        = (int*) malloc(LENGTH * sizeof(int));
+    int *result   = (int*) malloc(LENGTH * sizeof(int));
+    int *expected = (int*) malloc(LENGTH * sizeof(int));
+    if (a == NULL || b == NULL || c == NULL || result == NULL || expected == NULL)
+    {
+        printf("Error: cannot allocate %d cuboids\n", LENGTH);
+        return EXIT_FAILURE;
+    }
+
+    // Every build from source, none from a binary left by an earlier run
+    setenv("CUBOID_CACHE_DIR", "", 1);
+
+    fill_inputs(a, b, c, LENGTH, 0);
+    cpu_cuboid_area(a, b, c, expected, LENGTH);
+
+    cl_int err;
+    struct cuboid_engine *engine = cuboid_engine_create(CL_DEVICE_TYPE_ALL, 0, &err);
+    expect(engine != NULL && err == CL_SUCCESS, "the first engine is created");
+    if (engine == NULL)
+        return EXIT_FAILURE;
+
+    // The device goes away after a few chunks
+    struct cuboid_job job;
+    cuboid_job_init(&job, LENGTH, CHUNK);
+    fake_fail_kernels(KERNELS_BEFORE_LOSS, CL_DEVICE_NOT_AVAILABLE);
+
+    err = cuboid_engine_run(engine, &job, a, b, c, result, 0);
+    expect(err == CL_DEVICE_NOT_AVAILABLE, "the run stops with the device error");
+    expect(job.device_lost, "the device is lost");
+    expect(job.done == KERNELS_BEFORE_LOSS * CHUNK, "the chunks before the loss are done");
+    cuboid_engine_destroy(engine);
+
+    // Recreating the engine fails, and the caller gets to handle it
+    fake_fail_kernels(-1, CL_SUCCESS);
+    fake_fail_builds(CL_BUILD_PROGRAM_FAILURE);
+
+    engine = cuboid_engine_create(CL_DEVICE_TYPE_ALL, 0, &err);
+    expect(engine == NULL, "no engine without a program");
+    expect(err == CL_BUILD_PROGRAM_FAILURE, "the build error is returned");
+    if (engine != NULL)
+        cuboid_engine_destroy(engine);
+
+    // So the rest goes to the CPU engine
+    err = cuboid_engine_run(NULL, &job, a, b, c, result, 1);
+    expect(err == CL_SUCCESS, "the CPU engine finishes the job");
+    expect(job.done == LENGTH, "every cuboid is done");
+    expect(job.cpu_elements == LENGTH - KERNELS_BEFORE_LOSS * CHUNK, "the CPU engine took the rest");
+
+    size_t wrong = 0;
+    for (size_t i = 0; i < LENGTH; i++)
+        wrong += result[i] != expected[i];
+    expect(wrong == 0, "the results match cpu_cuboid_area()");
+
+    free(a);
+    free(b);
+    free(c);
+    free(result);
+    free(expected);
+
+    printf("engine_recovery: %s\n", failures == 0 ? "passed" : "FAILED");
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,475 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    A fake OpenCL runtime for the tests
+//
+//             Just enough of the OpenCL 1.2 API for the engine (engine.c,
+//             arena.c, program.c): one platform with one device, buffers and
+//             sub-buffers in host memory, and a cuboid_area that runs on the
+//             host when it is enqueued. Every command completes before its
+//             enqueue returns. Linked into a test executable these
+//             definitions take the place of the ICD loader's.
+//
+//             fake_fail_builds() and fake_fail_kernels() script the failures
+//             a test needs.
+//
+//------------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fake_opencl.h"
+
+//------------------------------------------------------------------------------
+
+#define FAKE_MAX_ALLOC (16 * 1024 * 1024)
+#define FAKE_ALIGN_BITS 1024
+
+struct _cl_platform_id  { int unused; };
+struct _cl_device_id    { int unused; };
+struct _cl_context      { int unused; };
+struct _cl_command_queue { int unused; };
+
+struct _cl_mem {
+    char   *data;
+    size_t  size;
+    cl_mem  parent;     // the buffer a sub-buffer is a region of
+};
+
+struct _cl_program {
+    int     built;
+};
+
+struct _cl_kernel {
+    cl_mem  buffer[4];  // a, b, c, result
+    cl_uint n;
+};
+
+struct _cl_event {
+    int     references;
+};
+
+static struct _cl_platform_id platform;
+static struct _cl_device_id   device;
+
+static cl_int build_error = CL_SUCCESS;
+static long   kernels_left = -1;
+static cl_int kernel_error = CL_SUCCESS;
+
+void fake_fail_builds(cl_int err)
+{
+    build_error = err;
+}
+
+void fake_fail_kernels(long after, cl_int err)
+{
+    kernels_left = after;
+    kernel_error = err;
+}
+
+// Every command is complete once it is enqueued
+static void complete(cl_event *event)
+{
+    if (event == NULL)
+        return;
+
+    *event = (cl_event) malloc(sizeof(struct _cl_event));
+    (*event)->references = 1;
+}
+
+//------------------------------------------------------------------------------
+// Platform, device, context and queue
+
+cl_int clGetPlatformIDs(cl_uint num_entries, cl_platform_id *platforms, cl_uint *num_platforms)
+{
+    if (platforms != NULL && num_entries > 0)
+        platforms[0] = &platform;
+    if (num_platforms != NULL)
+        *num_platforms = 1;
+    return CL_SUCCESS;
+}
+
+cl_int clGetDeviceIDs(cl_platform_id p, cl_device_type type, cl_uint num_entries, cl_device_id *devices,
+                      cl_uint *num_devices)
+{
+    (void) p;
+    (void) type;
+
+    if (devices != NULL && num_entries > 0)
+        devices[0] = &device;
+    if (num_devices != NULL)
+        *num_devices = 1;
+    return CL_SUCCESS;
+}
+
+cl_int clGetDeviceInfo(cl_device_id d, cl_device_info param, size_t size, void *value, size_t *size_ret)
+{
+    (void) d;
+
+    if (param == CL_DEVICE_NAME || param == CL_DRIVER_VERSION)
+    {
+        const char *text = param == CL_DEVICE_NAME ? "Fake device" : "0.0";
+        if (value != NULL && size > strlen(text))
+            strcpy((char*) value, text);
+        if (size_ret != NULL)
+            *size_ret = strlen(text) + 1;
+        return CL_SUCCESS;
+    }
+    if (param == CL_DEVICE_MAX_MEM_ALLOC_SIZE && size >= sizeof(cl_ulong))
+    {
+        *(cl_ulong*) value = FAKE_MAX_ALLOC;
+        return CL_SUCCESS;
+    }
+    if (param == CL_DEVICE_MEM_BASE_ADDR_ALIGN && size >= sizeof(cl_uint))
+    {
+        *(cl_uint*) value = FAKE_ALIGN_BITS;
+        return CL_SUCCESS;
+    }
+
+    return CL_INVALID_VALUE;
+}
+
+cl_context clCreateContext(const cl_context_properties *properties, cl_uint num_devices,
+                           const cl_device_id *devices,
+                           void (CL_CALLBACK *notify)(const char*, const void*, size_t, void*),
+                           void *user_data, cl_int *err)
+{
+    (void) properties;
+    (void) num_devices;
+    (void) devices;
+    (void) notify;
+    (void) user_data;
+
+    *err = CL_SUCCESS;
+    return (cl_context) malloc(sizeof(struct _cl_context));
+}
+
+cl_int clReleaseContext(cl_context context)
+{
+    free(context);
+    return CL_SUCCESS;
+}
+
+cl_command_queue clCreateCommandQueue(cl_context context, cl_device_id d, cl_command_queue_properties properties,
+                                      cl_int *err)
+{
+    (void) context;
+    (void) d;
+    (void) properties;
+
+    *err = CL_SUCCESS;
+    return (cl_command_queue) malloc(sizeof(struct _cl_command_queue));
+}
+
+cl_int clReleaseCommandQueue(cl_command_queue commands)
+{
+    free(commands);
+    return CL_SUCCESS;
+}
+
+cl_int clFlush(cl_command_queue commands)
+{
+    (void) commands;
+    return CL_SUCCESS;
+}
+
+cl_int clFinish(cl_command_queue commands)
+{
+    (void) commands;
+    return CL_SUCCESS;
+}
+
+//------------------------------------------------------------------------------
+// Buffers
+
+cl_mem clCreateBuffer(cl_context context, cl_mem_flags flags, size_t size, void *host, cl_int *err)
+{
+    (void) context;
+    (void) flags;
+    (void) host;
+
+    cl_mem mem = (cl_mem) calloc(1, sizeof(struct _cl_mem));
+    if (mem != NULL)
+        mem->data = (char*) calloc(size, 1);
+    if (mem == NULL || mem->data == NULL)
+    {
+        free(mem);
+        *err = CL_OUT_OF_HOST_MEMORY;
+        return NULL;
+    }
+
+    mem->size = size;
+    *err = CL_SUCCESS;
+    return mem;
+}
+
+cl_mem clCreateSubBuffer(cl_mem buffer, cl_mem_flags flags, cl_buffer_create_type type, const void *info,
+                         cl_int *err)
+{
+    (void) flags;
+    (void) type;
+
+    const cl_buffer_region *region = (const cl_buffer_region*) info;
+    if (region->origin + region->size > buffer->size)
+    {
+        *err = CL_INVALID_VALUE;
+        return NULL;
+    }
+
+    cl_mem mem = (cl_mem) calloc(1, sizeof(struct _cl_mem));
+    mem->data   = buffer->data + region->origin;
+    mem->size   = region->size;
+    mem->parent = buffer;
+    *err = CL_SUCCESS;
+    return mem;
+}
+
+cl_int clReleaseMemObject(cl_mem mem)
+{
+    if (mem->parent == NULL)
+        free(mem->data);
+    free(mem);
+    return CL_SUCCESS;
+}
+
+cl_int clEnqueueWriteBuffer(cl_command_queue commands, cl_mem mem, cl_bool blocking, size_t offset, size_t size,
+                            const void *host, cl_uint num_events, const cl_event *wait, cl_event *event)
+{
+    (void) commands;
+    (void) blocking;
+    (void) num_events;
+    (void) wait;
+
+    if (offset + size > mem->size)
+        return CL_INVALID_VALUE;
+
+    memcpy(mem->data + offset, host, size);
+    complete(event);
+    return CL_SUCCESS;
+}
+
+cl_int clEnqueueReadBuffer(cl_command_queue commands, cl_mem mem, cl_bool blocking, size_t offset, size_t size,
+                           void *host, cl_uint num_events, const cl_event *wait, cl_event *event)
+{
+    (void) commands;
+    (void) blocking;
+    (void) num_events;
+    (void) wait;
+
+    if (offset + size > mem->size)
+        return CL_INVALID_VALUE;
+
+    memcpy(host, mem->data + offset, size);
+    complete(event);
+    return CL_SUCCESS;
+}
+
+void *clEnqueueMapBuffer(cl_command_queue commands, cl_mem mem, cl_bool blocking, cl_map_flags flags,
+                         size_t offset, size_t size, cl_uint num_events, const cl_event *wait, cl_event *event,
+                         cl_int *err)
+{
+    (void) commands;
+    (void) blocking;
+    (void) flags;
+    (void) size;
+    (void) num_events;
+    (void) wait;
+
+    complete(event);
+    *err = CL_SUCCESS;
+    return mem->data + offset;
+}
+
+cl_int clEnqueueUnmapMemObject(cl_command_queue commands, cl_mem mem, void *ptr, cl_uint num_events,
+                               const cl_event *wait, cl_event *event)
+{
+    (void) commands;
+    (void) mem;
+    (void) ptr;
+    (void) num_events;
+    (void) wait;
+
+    complete(event);
+    return CL_SUCCESS;
+}
+
+//------------------------------------------------------------------------------
+// Programs and kernels
+
+cl_program clCreateProgramWithSource(cl_context context, cl_uint count, const char **strings,
+                                     const size_t *lengths, cl_int *err)
+{
+    (void) context;
+    (void) count;
+    (void) strings;
+    (void) lengths;
+
+    *err = CL_SUCCESS;
+    return (cl_program) calloc(1, sizeof(struct _cl_program));
+}
+
+cl_program clCreateProgramWithBinary(cl_context context, cl_uint num_devices, const cl_device_id *devices,
+                                     const size_t *lengths, const unsigned char **binaries, cl_int *status,
+                                     cl_int *err)
+{
+    (void) context;
+    (void) num_devices;
+    (void) devices;
+    (void) lengths;
+    (void) binaries;
+
+    // There is no binary format, every build is from source
+    if (status != NULL)
+        *status = CL_INVALID_BINARY;
+    *err = CL_INVALID_BINARY;
+    return NULL;
+}
+
+cl_int clBuildProgram(cl_program program, cl_uint num_devices, const cl_device_id *devices, const char *options,
+                      void (CL_CALLBACK *notify)(cl_program, void*), void *user_data)
+{
+    (void) num_devices;
+    (void) devices;
+    (void) options;
+    (void) notify;
+    (void) user_data;
+
+    program->built = build_error == CL_SUCCESS;
+    return build_error;
+}
+
+cl_int clGetProgramBuildInfo(cl_program program, cl_device_id d, cl_program_build_info param, size_t size,
+                             void *value, size_t *size_ret)
+{
+    (void) program;
+    (void) d;
+    (void) param;
+
+    const char *log = "fake: build failure injected by the test";
+    if (value != NULL && size > strlen(log))
+        strcpy((char*) value, log);
+    if (size_ret != NULL)
+        *size_ret = strlen(log) + 1;
+    return CL_SUCCESS;
+}
+
+cl_int clGetProgramInfo(cl_program program, cl_program_info param, size_t size, void *value, size_t *size_ret)
+{
+    (void) program;
+    (void) param;
+    (void) size;
+    (void) value;
+    (void) size_ret;
+
+    return CL_INVALID_VALUE;
+}
+
+cl_int clReleaseProgram(cl_program program)
+{
+    free(program);
+    return CL_SUCCESS;
+}
+
+cl_kernel clCreateKernel(cl_program program, const char *name, cl_int *err)
+{
+    (void) name;
+
+    if (!program->built)
+    {
+        *err = CL_INVALID_PROGRAM_EXECUTABLE;
+        return NULL;
+    }
+
+    *err = CL_SUCCESS;
+    return (cl_kernel) calloc(1, sizeof(struct _cl_kernel));
+}
+
+cl_int clReleaseKernel(cl_kernel kernel)
+{
+    free(kernel);
+    return CL_SUCCESS;
+}
+
+// The arguments of cuboid_area: a, b, c, result and the element count
+cl_int clSetKernelArg(cl_kernel kernel, cl_uint index, size_t size, const void *value)
+{
+    if (index < 4 && size == sizeof(cl_mem))
+        kernel->buffer[index] = *(const cl_mem*) value;
+    else if (index == 4 && size == sizeof(cl_uint))
+        kernel->n = *(const cl_uint*) value;
+    else
+        return CL_INVALID_ARG_INDEX;
+    return CL_SUCCESS;
+}
+
+cl_int clEnqueueNDRangeKernel(cl_command_queue commands, cl_kernel kernel, cl_uint dims, const size_t *offset,
+                              const size_t *global, const size_t *local, cl_uint num_events,
+                              const cl_event *wait, cl_event *event)
+{
+    (void) commands;
+    (void) dims;
+    (void) offset;
+    (void) local;
+    (void) num_events;
+    (void) wait;
+
+    if (kernels_left == 0)
+        return kernel_error;
+    if (kernels_left > 0)
+        kernels_left--;
+
+    const cl_int *a = (const cl_int*) kernel->buffer[0]->data;
+    const cl_int *b = (const cl_int*) kernel->buffer[1]->data;
+    const cl_int *c = (const cl_int*) kernel->buffer[2]->data;
+    cl_int *result  = (cl_int*) kernel->buffer[3]->data;
+
+    for (size_t i = 0; i < *global && i < kernel->n; i++)
+        result[i] = 2 * (a[i] * b[i] + b[i] * c[i] + a[i] * c[i]);
+
+    complete(event);
+    return CL_SUCCESS;
+}
+
+//------------------------------------------------------------------------------
+// Events
+
+cl_int clWaitForEvents(cl_uint num_events, const cl_event *events)
+{
+    (void) num_events;
+    (void) events;
+    return CL_SUCCESS;
+}
+
+cl_int clGetEventInfo(cl_event event, cl_event_info param, size_t size, void *value, size_t *size_ret)
+{
+    (void) event;
+
+    if (param != CL_EVENT_COMMAND_EXECUTION_STATUS || size < sizeof(cl_int))
+        return CL_INVALID_VALUE;
+
+    *(cl_int*) value = CL_COMPLETE;
+    if (size_ret != NULL)
+        *size_ret = sizeof(cl_int);
+    return CL_SUCCESS;
+}
+
+cl_int clSetEventCallback(cl_event event, cl_int type, void (CL_CALLBACK *notify)(cl_event, cl_int, void*),
+                          void *user_data)
+{
+    (void) type;
+
+    notify(event, CL_COMPLETE, user_data);
+    return CL_SUCCESS;
+}
+
+cl_int clRetainEvent(cl_event event)
+{
+    event->references++;
+    return CL_SUCCESS;
+}
+
+cl_int clReleaseEvent(cl_event event)
+{
+    if (--event->references == 0)
+        free(event);
+    return CL_SUCCESS;
+}
@@ -0,0 +1,19 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+// Failures the fake OpenCL runtime (fake_opencl.c) injects for a test
+//
+//------------------------------------------------------------------------------
+
+#if defined(__APPLE__) || defined(__MACOSX)
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+// clBuildProgram() returns err from now on, CL_SUCCESS builds again
+void fake_fail_builds(cl_int err);
+
+// clEnqueueNDRangeKernel() runs `after` more kernels and then returns err,
+// a negative `after` never fails
+void fake_fail_kernels(long after, cl_int err);
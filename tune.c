@@ -0,0 +1,229 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Launch configuration of the copy path and its auto-tuner
+//
+//             The tuner queries CL_KERNEL_WORK_GROUP_SIZE and
+//             CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE for
+//             cuboid_area_items and times every work-group size from the
+//             preferred multiple up to the maximum, doubling each time, plus
+//             the runtime's own choice, against 1, 2, 4, 8 and 16 cuboids per
+//             work-item. Kernel times come from profiling events, the best of
+//             TUNE_RUNS runs counts. The fastest configuration is written as
+//             a one-line text file next to the cached program binaries, so
+//             it follows the device name and driver version.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+#define TUNE_RUNS 3
+
+static const cl_uint tune_items[] = { 1, 2, 4, 8, 16 };
+
+size_t launch_global(const struct launch_config *lc, size_t work_items)
+{
+    if (lc->local == 0)
+        return work_items;
+
+    return (work_items + lc->local - 1) / lc->local * lc->local;
+}
+
+int tune_load(cl_device_id device_id, struct launch_config *lc)
+{
+    char path[1100];
+
+    if (cache_device_path(device_id, "tune", path, sizeof(path)) != 0)
+        return -1;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    size_t   local;
+    unsigned items;
+    int ok = fscanf(file, "local=%zu items=%u", &local, &items) == 2 && items >= 1;
+    fclose(file);
+
+    if (!ok)
+        return -1;
+
+    lc->local = local;
+    lc->items = items;
+
+    return 0;
+}
+
+static void tune_save(cl_device_id device_id, const struct launch_config *lc)
+{
+    char path[1100];
+
+    if (cache_device_path(device_id, "tune", path, sizeof(path)) != 0)
+        return;
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Warning: cannot save the tuned configuration to %s\n", path);
+        return;
+    }
+
+    fprintf(file, "local=%zu items=%u\n", lc->local, (unsigned) lc->items);
+    fclose(file);
+
+    printf("Saved to %s\n", path);
+}
+
+// Best kernel time of TUNE_RUNS runs after one warmup, or a negative value
+// when the device rejects the configuration
+static double time_config(cl_command_queue commands, cl_kernel kernel,
+                          const struct launch_config *lc, size_t length)
+{
+    int err;
+
+    size_t global = launch_global(lc, (length + lc->items - 1) / lc->items);
+    double best = -1.0;
+
+    err = clSetKernelArg(kernel, 5, sizeof(cl_uint), &lc->items);
+    checkError(err, "Setting tuner items per work-item");
+
+    for (int run = -1; run < TUNE_RUNS; run++)
+    {
+        cl_event event;
+        cl_ulong start, end;
+
+        err = clEnqueueNDRangeKernel(commands, kernel, 1, NULL, &global,
+                                     lc->local > 0 ? &lc->local : NULL, 0, NULL, &event);
+        if (err != CL_SUCCESS)
+            return -1.0;
+
+        err = clWaitForEvents(1, &event);
+        checkError(err, "Waiting for tuner kernel");
+
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+        clReleaseEvent(event);
+
+        double seconds = (end - start) * 1.0e-9;
+        if (run >= 0 && (best < 0.0 || seconds < best))
+            best = seconds;
+    }
+
+    return best;
+}
+
+//------------------------------------------------------------------------------
+
+void tune_run(cl_context context, cl_device_id device_id, cl_command_queue commands,
+              cl_program program, size_t length, struct launch_config *best)
+{
+    int err;
+
+    cl_kernel kernel = clCreateKernel(program, "cuboid_area_items", &err);
+    checkError(err, "Creating tuner kernel");
+
+    size_t max_local, multiple;
+    err  = clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE,
+                                    sizeof(size_t), &max_local, NULL);
+    err |= clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                                    sizeof(size_t), &multiple, NULL);
+    checkError(err, "Querying kernel work-group info");
+    if (multiple == 0)
+        multiple = 1;
+
+    // Keep the four buffers well inside device memory
+    cl_ulong global_mem, max_alloc;
+    err  = clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &global_mem, NULL);
+    err |= clGetDeviceInfo(device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+    checkError(err, "Querying device memory");
+
+    size_t limit = (size_t) (global_mem / 2 / (4 * sizeof(cl_int)));
+    if (limit > max_alloc / sizeof(cl_int))
+        limit = (size_t) (max_alloc / sizeof(cl_int));
+    if (length > limit)
+        length = limit;
+
+    size_t bytes = sizeof(cl_int) * length;
+
+    printf("\nTuning cuboid_area_items over %zu elements (work-group size up to %zu, preferred multiple %zu)\n",
+           length, max_local, multiple);
+
+    int *a = (int*) cpu_alloc(length, sizeof(int));
+    int *b = (int*) cpu_alloc(length, sizeof(int));
+    int *c = (int*) cpu_alloc(length, sizeof(int));
+    if (a == NULL || b == NULL || c == NULL)
+    {
+        fprintf(stderr, "Error: Failed to allocate host memory for %zu elements!\n", length);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < length; i++) {
+        a[i] = (int) (i % 9) + 1;
+        b[i] = (int) ((i / 9) % 9) + 1;
+        c[i] = (int) ((i / 81) % 9) + 1;
+    }
+
+    cl_mem d[4];
+    for (int i = 0; i < 4; i++)
+    {
+        d[i] = clCreateBuffer(context, i < 3 ? CL_MEM_READ_ONLY : CL_MEM_WRITE_ONLY, bytes, NULL, &err);
+        checkError(err, "Creating tuner buffer");
+        err = clSetKernelArg(kernel, i, sizeof(cl_mem), &d[i]);
+        checkError(err, "Setting tuner kernel arguments");
+    }
+
+    err  = clEnqueueWriteBuffer(commands, d[0], CL_FALSE, 0, bytes, a, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(commands, d[1], CL_FALSE, 0, bytes, b, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(commands, d[2], CL_TRUE, 0, bytes, c, 0, NULL, NULL);
+    checkError(err, "Copying tuner inputs");
+
+    cl_uint n = (cl_uint) length;
+    err = clSetKernelArg(kernel, 4, sizeof(cl_uint), &n);
+    checkError(err, "Setting tuner element count");
+
+    printf("\n%8s %6s %14s %10s\n", "local", "items", "kernel (s)", "GB/s");
+
+    double best_time = -1.0;
+    best->local = 0;
+    best->items = 1;
+
+    for (size_t t = 0; t < sizeof(tune_items) / sizeof(tune_items[0]); t++)
+    {
+        // 0 first: the runtime's own choice is the baseline to beat
+        for (size_t local = 0; local <= max_local; local = local == 0 ? multiple : local * 2)
+        {
+            struct launch_config lc = { local, tune_items[t] };
+
+            double seconds = time_config(commands, kernel, &lc, length);
+            if (seconds < 0.0)
+            {
+                printf("%8zu %6u %14s %10s\n", local, (unsigned) lc.items, "rejected", "-");
+                continue;
+            }
+            printf("%8zu %6u %14.6lf %10.2lf\n", local, (unsigned) lc.items, seconds,
+                   seconds > 0.0 ? 4.0 * bytes / seconds / 1.0e9 : 0.0);
+
+            if (best_time < 0.0 || seconds < best_time)
+            {
+                best_time = seconds;
+                *best = lc;
+            }
+        }
+    }
+
+    printf("\nBest launch configuration: local=%zu items=%u (%lf seconds)\n",
+           best->local, (unsigned) best->items, best_time);
+    tune_save(device_id, best);
+
+    for (int i = 0; i < 4; i++)
+        clReleaseMemObject(d[i]);
+    clReleaseKernel(kernel);
+
+    free(a);
+    free(b);
+    free(c);
+}
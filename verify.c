@@ -0,0 +1,331 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Verification of the cuboid areas without a reference array
+//
+//             Every mode recomputes the expected area from the inputs as it
+//             goes, so no second result array is kept:
+//
+//             full      compares every element on every CPU thread, each
+//                       thread over its own static block as in cpu.c
+//             sample    compares a pseudo-random sample of the elements
+//             checksum  compares one order-independent 64-bit hash: the sum
+//                       of a mix of (index, area) over all elements. The
+//                       device hashes its result buffer with cuboid_checksum,
+//                       so only one number has to be compared.
+//
+//             Full and sample report the lowest differing indices they saw.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+// Work-groups per compute unit and their size limit for cuboid_checksum
+#define CHECKSUM_GROUPS_PER_CU 8
+#define CHECKSUM_LOCAL_MAX     256
+
+// Wraps on overflow exactly like the kernels do
+static int expected_area(const int *a, const int *b, const int *c, size_t i)
+{
+    unsigned x = (unsigned) a[i], y = (unsigned) b[i], z = (unsigned) c[i];
+
+    return (int) (2u * (x * y + y * z + x * z));
+}
+
+// SplitMix64 finalizer, the same as verify_mix() in kernels.c
+static cl_ulong mix64(cl_ulong x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+
+    return x;
+}
+
+static cl_ulong checksum_term(size_t i, int value)
+{
+    return mix64(((cl_ulong) i << 32) | (cl_uint) value);
+}
+
+// Keeps the VERIFY_FIRST lowest distinct indices in report->first, sorted
+static void note_index(struct verify_report *report, size_t index)
+{
+    size_t n = report->shown;
+
+    for (size_t k = 0; k < n; k++)
+    {
+        if (report->first[k] == index)
+            return;
+    }
+
+    if (n == VERIFY_FIRST && index >= report->first[n - 1])
+        return;
+    if (n < VERIFY_FIRST)
+        report->shown++;
+    else
+        n--;
+
+    while (n > 0 && report->first[n - 1] > index)
+    {
+        report->first[n] = report->first[n - 1];
+        n--;
+    }
+    report->first[n] = index;
+}
+
+static void report_init(struct verify_report *report, enum verify_mode mode)
+{
+    report->mode       = mode;
+    report->checked    = 0;
+    report->mismatches = 0;
+    report->shown      = 0;
+    report->expected   = 0;
+    report->actual     = 0;
+    report->on_device  = 0;
+}
+
+//------------------------------------------------------------------------------
+
+void verify_full(const int *a, const int *b, const int *c, const int *result, size_t length,
+                 struct verify_report *report)
+{
+    report_init(report, VERIFY_FULL);
+    report->checked = length;
+
+    #pragma omp parallel
+    {
+#ifdef _OPENMP
+        size_t nthreads = (size_t) omp_get_num_threads();
+        size_t tid      = (size_t) omp_get_thread_num();
+#else
+        size_t nthreads = 1;
+        size_t tid      = 0;
+#endif
+        size_t begin = length * tid / nthreads;
+        size_t end   = length * (tid + 1) / nthreads;
+
+        size_t first[VERIFY_FIRST];
+        size_t found = 0;
+        size_t mismatches = 0;
+
+        for (size_t i = begin; i < end; i++)
+        {
+            if (result[i] != expected_area(a, b, c, i))
+            {
+                if (found < VERIFY_FIRST)
+                    first[found++] = i;
+                mismatches++;
+            }
+        }
+
+        #pragma omp critical
+        {
+            report->mismatches += mismatches;
+            for (size_t k = 0; k < found; k++)
+                note_index(report, first[k]);
+        }
+    }
+}
+
+void verify_sample(const int *a, const int *b, const int *c, const int *result, size_t length,
+                   size_t samples, cl_ulong seed, struct verify_report *report)
+{
+    report_init(report, VERIFY_SAMPLE);
+    report->checked = samples;
+
+    size_t mismatches = 0;
+
+    #pragma omp parallel for schedule(static) reduction(+:mismatches)
+    for (long k = 0; k < (long) samples; k++)
+    {
+        size_t i = (size_t) (mix64(seed + (cl_ulong) k) % length);
+        if (result[i] != expected_area(a, b, c, i))
+        {
+            mismatches++;
+            #pragma omp critical
+            note_index(report, i);
+        }
+    }
+
+    report->mismatches = mismatches;
+}
+
+cl_ulong host_checksum(const int *result, size_t length)
+{
+    cl_ulong sum = 0;
+
+    #pragma omp parallel for schedule(static) reduction(+:sum)
+    for (long i = 0; i < (long) length; i++)
+        sum += checksum_term((size_t) i, result[i]);
+
+    return sum;
+}
+
+void verify_checksum(const int *a, const int *b, const int *c, size_t length,
+                     cl_ulong actual, int on_device, struct verify_report *report)
+{
+    cl_ulong sum = 0;
+
+    #pragma omp parallel for schedule(static) reduction(+:sum)
+    for (long i = 0; i < (long) length; i++)
+        sum += checksum_term((size_t) i, expected_area(a, b, c, (size_t) i));
+
+    report_init(report, VERIFY_CHECKSUM);
+    report->checked    = length;
+    report->expected   = sum;
+    report->actual     = actual;
+    report->on_device  = on_device;
+    report->mismatches = sum != actual;
+}
+
+void verify_result(enum verify_mode mode, const int *a, const int *b, const int *c, const int *result,
+                   size_t length, size_t samples, struct verify_report *report)
+{
+    if (mode == VERIFY_FULL)
+        verify_full(a, b, c, result, length, report);
+    else if (mode == VERIFY_SAMPLE)
+        verify_sample(a, b, c, result, length, samples < length ? samples : length, 1, report);
+    else if (mode == VERIFY_CHECKSUM)
+        verify_checksum(a, b, c, length, host_checksum(result, length), 0, report);
+    else
+        report_init(report, VERIFY_NONE);
+}
+
+void verify_begin(struct verify_report *report, enum verify_mode mode)
+{
+    report_init(report, mode);
+}
+
+void verify_range(const int *a, const int *b, const int *c, const int *result, size_t offset, size_t count,
+                  size_t samples, struct verify_report *report)
+{
+    struct verify_report part;
+
+    if (report->mode == VERIFY_FULL)
+        verify_full(a + offset, b + offset, c + offset, result, count, &part);
+    else if (report->mode == VERIFY_SAMPLE)
+        verify_sample(a + offset, b + offset, c + offset, result, count, samples < count ? samples : count,
+                      1 + offset, &part);
+    else
+        return;
+
+    report->checked    += part.checked;
+    report->mismatches += part.mismatches;
+    for (size_t k = 0; k < part.shown; k++)
+        note_index(report, offset + part.first[k]);
+}
+
+size_t verify_print(const struct verify_report *report, const char *what)
+{
+    if (report->mode == VERIFY_NONE)
+        return 0;
+
+    if (report->mode == VERIFY_CHECKSUM)
+    {
+        if (report->mismatches == 0)
+            printf("%s: checksum %016llx of %zu results matches (%s)\n", what,
+                   (unsigned long long) report->actual, report->checked,
+                   report->on_device ? "hashed on the device" : "hashed on the host");
+        else
+            printf("Error: %s: checksum %016llx differs from the expected %016llx!\n", what,
+                   (unsigned long long) report->actual, (unsigned long long) report->expected);
+        return report->mismatches;
+    }
+
+    const char *scope = report->mode == VERIFY_FULL ? "results" : "sampled results";
+
+    // A report assembled from ranges can end up empty, that is no match
+    if (report->checked == 0)
+    {
+        printf("Error: %s: none of the %s were checked!\n", what, scope);
+        return 1;
+    }
+
+    if (report->mismatches == 0)
+    {
+        printf("%s: all %zu %s match\n", what, report->checked, scope);
+        return 0;
+    }
+
+    printf("Error: %s: %zu of %zu %s differ, first at", what, report->mismatches, report->checked, scope);
+    for (size_t k = 0; k < report->shown; k++)
+        printf(" %zu", report->first[k]);
+    printf("\n");
+
+    return report->mismatches;
+}
+
+//------------------------------------------------------------------------------
+
+cl_ulong device_checksum(cl_command_queue commands, cl_kernel kernel_checksum, cl_mem d_result, size_t length)
+{
+    int err;
+
+    cl_context   context;
+    cl_device_id device_id;
+    err  = clGetCommandQueueInfo(commands, CL_QUEUE_CONTEXT, sizeof(cl_context), &context, NULL);
+    err |= clGetCommandQueueInfo(commands, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device_id, NULL);
+    checkError(err, "Querying the checksum queue");
+
+    cl_uint comp_units;
+    err = clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &comp_units, NULL);
+    checkError(err, "Querying compute units");
+
+    // The tree in cuboid_checksum needs a power-of-two work-group
+    size_t max_local;
+    err = clGetKernelWorkGroupInfo(kernel_checksum, device_id, CL_KERNEL_WORK_GROUP_SIZE,
+                                   sizeof(size_t), &max_local, NULL);
+    checkError(err, "Querying checksum work-group size");
+
+    size_t local = 1;
+    while (local * 2 <= max_local && local * 2 <= CHECKSUM_LOCAL_MAX)
+        local *= 2;
+
+    size_t groups = (size_t) comp_units * CHECKSUM_GROUPS_PER_CU;
+    if (groups > (length + local - 1) / local)
+        groups = (length + local - 1) / local;
+    size_t global = groups * local;
+
+    cl_mem d_partial = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_ulong) * groups, NULL, &err);
+    checkError(err, "Creating buffer d_partial");
+
+    cl_uint n = (cl_uint) length;
+    err  = clSetKernelArg(kernel_checksum, 0, sizeof(cl_mem), &d_result);
+    err |= clSetKernelArg(kernel_checksum, 1, sizeof(cl_uint), &n);
+    err |= clSetKernelArg(kernel_checksum, 2, sizeof(cl_mem), &d_partial);
+    err |= clSetKernelArg(kernel_checksum, 3, sizeof(cl_ulong) * local, NULL);
+    checkError(err, "Setting checksum kernel arguments");
+
+    err = clEnqueueNDRangeKernel(commands, kernel_checksum, 1, NULL, &global, &local, 0, NULL, NULL);
+    checkError(err, "Enqueueing checksum kernel");
+
+    cl_ulong *partial = (cl_ulong*) malloc(sizeof(cl_ulong) * groups);
+    if (partial == NULL)
+    {
+        printf("Error: Failed to allocate %zu checksum partials!\n", groups);
+        exit(EXIT_FAILURE);
+    }
+
+    err = clEnqueueReadBuffer(commands, d_partial, CL_TRUE, 0, sizeof(cl_ulong) * groups, partial, 0, NULL, NULL);
+    checkError(err, "Reading checksum partials");
+
+    cl_ulong sum = 0;
+    for (size_t g = 0; g < groups; g++)
+        sum += partial[g];
+
+    free(partial);
+    clReleaseMemObject(d_partial);
+
+    return sum;
+}
@@ -0,0 +1,137 @@
+//------------------------------------------------------------------------------
+//
+// Purpose:    Zero-copy execution of the cuboid_area kernel
+//
+//             The buffers are allocated by the runtime with
+//             CL_MEM_ALLOC_HOST_PTR and accessed from the host through
+//             clEnqueueMapBuffer, so the host writes the inputs straight into
+//             device-visible memory and reads the results in place. On
+//             devices that share memory with the host (integrated GPUs,
+//             Apple Silicon) map/unmap does not copy anything.
+//
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cuboid.h"
+#include "err_code.h"
+
+//------------------------------------------------------------------------------
+
+static cl_mem create_mapped(cl_context context, cl_mem_flags flags, size_t bytes, const char *name)
+{
+    int err;
+
+    cl_mem buffer = clCreateBuffer(context, flags | CL_MEM_ALLOC_HOST_PTR, bytes, NULL, &err);
+    checkError(err, name);
+
+    return buffer;
+}
+
+static int *map(cl_command_queue commands, cl_mem buffer, cl_map_flags flags, size_t bytes, const char *name)
+{
+    int err;
+
+    int *ptr = (int *) clEnqueueMapBuffer(commands, buffer, CL_TRUE, flags, 0, bytes, 0, NULL, NULL, &err);
+    checkError(err, name);
+
+    return ptr;
+}
+
+static void unmap(cl_command_queue commands, cl_mem buffer, int **ptr, const char *name)
+{
+    int err = clEnqueueUnmapMemObject(commands, buffer, *ptr, 0, NULL, NULL);
+    checkError(err, name);
+    *ptr = NULL;
+}
+
+//------------------------------------------------------------------------------
+
+void zero_copy_create(cl_context context, cl_command_queue commands,
+                      struct zero_copy *zc, size_t length)
+{
+    size_t bytes = sizeof(cl_int) * length;
+
+    zc->length = length;
+
+    zc->d_a = create_mapped(context, CL_MEM_READ_ONLY, bytes, "Creating zero-copy buffer d_a");
+    zc->d_b = create_mapped(context, CL_MEM_READ_ONLY, bytes, "Creating zero-copy buffer d_b");
+    zc->d_c = create_mapped(context, CL_MEM_READ_ONLY, bytes, "Creating zero-copy buffer d_c");
+    zc->d_result = create_mapped(context, CL_MEM_WRITE_ONLY, bytes, "Creating zero-copy buffer d_result");
+
+    // The previous contents are irrelevant, so let the runtime skip the
+    // device to host synchronisation
+    zc->a = map(commands, zc->d_a, CL_MAP_WRITE_INVALIDATE_REGION, bytes, "Mapping d_a for writing");
+    zc->b = map(commands, zc->d_b, CL_MAP_WRITE_INVALIDATE_REGION, bytes, "Mapping d_b for writing");
+    zc->c = map(commands, zc->d_c, CL_MAP_WRITE_INVALIDATE_REGION, bytes, "Mapping d_c for writing");
+    zc->result = NULL;
+}
+
+double zero_copy_run(cl_command_queue commands, cl_kernel kernel_cuboid_area,
+                     struct zero_copy *zc, double *kernel_time)
+{
+    int err;
+
+    size_t global = zc->length;
+    size_t bytes  = sizeof(cl_int) * zc->length;
+
+    double total_time = wtime();
+
+    // Hand the filled inputs over to the device
+    unmap(commands, zc->d_a, &zc->a, "Unmapping d_a");
+    unmap(commands, zc->d_b, &zc->b, "Unmapping d_b");
+    unmap(commands, zc->d_c, &zc->c, "Unmapping d_c");
+
+    err  = clSetKernelArg(kernel_cuboid_area, 0, sizeof(cl_mem), &zc->d_a);
+    err |= clSetKernelArg(kernel_cuboid_area, 1, sizeof(cl_mem), &zc->d_b);
+    err |= clSetKernelArg(kernel_cuboid_area, 2, sizeof(cl_mem), &zc->d_c);
+    err |= clSetKernelArg(kernel_cuboid_area, 3, sizeof(cl_mem), &zc->d_result);
+    cl_uint n = (cl_uint) zc->length;
+    err |= clSetKernelArg(kernel_cuboid_area, 4, sizeof(cl_uint), &n);
+    checkError(err, "Setting zero-copy kernel arguments");
+
+    err = clFinish(commands);
+    checkError(err, "Waiting for unmap to finish");
+
+    *kernel_time = wtime();
+
+    err = clEnqueueNDRangeKernel(commands, kernel_cuboid_area, 1, NULL, &global, NULL, 0, NULL, NULL);
+    checkError(err, "Enqueueing zero-copy kernel");
+
+    err = clFinish(commands);
+    checkError(err, "Waiting for zero-copy kernel to finish");
+
+    *kernel_time = wtime() - *kernel_time;
+
+    // Read the results in place
+    zc->result = map(commands, zc->d_result, CL_MAP_READ, bytes, "Mapping d_result for reading");
+
+    total_time = wtime() - total_time;
+
+    // Give the host read access to the inputs again so they can be used for
+    // the sequential check, this is not part of the device path
+    zc->a = map(commands, zc->d_a, CL_MAP_READ, bytes, "Mapping d_a for reading");
+    zc->b = map(commands, zc->d_b, CL_MAP_READ, bytes, "Mapping d_b for reading");
+    zc->c = map(commands, zc->d_c, CL_MAP_READ, bytes, "Mapping d_c for reading");
+
+    return total_time;
+}
+
+void zero_copy_release(cl_command_queue commands, struct zero_copy *zc)
+{
+    if (zc->a != NULL)
+        unmap(commands, zc->d_a, &zc->a, "Unmapping d_a");
+    if (zc->b != NULL)
+        unmap(commands, zc->d_b, &zc->b, "Unmapping d_b");
+    if (zc->c != NULL)
+        unmap(commands, zc->d_c, &zc->c, "Unmapping d_c");
+    if (zc->result != NULL)
+        unmap(commands, zc->d_result, &zc->result, "Unmapping d_result");
+    clFinish(commands);
+
+    clReleaseMemObject(zc->d_a);
+    clReleaseMemObject(zc->d_b);
+    clReleaseMemObject(zc->d_c);
+    clReleaseMemObject(zc->d_result);
+}